@@ -0,0 +1,26 @@
+// Client shim of a HorseWhisperer command server: forwards its command
+// line, environment, working directory and stdio to the server and
+// exits with the exit code of the command. Compile with:
+//     g++ -std=c++11 -pthread client_shim.cpp -o client_shim
+// and run as:
+//     HORSEWHISPERER_SOCKET=/tmp/myprog.sock ./client_shim gallop --ponies 2
+
+#include "../include/horsewhisperer/server.h"
+
+#include <cstdlib>
+#include <iostream>
+
+int main(int argc, char* argv[]) {
+    const char* socket_path = std::getenv("HORSEWHISPERER_SOCKET");
+    if (!socket_path) {
+        std::cerr << "HORSEWHISPERER_SOCKET is not set\n";
+        return 1;
+    }
+
+    int exit_code = HorseWhisperer::ForwardToServer(socket_path, argc, argv);
+    if (exit_code < 0) {
+        std::cerr << "Failed to reach the server at " << socket_path << "\n";
+        return 1;
+    }
+    return exit_code;
+}
@@ -5,7 +5,7 @@
     Basic usage of the Horse Whisperer
 
     Compile with:
-        c++ -std=c++11 example1.cpp -o example
+        c++ -std=c++11 -pthread example1.cpp -o example
 
     Run with
         ./example
@@ -13,11 +13,87 @@
 #include <memory>
 #include <stdexcept>
 #include <cassert>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+#include <climits>
+#include <cerrno>
+#include <csignal>
+#include <deque>
+#include <future>
+#include <iterator>
+#include <initializer_list>
+#include <new>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 // Used by consumers to export Horsewhisperer configuration from a shared library.
 #ifndef HORSEWHISPERER_EXPORT
+#if defined(HORSEWHISPERER_SHARED_LIB) && defined(__GNUC__)
+#define HORSEWHISPERER_EXPORT __attribute__ ((visibility ("default")))
+#else
 #define HORSEWHISPERER_EXPORT
 #endif
+#endif
+
+// By default everything is defined in this header and the API functions
+// are static. With HORSEWHISPERER_COMPILED_LIB defined, this header only
+// declares the API, which is defined by the horsewhisperer library
+// (src/horsewhisperer.cpp, built with HORSEWHISPERER_IMPLEMENTATION), so
+// that the translation units of a program don't compile and emit their
+// own copies of it.
+#if defined(HORSEWHISPERER_COMPILED_LIB)
+#define HORSEWHISPERER_API HORSEWHISPERER_EXPORT
+#if !defined(HORSEWHISPERER_IMPLEMENTATION)
+#define HORSEWHISPERER_DECLARATIONS_ONLY
+#endif
+#else
+#define HORSEWHISPERER_API static
+#endif
+
+// Messages logged with a verbosity level above this value are compiled
+// out entirely; define it before including this header to strip the
+// most verbose logging from release builds.
+#ifndef HORSEWHISPERER_MAX_LOG_LEVEL
+#define HORSEWHISPERER_MAX_LOG_LEVEL 9
+#endif
+
+// Log a message if the current vlevel is at least the specified one:
+//     HORSEWHISPERER_LOG(2) << "processing " << item;
+// When the level is not enabled the cost is a single branch and the
+// streamed expressions are not evaluated.
+#define HORSEWHISPERER_LOG(level)                                             \
+    if ((level) > HORSEWHISPERER_MAX_LOG_LEVEL                                \
+        || !::HorseWhisperer::isLogLevelEnabled(level)) {}                    \
+    else ::HorseWhisperer::LogMessage().stream()
 
 namespace HorseWhisperer {
 
@@ -53,12 +129,16 @@ class action_validation_error : public horsewhisperer_error {
 // Tokens
 //
 
-static const std::string VERSION_STRING = "0.13.0";
+static const std::string VERSION_STRING = "0.14.0";
 
 // Context indexes
 static const int GLOBAL_CONTEXT_IDX = 0;
 static const int NO_CONTEXT_IDX = -1;
 
+// Exit code of an action that exceeded its deadline; actions cancelled
+// by a signal exit with 128 + the signal number, as shells do
+static const int ACTION_TIMEOUT_EXIT_CODE = 124;
+
 // Parse results
 enum class ParseResult { OK, HELP, VERSION, FAILURE, INVALID_FLAG };
 
@@ -70,7 +150,21 @@ static const unsigned int DESCRIPTION_MARGIN_RIGHT_DEFAULT = 80;
 // Types
 //
 
-enum class FlagType { Bool, Int, Double, String, MultiString };
+enum class FlagType { Bool, Int, Double, String, MultiString, IntList, DoubleList };
+
+// How the exit codes of the invocations of a per-argument action are
+// combined: the failure of the first argument, or the failure with the
+// largest absolute value (the first one, in case of a tie)
+enum class ExitCodePolicy { FirstFailure, WorstCode };
+
+// How the output of the actions reaches the terminal. Ordered: as it's
+// flushed, except for concurrent per-argument invocations, written in
+// argument order once they complete. Live: as it's flushed, with the lines
+// of per-argument invocations prefixed by their argument. Buffered: as
+// Ordered, but written in large blocks, ignoring the flushes; the output
+// pending at std::exit is lost, and output written with stdio or by child
+// processes may come first.
+enum class OutputMode { Ordered, Live, Buffered };
 
 // Callback specified for a given value; called whenever the setFlag()
 // function is executed in order to validate the flag argument - it
@@ -81,10 +175,194 @@ enum class FlagType { Bool, Int, Double, String, MultiString };
 template <typename Type>
 using FlagCallback = std::function<void(Type&)>;
 
+// Sequence container storing up to N elements in place, so that short
+// lists don't allocate; beyond that the elements move to the heap.
+// Iterators are plain pointers. Only used internally; the API exposes
+// std::vector.
+template <typename T, size_t N>
+class SmallVector {
+  public:
+    using value_type = T;
+    using size_type = size_t;
+    using reference = T&;
+    using const_reference = const T&;
+    using iterator = T*;
+    using const_iterator = const T*;
+
+    SmallVector() : data_ { inlineData() }, size_ { 0 }, capacity_ { N } {
+    }
+
+    SmallVector(std::initializer_list<T> values) : SmallVector() {
+        reserve(values.size());
+        for (auto& value : values) {
+            emplace_back(value);
+        }
+    }
+
+    template <typename Iterator,
+              typename = typename std::enable_if<!std::is_integral<Iterator>::value>::type>
+    SmallVector(Iterator first, Iterator last) : SmallVector() {
+        for (; first != last; ++first) {
+            emplace_back(*first);
+        }
+    }
+
+    SmallVector(const SmallVector& other) : SmallVector(other.begin(), other.end()) {
+    }
+
+    // The inline elements are moved without growing, so the moves don't
+    // allocate
+    SmallVector(SmallVector&& other)
+            noexcept(std::is_nothrow_move_constructible<T>::value) : SmallVector() {
+        take(other);
+    }
+
+    ~SmallVector() {
+        clear();
+        deallocate();
+    }
+
+    SmallVector& operator=(const SmallVector& other) {
+        if (this != &other) {
+            clear();
+            reserve(other.size_);
+            for (auto& value : other) {
+                emplace_back(value);
+            }
+        }
+        return *this;
+    }
+
+    SmallVector& operator=(SmallVector&& other)
+            noexcept(std::is_nothrow_move_constructible<T>::value) {
+        if (this != &other) {
+            clear();
+            deallocate();
+            take(other);
+        }
+        return *this;
+    }
+
+    iterator begin() { return data_; }
+    iterator end() { return data_ + size_; }
+    const_iterator begin() const { return data_; }
+    const_iterator end() const { return data_ + size_; }
+    const_iterator cbegin() const { return data_; }
+    const_iterator cend() const { return data_ + size_; }
+
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+    bool empty() const { return size_ == 0; }
+    T* data() { return data_; }
+    const T* data() const { return data_; }
+
+    T& operator[](size_t idx) { return data_[idx]; }
+    const T& operator[](size_t idx) const { return data_[idx]; }
+    T& front() { return data_[0]; }
+    const T& front() const { return data_[0]; }
+    T& back() { return data_[size_ - 1]; }
+    const T& back() const { return data_[size_ - 1]; }
+
+    const T& at(size_t idx) const {
+        if (idx >= size_) {
+            throw std::out_of_range { "SmallVector::at" };
+        }
+        return data_[idx];
+    }
+
+    void reserve(size_t capacity) {
+        if (capacity > capacity_) {
+            grow(capacity);
+        }
+    }
+
+    // The element is constructed before growing, since the arguments
+    // can refer to an element of the vector
+    template <typename... Args>
+    T& emplace_back(Args&&... args) {
+        if (size_ == capacity_) {
+            T value(std::forward<Args>(args)...);
+            grow(2 * capacity_);
+            new (data_ + size_) T(std::move(value));
+        } else {
+            new (data_ + size_) T(std::forward<Args>(args)...);
+        }
+        return data_[size_++];
+    }
+
+    void push_back(const T& value) {
+        emplace_back(value);
+    }
+
+    void push_back(T&& value) {
+        emplace_back(std::move(value));
+    }
+
+    void pop_back() {
+        data_[--size_].~T();
+    }
+
+    void clear() {
+        while (size_ > 0) {
+            pop_back();
+        }
+    }
+
+  private:
+    T* data_;
+    size_t size_;
+    size_t capacity_;
+    typename std::aligned_storage<sizeof(T) * N, alignof(T)>::type storage_;
+
+    T* inlineData() {
+        return reinterpret_cast<T*>(&storage_);
+    }
+
+    void grow(size_t capacity) {
+        auto data = static_cast<T*>(::operator new(capacity * sizeof(T)));
+        for (size_t idx = 0; idx < size_; idx++) {
+            new (data + idx) T(std::move(data_[idx]));
+            data_[idx].~T();
+        }
+        deallocate();
+        data_ = data;
+        capacity_ = capacity;
+    }
+
+    void deallocate() {
+        if (data_ != inlineData()) {
+            ::operator delete(data_);
+            data_ = inlineData();
+            capacity_ = N;
+        }
+    }
+
+    // Steal the heap buffer of other, or move its inline elements
+    void take(SmallVector& other) {
+        if (other.data_ != other.inlineData()) {
+            data_ = other.data_;
+            size_ = other.size_;
+            capacity_ = other.capacity_;
+            other.data_ = other.inlineData();
+            other.size_ = 0;
+            other.capacity_ = N;
+            return;
+        }
+        for (auto& value : other) {
+            emplace_back(std::move(value));
+        }
+        other.clear();
+    }
+};
+
 using Arguments = std::vector<std::string>;
 
 using MultiString = std::vector<std::string>;
 
+using IntList = std::vector<int>;
+
+using DoubleList = std::vector<double>;
+
 // Callback specified for a given action; called by the parse()
 // function after completing the parsing, in order to validate its
 // arguments.
@@ -95,29 +373,125 @@ using ArgumentsCallback = std::function<void(const Arguments& arguments)>;
 
 using ActionCallback = std::function<int(const Arguments& arguments)>;
 
+// Callback of an action defined with an options struct; each context of
+// the action has its own instance, where the flags bound to its members
+// are written by parse()
+template <typename Options>
+using OptionsActionCallback =
+    std::function<int(const Arguments& arguments, const Options& options)>;
+
+class ArgumentStream;
+
+// Callback of a streaming action; the arguments are read while the
+// action runs, see ArgumentStream
+using StreamingActionCallback = std::function<int(ArgumentStream& arguments)>;
+
+// Returns the variable a flag is bound to, given the options struct of
+// its context (nullptr for global flags and actions without options).
+// The value of the flag is written there whenever it's set.
+template <typename Type>
+using FlagBinding = std::function<Type*(void* options)>;
+
+// Maps the supported value types to the FlagType enum
+template <typename Type> struct FlagTypeOf;
+template <> struct FlagTypeOf<bool> { static const FlagType value = FlagType::Bool; };
+template <> struct FlagTypeOf<int> { static const FlagType value = FlagType::Int; };
+template <> struct FlagTypeOf<double> { static const FlagType value = FlagType::Double; };
+template <> struct FlagTypeOf<std::string> { static const FlagType value = FlagType::String; };
+template <> struct FlagTypeOf<MultiString> { static const FlagType value = FlagType::MultiString; };
+template <> struct FlagTypeOf<IntList> { static const FlagType value = FlagType::IntList; };
+template <> struct FlagTypeOf<DoubleList> { static const FlagType value = FlagType::DoubleList; };
+
+// Value of a flag; names, aliases and descriptions are stored in the
+// FlagTable
 struct FlagBase {
     virtual ~FlagBase() {}
-    std::string aliases;
-    std::string description;
+    virtual std::unique_ptr<FlagBase> clone() const = 0;
+    // Bind the flag to the variable given by its binding, if any
+    virtual void bind(void* options) = 0;
+    FlagType type;
 };
 
 template <typename Type>
 struct Flag : FlagBase {
+    Flag() : target { nullptr } {
+        type = FlagTypeOf<Type>::value;
+    }
+
+    std::unique_ptr<FlagBase> clone() const override {
+        return std::unique_ptr<FlagBase> { new Flag<Type>(*this) };
+    }
+
+    // The current value is written to the bound variable, so that it
+    // holds the default value until the flag is set
+    void bind(void* options) override {
+        if (binding) {
+            target = binding(options);
+            *target = value;
+        }
+    }
+
+    void set(Type new_value) {
+        value = std::move(new_value);
+        if (target) {
+            *target = value;
+        }
+    }
+
     Type value;
     FlagCallback<Type> flag_callback;
+    FlagBinding<Type> binding;
+    // Variable bound to the flag, if any
+    Type* target;
+};
+
+// Flags are identified by their index in the FlagTable
+using FlagId = uint32_t;
+
+static const FlagId NO_FLAG = UINT32_MAX;
+
+// Flag scope of the global context; each action has its own scope
+static const uint32_t GLOBAL_SCOPE = 0;
+
+// Typed positional parameter of an action. parse() converts the argument
+// at its position as a flag value of the same type, validates it with the
+// flag callback and writes it to the bound variable; a MultiString
+// parameter takes all the remaining arguments
+struct Parameter {
+    std::string name;
+    std::string description;
+    // Default value, validation callback and binding
+    std::shared_ptr<FlagBase> value;
 };
 
 struct Action {
-    // Action name
+    // Action name; the path of the action in case of nested groups
     std::string name;
-    // Keys local to the action
-    std::map<std::string, std::shared_ptr<FlagBase>> flags;
+    // Whether this is a group of actions, which has flags and help but
+    // is never run
+    bool is_group;
+    // Group containing the action, if any
+    std::shared_ptr<Action> group;
+    // Node of the action in the CommandTrie
+    uint32_t node;
+    // Scope of the action flags in the FlagTable
+    uint32_t scope;
+    // Flags local to the action, in definition order
+    std::vector<FlagId> flag_ids;
+    // Typed parameters, in position order
+    std::vector<Parameter> parameters;
     // Action description
     std::string description;
     // Arity of the action, or min arity in case variable_arity is flagged
     unsigned int arity;
     // Function called when we invoke the action
     ActionCallback action_callback;
+    // Creates the options struct of each context, for actions defined
+    // with one; options_callback is called instead of action_callback
+    std::function<std::shared_ptr<void>()> make_options;
+    std::function<int(const Arguments&, const void*)> options_callback;
+    // Called instead of action_callback for streaming actions
+    StreamingActionCallback streaming_callback;
     // Function called when we validate action arguments
     ArgumentsCallback arguments_callback;
     // Context sensitive action help
@@ -128,99 +502,387 @@ struct Action {
     bool chainable;
     // Wheter we invoke the action with variable num of args
     bool variable_arity;
+    // Whether the outcome of the action depends only on its arguments
+    // and flags, so that it can be replayed from the action cache
+    bool idempotent;
+    // How long a cached outcome remains valid; zero means forever
+    std::chrono::seconds cache_ttl;
+    // Time after which the action is cancelled; zero means no limit
+    std::chrono::milliseconds deadline;
+    // Whether the action runs in a child process
+    bool forked;
+    // Whether the callback is invoked once per argument, concurrently
+    bool per_argument;
+    ExitCodePolicy exit_code_policy;
 };
 
-static FlagType getTypeOfFlag(const FlagBase* flagp);
-
 struct Context {
-    // Flags defined for the given context
-    std::map<std::string, std::shared_ptr<FlagBase>> flags;
+    // Values of the action flags for the given context, ordered by flag
+    // id; global flag values are stored in the FlagTable
+    SmallVector<std::pair<FlagId, std::unique_ptr<FlagBase>>, 4> flags;
     // What this context is doing
     std::shared_ptr<Action> action;
     // Action arguments
     Arguments arguments;
+    // Options struct of the action, if defined with one; the bound action
+    // flags of the context write their values there
+    std::shared_ptr<void> options;
+    // Position of the action in the command line
+    int position;
+
+    // Return the value of the specified action flag, or nullptr in case
+    // the flag was defined after creating the context
+    FlagBase* flag(FlagId id) const {
+        auto it = std::lower_bound(
+            flags.begin(), flags.end(), id,
+            [](const std::pair<FlagId, std::unique_ptr<FlagBase>>& entry, FlagId key) {
+                return entry.first < key;
+            });
+        return (it != flags.end() && it->first == id) ? it->second.get() : nullptr;
+    }
+};
 
-    std::string toString() {
-        std::stringstream ss {};
-        ss << "Action " << action->name;
-        if (arguments.size() > 0) {
-            ss << "  - arguments:";
-            for (auto& arg : arguments) {
-                ss << " " << arg;
+typedef std::unique_ptr<Context> ContextPtr;
+
+// Counters of the action cache
+struct ActionCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stores;
+    uint64_t evictions;
+};
+
+// Counters of an action executed with --hw-counters, for the thread
+// that ran it; the ones that couldn't be measured are -1
+struct ActionCounters {
+    std::string action;
+    int64_t wall_time_ns;
+    int64_t task_clock_ns;
+    int64_t cycles;
+    int64_t instructions;
+    int64_t cache_misses;
+    int64_t branch_misses;
+    int64_t context_switches;
+    int64_t page_faults;
+};
+
+// Resources used by the process while an action ran; the peak RSS field
+// is how much the action raised it, and the fields that couldn't be read
+// are -1. The chars fields count all the bytes passed to read and write
+// calls, the bytes fields only the ones that went to storage.
+struct ActionResources {
+    std::string action;
+    int exit_code;
+    int64_t user_cpu_us;
+    int64_t system_cpu_us;
+    int64_t max_rss_growth_kb;
+    int64_t minor_faults;
+    int64_t major_faults;
+    int64_t voluntary_switches;
+    int64_t involuntary_switches;
+    int64_t read_chars;
+    int64_t write_chars;
+    int64_t read_bytes;
+    int64_t write_bytes;
+};
+
+// Outcome of an executed action: its exit code and the result it set
+// with SetActionResult, if any
+struct ActionResult {
+    std::string action;
+    int exit_code;
+    std::string result;
+    // What the action wrote to std::cout, in case the output is captured
+    std::string output;
+};
+
+enum class CancellationReason { None, Timeout, Signal };
+
+// SIGINT and SIGTERM handling while the actions run. The handler only
+// records the signal, which cancels the token of the running action.
+// A second signal restores the default disposition and re-raises it,
+// so that an action that ignores its token can still be killed.
+template <typename Dummy = void>
+struct SignalState {
+    static std::atomic<int> received;
+
+    static void handle(int signal_number) {
+        if (received.exchange(signal_number) != 0) {
+            std::signal(signal_number, SIG_DFL);
+            std::raise(signal_number);
+        }
+    }
+};
+
+template <typename Dummy>
+std::atomic<int> SignalState<Dummy>::received { 0 };
+
+// Handle shared between the running action and the watchdog; actions
+// poll it or wait on it and return once it's cancelled. Copies refer
+// to the same state, so they can be handed to other threads.
+class CancellationToken {
+  public:
+    CancellationToken() : state_ { std::make_shared<State>() } {}
+
+    bool isCancelled() const {
+        return reason() != CancellationReason::None;
+    }
+
+    CancellationReason reason() const {
+        auto reason = state_->reason.load();
+        if (reason == CancellationReason::None && receivedSignal() != 0) {
+            return CancellationReason::Signal;
+        }
+        return reason;
+    }
+
+    // Number of the signal that cancelled the token, if any
+    int signalNumber() const {
+        if (state_->reason.load() == CancellationReason::None) {
+            return receivedSignal();
+        }
+        return state_->signal_number.load();
+    }
+
+    // Block until the token is cancelled or the timeout expires;
+    // return true if cancelled
+    template <typename Rep, typename Period>
+    bool waitFor(const std::chrono::duration<Rep, Period>& timeout) const {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        std::unique_lock<std::mutex> lock { state_->mutex };
+        while (!isCancelled()) {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= deadline) {
+                return false;
             }
+            state_->cancelled.wait_until(lock, wakeUpTime(now, deadline));
         }
-        if (flags.size() > 0) {
-            for (auto& k_v : flags) {
-                ss << "\n  flag " << k_v.first << ":";
-                switch (getTypeOfFlag(k_v.second.get())) {
-                    case FlagType::Bool:
-                        ss << " " << std::static_pointer_cast<Flag<bool>>(k_v.second)->value;
-                        break;
-                    case FlagType::String:
-                        ss << " " << std::static_pointer_cast<Flag<std::string>>(k_v.second)->value;
-                        break;
-                    case FlagType::Int:
-                        ss << " " << std::static_pointer_cast<Flag<int>>(k_v.second)->value;
-                        break;
-                    case FlagType::Double:
-                        ss << " " << std::static_pointer_cast<Flag<double>>(k_v.second)->value;
-                        break;
-                    case FlagType::MultiString:
-                        for (auto& s : std::static_pointer_cast<Flag<MultiString>>(k_v.second)->value) {
-                            ss << " " << s;
-                        }
-                        break;
-                }
+        return true;
+    }
+
+    void wait() const {
+        std::unique_lock<std::mutex> lock { state_->mutex };
+        while (!isCancelled()) {
+            if (state_->follows_signals.load()) {
+                state_->cancelled.wait_for(lock, signalPollInterval());
+            } else {
+                state_->cancelled.wait(lock);
             }
         }
-        return ss.str();
     }
-};
 
-typedef std::unique_ptr<Context> ContextPtr;
+    // Only the first cancellation is recorded
+    void cancel(CancellationReason reason, int signal_number = 0) {
+        std::lock_guard<std::mutex> lock { state_->mutex };
+        if (state_->reason.load() != CancellationReason::None) {
+            return;
+        }
+        state_->signal_number.store(signal_number);
+        state_->reason.store(reason);
+        state_->cancelled.notify_all();
+    }
+
+  private:
+    friend class Watchdog;
+
+    struct State {
+        State() : reason { CancellationReason::None }, signal_number { 0 },
+                  follows_signals { false } {}
+
+        std::atomic<CancellationReason> reason;
+        std::atomic<int> signal_number;
+        // Set for the token of the running action: a received signal
+        // cancels it without any thread having to notice first
+        std::atomic<bool> follows_signals;
+        std::mutex mutex;
+        std::condition_variable cancelled;
+    };
+
+    std::shared_ptr<State> state_;
+
+    int receivedSignal() const {
+        return state_->follows_signals.load() ? SignalState<>::received.load() : 0;
+    }
+
+    // A signal handler can't notify the condition variable, so the
+    // waiters of a token that follows signals check it periodically
+    static std::chrono::milliseconds signalPollInterval() {
+        return std::chrono::milliseconds { 10 };
+    }
+
+    std::chrono::steady_clock::time_point wakeUpTime(
+            std::chrono::steady_clock::time_point now,
+            std::chrono::steady_clock::time_point deadline) const {
+        if (state_->follows_signals.load() && now + signalPollInterval() < deadline) {
+            return now + signalPollInterval();
+        }
+        return deadline;
+    }
+
+    void followSignals() {
+        state_->follows_signals.store(true);
+    }
+};
 
 //
 // API Declarations
 //
 
 template <typename Type>
-static void DefineGlobalFlag(std::string aliases,
-                             std::string description,
-                             Type default_value,
-                             FlagCallback<Type> flag_callback) __attribute__ ((unused));
+HORSEWHISPERER_API void DefineGlobalFlag(std::string aliases,
+                                         std::string description,
+                                         Type default_value,
+                                         FlagCallback<Type> flag_callback) __attribute__ ((unused));
 template <typename Type>
-static void DefineActionFlag(std::string action_name,
-                             std::string aliases,
-                             std::string description,
-                             Type default_value,
-                             FlagCallback<Type> flag_callback) __attribute__ ((unused));
-static bool IsActionFlag(std::string action, std::string flagname) __attribute__ ((unused));
+HORSEWHISPERER_API void DefineActionFlag(std::string action_name,
+                                         std::string aliases,
+                                         std::string description,
+                                         Type default_value,
+                                         FlagCallback<Type> flag_callback) __attribute__ ((unused));
 template <typename Type>
-static Type GetFlag(std::string const& flag_name) __attribute__ ((unused));
+HORSEWHISPERER_API void DefineGlobalFlag(std::string aliases,
+                                         std::string description,
+                                         FlagBinding<Type> binding,
+                                         Type default_value,
+                                         FlagCallback<Type> flag_callback = nullptr) __attribute__ ((unused));
+template <typename Type>
+HORSEWHISPERER_API void DefineActionFlag(std::string action_name,
+                                         std::string aliases,
+                                         std::string description,
+                                         FlagBinding<Type> binding,
+                                         Type default_value,
+                                         FlagCallback<Type> flag_callback = nullptr) __attribute__ ((unused));
+template <typename Type>
+HORSEWHISPERER_API void DefineGlobalFlag(std::string aliases,
+                                         std::string description,
+                                         Type* variable,
+                                         Type default_value,
+                                         FlagCallback<Type> flag_callback = nullptr) __attribute__ ((unused));
+template <typename Type>
+HORSEWHISPERER_API void DefineActionFlag(std::string action_name,
+                                         std::string aliases,
+                                         std::string description,
+                                         Type* variable,
+                                         Type default_value,
+                                         FlagCallback<Type> flag_callback = nullptr) __attribute__ ((unused));
+template <typename Type, typename Options>
+HORSEWHISPERER_API void DefineActionFlag(std::string action_name,
+                                         std::string aliases,
+                                         std::string description,
+                                         Type Options::* member,
+                                         Type default_value,
+                                         FlagCallback<Type> flag_callback = nullptr) __attribute__ ((unused));
+template <typename Type>
+HORSEWHISPERER_API void DefineActionArgument(std::string action_name,
+                                             std::string name,
+                                             std::string description,
+                                             FlagBinding<Type> binding,
+                                             Type default_value,
+                                             FlagCallback<Type> validation_callback = nullptr) __attribute__ ((unused));
+template <typename Type>
+HORSEWHISPERER_API void DefineActionArgument(std::string action_name,
+                                             std::string name,
+                                             std::string description,
+                                             Type* variable,
+                                             Type default_value,
+                                             FlagCallback<Type> validation_callback = nullptr) __attribute__ ((unused));
+template <typename Type, typename Options>
+HORSEWHISPERER_API void DefineActionArgument(std::string action_name,
+                                             std::string name,
+                                             std::string description,
+                                             Type Options::* member,
+                                             Type default_value,
+                                             FlagCallback<Type> validation_callback = nullptr) __attribute__ ((unused));
+HORSEWHISPERER_API bool IsActionFlag(std::string action, std::string flagname) __attribute__ ((unused));
+template <typename Type>
+HORSEWHISPERER_API Type GetFlag(std::string const& flag_name) __attribute__ ((unused));
 // Throws undefined_flag_error in case the specified flag is unknown
-static FlagType GetFlagType(std::string const& flag_name) __attribute__ ((unused));
+HORSEWHISPERER_API FlagType GetFlagType(std::string const& flag_name) __attribute__ ((unused));
 template <typename Type>
-static void SetFlag(std::string const& flag_name, Type value) __attribute__ ((unused));
-static void DefineAction(std::string action_name,
-                         int arity,
-                         bool chainable,
-                         std::string description,
-                         std::string help_string,
-                         ActionCallback action_callback,
-                         ArgumentsCallback arguments_callback,
-                         bool variable_arity) __attribute__ ((unused));
-static void SetAppName(std::string name) __attribute__ ((unused));
-static void SetHelpBanner(std::string banner) __attribute__ ((unused));
-static void SetVersion(std::string version, std::string short_flag) __attribute__ ((unused));
-static void SetDelimiters(std::vector<std::string> const& delimiters) __attribute__ ((unused));
-static ParseResult Parse(int argc, char** argv) __attribute__ ((unused));
-static void ShowHelp(bool show_actions_help = true) __attribute__ ((unused));
-static void ShowVersion() __attribute__ ((unused));
-static std::vector<std::string> GetParsedActions() __attribute__ ((unused));
-static int Start() __attribute__ ((unused));
-static void Reset() __attribute__ ((unused));
-static void SetHelpMargins(unsigned int left_margin,
-                           unsigned int right_margin) __attribute__ ((unused));
+HORSEWHISPERER_API void SetFlag(std::string const& flag_name, Type value) __attribute__ ((unused));
+HORSEWHISPERER_API void DefineAction(std::string action_name,
+                                     int arity,
+                                     bool chainable,
+                                     std::string description,
+                                     std::string help_string,
+                                     ActionCallback action_callback,
+                                     ArgumentsCallback arguments_callback = nullptr,
+                                     bool variable_arity = false) __attribute__ ((unused));
+HORSEWHISPERER_API void DefineActionWithOptions(std::string action_name,
+                                                int arity,
+                                                bool chainable,
+                                                std::string description,
+                                                std::string help_string,
+                                                std::function<std::shared_ptr<void>()> make_options,
+                                                std::function<int(const Arguments&, const void*)> action_callback,
+                                                ArgumentsCallback arguments_callback,
+                                                bool variable_arity) __attribute__ ((unused));
+HORSEWHISPERER_API void DefineStreamingAction(std::string action_name,
+                                              int arity,
+                                              bool chainable,
+                                              std::string description,
+                                              std::string help_string,
+                                              StreamingActionCallback action_callback,
+                                              ArgumentsCallback arguments_callback = nullptr) __attribute__ ((unused));
+template <typename Options>
+HORSEWHISPERER_API void DefineAction(std::string action_name,
+                                     int arity,
+                                     bool chainable,
+                                     std::string description,
+                                     std::string help_string,
+                                     OptionsActionCallback<Options> action_callback,
+                                     ArgumentsCallback arguments_callback = nullptr,
+                                     bool variable_arity = false) __attribute__ ((unused));
+HORSEWHISPERER_API void DefineActionGroup(std::string path,
+                                          std::string description,
+                                          std::string help_string = "") __attribute__ ((unused));
+HORSEWHISPERER_API void SetAppName(std::string name) __attribute__ ((unused));
+HORSEWHISPERER_API void SetHelpBanner(std::string banner) __attribute__ ((unused));
+HORSEWHISPERER_API void SetVersion(std::string version,
+                                   std::string short_flag = "") __attribute__ ((unused));
+HORSEWHISPERER_API void SetDelimiters(std::vector<std::string> const& delimiters) __attribute__ ((unused));
+HORSEWHISPERER_API ParseResult Parse(int argc, char** argv) __attribute__ ((unused));
+HORSEWHISPERER_API void ShowHelp(bool show_actions_help = true) __attribute__ ((unused));
+HORSEWHISPERER_API void ShowVersion() __attribute__ ((unused));
+HORSEWHISPERER_API std::vector<std::string> GetParsedActions() __attribute__ ((unused));
+HORSEWHISPERER_API int Start() __attribute__ ((unused));
+HORSEWHISPERER_API void Reset() __attribute__ ((unused));
+HORSEWHISPERER_API void SetHelpMargins(unsigned int left_margin,
+                                       unsigned int right_margin) __attribute__ ((unused));
+HORSEWHISPERER_API void SetLogStream(std::ostream* stream) __attribute__ ((unused));
+HORSEWHISPERER_API void FlushLog() __attribute__ ((unused));
+HORSEWHISPERER_API void SetActionIdempotent(std::string action_name,
+                                            std::chrono::seconds ttl) __attribute__ ((unused));
+HORSEWHISPERER_API void SetActionCacheDirectory(std::string directory) __attribute__ ((unused));
+HORSEWHISPERER_API void SetActionCacheSizeLimit(uint64_t max_bytes) __attribute__ ((unused));
+HORSEWHISPERER_API ActionCacheStats GetActionCacheStats() __attribute__ ((unused));
+HORSEWHISPERER_API std::vector<ActionCounters> GetActionCounters() __attribute__ ((unused));
+HORSEWHISPERER_API std::vector<ActionResources> GetActionResources() __attribute__ ((unused));
+HORSEWHISPERER_API void SetActionForked(std::string action_name) __attribute__ ((unused));
+HORSEWHISPERER_API void SetMaxForkedActions(unsigned int max_processes) __attribute__ ((unused));
+HORSEWHISPERER_API void SetOutputMode(OutputMode mode) __attribute__ ((unused));
+HORSEWHISPERER_API void SetOutputCapture(bool enabled) __attribute__ ((unused));
+HORSEWHISPERER_API void SetActionPerArgument(std::string action_name,
+                                             ExitCodePolicy policy = ExitCodePolicy::FirstFailure) __attribute__ ((unused));
+HORSEWHISPERER_API void SetActionResult(std::string result) __attribute__ ((unused));
+HORSEWHISPERER_API std::vector<ActionResult> GetActionResults() __attribute__ ((unused));
+HORSEWHISPERER_API void SetConcurrentValidation(bool enabled,
+                                                unsigned int num_threads = 0) __attribute__ ((unused));
+HORSEWHISPERER_API void SetActionDeadline(std::string action_name,
+                                          std::chrono::milliseconds deadline) __attribute__ ((unused));
+HORSEWHISPERER_API CancellationToken GetCancellationToken() __attribute__ ((unused));
+HORSEWHISPERER_API void SetTraceFile(std::string path) __attribute__ ((unused));
+HORSEWHISPERER_API void ParallelFor(size_t begin, size_t end,
+                                    const std::function<void(size_t)>& body,
+                                    size_t grain = 0) __attribute__ ((unused));
+HORSEWHISPERER_API void SubmitTask(std::function<void()> task) __attribute__ ((unused));
+template <typename Function>
+HORSEWHISPERER_API auto Submit(Function function)
+    -> std::future<decltype(function())> __attribute__ ((unused));
+HORSEWHISPERER_API uint64_t SaveSchema(std::string path) __attribute__ ((unused));
+HORSEWHISPERER_API bool LoadSchema(std::string path, uint64_t checksum = 0) __attribute__ ((unused));
+
+#ifndef HORSEWHISPERER_DECLARATIONS_ONLY
 
 //
 // Auxiliary Functions
@@ -237,6 +899,22 @@ static bool validateInteger(const std::string& val) {
     return true;
 }
 
+// Parse a base 10 int, rejecting empty, partial and out of range values
+static bool parseInteger(const std::string& val, int& result) {
+    if (val.empty()) {
+        return false;
+    }
+    char* end { nullptr };
+    errno = 0;
+    auto parsed = std::strtol(val.c_str(), &end, 10);
+    if (errno != 0 || *end != '\0' || !validateInteger(val)
+            || parsed < INT_MIN || parsed > INT_MAX) {
+        return false;
+    }
+    result = static_cast<int>(parsed);
+    return true;
+}
+
 static bool validateDouble(const std::string& val) {
     std::istringstream i_s { (val[0] == '-' ? val.substr(1) : val) };
     double x {};
@@ -247,164 +925,3513 @@ static bool validateDouble(const std::string& val) {
     return true;
 }
 
-static std::vector<std::string> wordWrap(const std::string& txt,
-                                         const unsigned int width) {
-    std::istringstream input { txt };
-    std::vector<std::string> lines {};
-    std::string current_word {};
-    std::string current_line {};
+// Check that all the characters of a list token are digits, commas or
+// one of the specified extra characters, and record the positions of
+// the commas. Blocks of 16 characters are scanned with SSE2, when
+// available; the remaining ones one at a time.
+static bool scanListToken(const char* txt, size_t size, const char* extra_chars,
+                          std::vector<size_t>& separators) {
+    size_t idx { 0 };
+
+#if defined(__SSE2__)
+    const __m128i zero_char = _mm_set1_epi8('0' - 1);
+    const __m128i nine_char = _mm_set1_epi8('9' + 1);
+    const __m128i comma = _mm_set1_epi8(',');
+
+    for (; idx + 16 <= size; idx += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(txt + idx));
+        __m128i digits = _mm_and_si128(_mm_cmpgt_epi8(block, zero_char),
+                                       _mm_cmplt_epi8(block, nine_char));
+        __m128i valid = _mm_or_si128(digits, _mm_cmpeq_epi8(block, comma));
+        for (const char* c = extra_chars; *c; c++) {
+            valid = _mm_or_si128(valid, _mm_cmpeq_epi8(block, _mm_set1_epi8(*c)));
+        }
+
+        if (_mm_movemask_epi8(valid) != 0xFFFF) {
+            return false;
+        }
 
-    while (getline(input, current_word, ' ')) {
-        if (current_line.size() + current_word.size() >= width) {
-            lines.push_back(current_line);
-            current_line = current_word;
-        } else {
-            current_word = (current_line.empty() ? "" : " ") + current_word;
-            current_line += current_word;
+        unsigned int commas = _mm_movemask_epi8(_mm_cmpeq_epi8(block, comma));
+        while (commas) {
+            separators.push_back(idx + __builtin_ctz(commas));
+            commas &= commas - 1;
         }
     }
+#endif
 
-    if (!current_line.empty()) {
-        lines.push_back(current_line);
+    for (; idx < size; idx++) {
+        if (txt[idx] == ',') {
+            separators.push_back(idx);
+        } else if ((txt[idx] < '0' || txt[idx] > '9')
+                   && !std::strchr(extra_chars, txt[idx])) {
+            return false;
+        }
     }
 
-    return lines;
+    return true;
 }
 
-static FlagType getTypeOfFlag(const FlagBase* flagp) {
-    FlagType flag_type { FlagType::Bool };
+static bool parseListField(const char* begin, const char* end, int& value) {
+    bool negative { begin != end && *begin == '-' };
+    if (negative) {
+        begin++;
+    }
+    if (begin == end) {
+        return false;
+    }
+
+    int64_t magnitude { 0 };
+    for (; begin != end; begin++) {
+        if (*begin < '0' || *begin > '9') {
+            return false;
+        }
+        magnitude = magnitude * 10 + (*begin - '0');
+        if (magnitude > static_cast<int64_t>(INT_MAX) + 1) {
+            return false;
+        }
+    }
 
-    // RTTI to determine the flag value type
-    if (dynamic_cast<const Flag<bool>*>(flagp)) {
-        flag_type = FlagType::Bool;
-    } else if (dynamic_cast<const Flag<std::string>*>(flagp)) {
-        flag_type = FlagType::String;
-    } else if (dynamic_cast<const Flag<int>*>(flagp)) {
-        flag_type = FlagType::Int;
-    } else if (dynamic_cast<const Flag<double>*>(flagp)) {
-        flag_type = FlagType::Double;
-    } else if (dynamic_cast<const Flag<MultiString>*>(flagp)) {
-        flag_type = FlagType::MultiString;
-    } else {
-        // We only support the types in the FlagType enum...
-        assert(false);
+    if (!negative && magnitude > INT_MAX) {
+        return false;
     }
 
-    return flag_type;
+    value = static_cast<int>(negative ? -magnitude : magnitude);
+    return true;
 }
 
-//
-// HorseWhisperer
-//
+static bool parseListField(const char* begin, const char* end, double& value) {
+    if (begin == end) {
+        return false;
+    }
+    char* parsed_end { nullptr };
+    // The field is followed by either a comma or the terminator
+    value = std::strtod(begin, &parsed_end);
+    return parsed_end == end;
+}
 
-class HORSEWHISPERER_EXPORT HorseWhisperer {
-  public:
-    // Return reference to instance of HorseWhisperer singleton
-    static HorseWhisperer& Instance() {
-        static HorseWhisperer instance;
-        return instance;
+// Parse a comma separated list of numbers, appending them to values
+template <typename Type>
+static bool parseList(const char* txt, std::vector<Type>& values) {
+    const char* extra_chars = std::is_integral<Type>::value ? "-" : "-+.eE";
+    std::vector<size_t> separators {};
+    size_t size { std::strlen(txt) };
+
+    if (!scanListToken(txt, size, extra_chars, separators)) {
+        return false;
     }
 
-    // No args constructor creates the pointer to the root context and
-    // implicitly declares the --help flag.
-    // Initializations are performed by init().
-    HorseWhisperer() {
-        init();
+    separators.push_back(size);
+    values.reserve(values.size() + separators.size());
+    size_t field_start { 0 };
+
+    for (auto separator : separators) {
+        Type value {};
+        if (!parseListField(txt + field_start, txt + separator, value)) {
+            return false;
+        }
+        values.push_back(value);
+        field_start = separator + 1;
     }
 
-    void reset() {
-        clean();
-        init();
+    return true;
+}
+
+// Whether a token looks like a (possibly negative) list of numbers
+static bool isListToken(const char* txt) {
+    if (*txt == '-' || *txt == '+') {
+        txt++;
     }
+    return (*txt >= '0' && *txt <= '9') || *txt == '.';
+}
 
-    void setAppName(std::string name) {
-        application_name_ = name;
+// Code points whose terminal display width isn't one column: combining
+// marks and other zero width characters, and the East Asian wide and
+// fullwidth ranges (emoji included). Sorted, for binary search.
+struct DisplayWidthRange {
+    uint32_t first;
+    uint32_t last;
+    unsigned int width;
+};
+
+static const DisplayWidthRange DISPLAY_WIDTH_RANGES[] {
+    { 0x0300, 0x036F, 0 }, { 0x0483, 0x0489, 0 }, { 0x0591, 0x05BD, 0 },
+    { 0x05BF, 0x05BF, 0 }, { 0x05C1, 0x05C2, 0 }, { 0x05C4, 0x05C5, 0 },
+    { 0x05C7, 0x05C7, 0 }, { 0x0610, 0x061A, 0 }, { 0x064B, 0x065F, 0 },
+    { 0x0670, 0x0670, 0 }, { 0x06D6, 0x06DC, 0 }, { 0x06DF, 0x06E4, 0 },
+    { 0x06E7, 0x06E8, 0 }, { 0x06EA, 0x06ED, 0 }, { 0x0900, 0x0902, 0 },
+    { 0x093A, 0x093A, 0 }, { 0x093C, 0x093C, 0 }, { 0x0941, 0x0948, 0 },
+    { 0x094D, 0x094D, 0 }, { 0x0951, 0x0957, 0 }, { 0x0962, 0x0963, 0 },
+    { 0x0E31, 0x0E31, 0 }, { 0x0E34, 0x0E3A, 0 }, { 0x0E47, 0x0E4E, 0 },
+    { 0x1100, 0x115F, 2 }, { 0x1AB0, 0x1AFF, 0 }, { 0x1DC0, 0x1DFF, 0 },
+    { 0x200B, 0x200F, 0 }, { 0x202A, 0x202E, 0 }, { 0x2060, 0x2064, 0 },
+    { 0x20D0, 0x20FF, 0 }, { 0x231A, 0x231B, 2 }, { 0x2329, 0x232A, 2 },
+    { 0x23E9, 0x23EC, 2 }, { 0x23F0, 0x23F0, 2 }, { 0x23F3, 0x23F3, 2 },
+    { 0x25FD, 0x25FE, 2 }, { 0x2614, 0x2615, 2 }, { 0x2648, 0x2653, 2 },
+    { 0x26A1, 0x26A1, 2 }, { 0x26AA, 0x26AB, 2 }, { 0x26BD, 0x26BE, 2 },
+    { 0x26C4, 0x26C5, 2 }, { 0x26D4, 0x26D4, 2 }, { 0x26EA, 0x26EA, 2 },
+    { 0x26F2, 0x26F5, 2 }, { 0x26FA, 0x26FD, 2 }, { 0x2705, 0x2705, 2 },
+    { 0x270A, 0x270B, 2 }, { 0x2728, 0x2728, 2 }, { 0x274C, 0x274C, 2 },
+    { 0x2753, 0x2755, 2 }, { 0x2757, 0x2757, 2 }, { 0x2795, 0x2797, 2 },
+    { 0x27B0, 0x27B0, 2 }, { 0x27BF, 0x27BF, 2 }, { 0x2B1B, 0x2B1C, 2 },
+    { 0x2B50, 0x2B50, 2 }, { 0x2B55, 0x2B55, 2 }, { 0x2E80, 0x3029, 2 },
+    { 0x302A, 0x302D, 0 }, { 0x302E, 0x303E, 2 }, { 0x3041, 0x3098, 2 },
+    { 0x3099, 0x309A, 0 }, { 0x309B, 0xA4CF, 2 }, { 0xA960, 0xA97F, 2 },
+    { 0xAC00, 0xD7A3, 2 }, { 0xF900, 0xFAFF, 2 }, { 0xFE00, 0xFE0F, 0 },
+    { 0xFE10, 0xFE19, 2 }, { 0xFE20, 0xFE2F, 0 }, { 0xFE30, 0xFE6F, 2 },
+    { 0xFEFF, 0xFEFF, 0 }, { 0xFF00, 0xFF60, 2 }, { 0xFFE0, 0xFFE6, 2 },
+    { 0x16FE0, 0x16FE4, 2 }, { 0x17000, 0x18CFF, 2 }, { 0x1B000, 0x1B2FF, 2 },
+    { 0x1F004, 0x1F004, 2 }, { 0x1F0CF, 0x1F0CF, 2 }, { 0x1F18E, 0x1F18E, 2 },
+    { 0x1F191, 0x1F19A, 2 }, { 0x1F200, 0x1F251, 2 }, { 0x1F300, 0x1F320, 2 },
+    { 0x1F32D, 0x1F335, 2 }, { 0x1F337, 0x1F37C, 2 }, { 0x1F37E, 0x1F393, 2 },
+    { 0x1F3A0, 0x1F3CA, 2 }, { 0x1F3CF, 0x1F3D3, 2 }, { 0x1F3E0, 0x1F3F0, 2 },
+    { 0x1F3F4, 0x1F3F4, 2 }, { 0x1F3F8, 0x1F43E, 2 }, { 0x1F440, 0x1F440, 2 },
+    { 0x1F442, 0x1F4FC, 2 }, { 0x1F4FF, 0x1F53D, 2 }, { 0x1F54B, 0x1F54E, 2 },
+    { 0x1F550, 0x1F567, 2 }, { 0x1F57A, 0x1F57A, 2 }, { 0x1F595, 0x1F596, 2 },
+    { 0x1F5A4, 0x1F5A4, 2 }, { 0x1F5FB, 0x1F64F, 2 }, { 0x1F680, 0x1F6C5, 2 },
+    { 0x1F6CC, 0x1F6CC, 2 }, { 0x1F6D0, 0x1F6D2, 2 }, { 0x1F6D5, 0x1F6D7, 2 },
+    { 0x1F6EB, 0x1F6EC, 2 }, { 0x1F6F4, 0x1F6FC, 2 }, { 0x1F7E0, 0x1F7EB, 2 },
+    { 0x1F90C, 0x1F93A, 2 }, { 0x1F93C, 0x1F945, 2 }, { 0x1F947, 0x1F9FF, 2 },
+    { 0x1FA70, 0x1FAFF, 2 }, { 0x20000, 0x2FFFD, 2 }, { 0x30000, 0x3FFFD, 2 },
+    { 0xE0001, 0xE007F, 0 }, { 0xE0100, 0xE01EF, 0 },
+};
+
+static unsigned int displayWidth(uint32_t code_point) {
+    auto range = std::upper_bound(std::begin(DISPLAY_WIDTH_RANGES),
+                                  std::end(DISPLAY_WIDTH_RANGES), code_point,
+                                  [](uint32_t value, const DisplayWidthRange& entry) {
+                                      return value < entry.first;
+                                  });
+    if (range != std::begin(DISPLAY_WIDTH_RANGES) && code_point <= (range - 1)->last) {
+        return (range - 1)->width;
     }
+    return 1;
+}
 
-    void setHelpBanner(std::string banner) {
-        help_banner_ = banner;
+// Decode the UTF-8 sequence at the start of txt, setting its length in
+// bytes; a byte that doesn't start a valid sequence is decoded on its
+// own, as U+FFFD
+static uint32_t decodeUtf8(const char* txt, size_t size, size_t& length) {
+    auto bytes = reinterpret_cast<const unsigned char*>(txt);
+    length = 1;
+    if (bytes[0] < 0x80) {
+        return bytes[0];
     }
 
-    void setVersionString(std::string version_string, std::string short_flag_string) {
-        version_string_ = version_string;
-        version_short_flag_string_ = short_flag_string;
-        std::string flag_string = "version";
-        if (short_flag_string != "") {
-            flag_string = short_flag_string + " " + flag_string;
+    size_t sequence_length { 0 };
+    uint32_t code_point { 0 };
+    if ((bytes[0] & 0xE0) == 0xC0) {
+        sequence_length = 2;
+        code_point = bytes[0] & 0x1F;
+    } else if ((bytes[0] & 0xF0) == 0xE0) {
+        sequence_length = 3;
+        code_point = bytes[0] & 0x0F;
+    } else if ((bytes[0] & 0xF8) == 0xF0) {
+        sequence_length = 4;
+        code_point = bytes[0] & 0x07;
+    }
+    if (sequence_length == 0 || sequence_length > size) {
+        return 0xFFFD;
+    }
+    for (size_t idx = 1; idx < sequence_length; idx++) {
+        if ((bytes[idx] & 0xC0) != 0x80) {
+            return 0xFFFD;
         }
-        defineGlobalFlag<bool>(flag_string, "Display version information and quit",
-                               false, nullptr);
+        code_point = (code_point << 6) | (bytes[idx] & 0x3F);
     }
+    length = sequence_length;
+    return code_point;
+}
 
-    void setDelimiters(const std::vector<std::string>& delimiters) {
-        delimiters_ = delimiters;
+// Length of the run of printable ASCII characters at the start of txt,
+// which are one column each; the run ends at any space or control
+// character and at the first byte of a multibyte sequence. Blocks of 16
+// bytes are scanned with SSE2, when available.
+static size_t asciiRun(const char* txt, size_t size) {
+    size_t idx { 0 };
+
+#if defined(__SSE2__)
+    // Signed comparison: bytes from 0x80 up are negative
+    const __m128i first_printable = _mm_set1_epi8(' ' + 1);
+    for (; idx + 16 <= size; idx += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(txt + idx));
+        unsigned int stops = _mm_movemask_epi8(_mm_cmplt_epi8(block, first_printable));
+        if (stops) {
+            return idx + __builtin_ctz(stops);
+        }
     }
+#endif
 
-    bool isDelimiter(const char* argument) const {
-        if (std::find(delimiters_.begin(), delimiters_.end(), argument)
-                != delimiters_.end()) {
-            return true;
+    for (; idx < size; idx++) {
+        auto byte = static_cast<unsigned char>(txt[idx]);
+        if (byte <= ' ' || byte >= 0x80) {
+            break;
         }
-        return false;
     }
+    return idx;
+}
 
-    bool isActionFlag(const std::string& action_name, const std::string& flagname) {
-        for (const auto& flag : actions_[action_name]->flags) {
-            if (flagname.compare(flag.first) == 0) {
-                return true;
+static bool isWrapSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Append the text to the output, wrapped to lines of at most width
+// display columns; each line after the first starts with the indent.
+// Words are separated by any run of spaces and tabs; the line breaks of
+// the text are kept, and a word wider than the line gets a line of its
+// own.
+static void wordWrap(std::string& output, const char* txt, size_t size,
+                     unsigned int width, const std::string& indent) {
+    output.reserve(output.size() + size
+                   + (size / std::max(width / 2, 1u) + 1) * (indent.size() + 1));
+
+    size_t line_width { 0 };
+    bool line_empty { true };
+    size_t pending_breaks { 0 };
+    size_t idx { 0 };
+
+    while (idx < size) {
+        if (txt[idx] == '\n') {
+            pending_breaks++;
+            idx++;
+            continue;
+        }
+        if (isWrapSpace(txt[idx])) {
+            idx++;
+            continue;
+        }
+
+        auto word_begin = idx;
+        size_t word_width { 0 };
+        while (idx < size) {
+            auto run = asciiRun(txt + idx, size - idx);
+            idx += run;
+            word_width += run;
+            if (idx == size || isWrapSpace(txt[idx])) {
+                break;
+            }
+            if (static_cast<unsigned char>(txt[idx]) < 0x80) {
+                // Other control characters take no column
+                idx++;
+                continue;
+            }
+            size_t length;
+            word_width += displayWidth(decodeUtf8(txt + idx, size - idx, length));
+            idx += length;
+        }
+
+        // Line breaks are written before the next word, so that the
+        // trailing ones are dropped; blank lines aren't indented
+        if (pending_breaks > 0) {
+            output.append(pending_breaks, '\n');
+            output += indent;
+            pending_breaks = 0;
+            line_width = 0;
+            line_empty = true;
+        }
+        if (!line_empty) {
+            if (line_width + 1 + word_width > width) {
+                output += '\n';
+                output += indent;
+                line_width = 0;
+            } else {
+                output += ' ';
+                line_width++;
+            }
+        }
+        output.append(txt + word_begin, idx - word_begin);
+        line_width += word_width;
+        line_empty = false;
+    }
+}
+
+// Run the tasks on up to num_threads threads (all available CPUs if
+// zero) and return, for each task, the exception it threw, if any
+static std::vector<std::exception_ptr> runConcurrently(
+        const std::vector<std::function<void()>>& tasks,
+        unsigned int num_threads) {
+    std::vector<std::exception_ptr> errors(tasks.size());
+    std::atomic<size_t> next_task { 0 };
+
+    auto worker = [&tasks, &errors, &next_task]() {
+        for (auto idx = next_task++; idx < tasks.size(); idx = next_task++) {
+            try {
+                tasks[idx]();
+            } catch (...) {
+                errors[idx] = std::current_exception();
+            }
+        }
+    };
+
+    if (num_threads == 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    num_threads = static_cast<unsigned int>(
+        std::min<size_t>(num_threads, tasks.size()));
+
+    std::vector<std::thread> threads {};
+    for (unsigned int t = 1; t < num_threads; t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    return errors;
+}
+
+static FlagType getTypeOfFlag(const FlagBase* flagp) {
+    return flagp->type;
+}
+
+//
+// Schema image
+//
+
+// FNV-1a hash; used to fingerprint action invocations and schema images
+class Fingerprint {
+  public:
+    void add(const void* data, size_t size) {
+        auto bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) {
+            value_ = (value_ ^ bytes[i]) * 1099511628211ULL;
+        }
+    }
+
+    // Strings are length-prefixed so that concatenations can't collide
+    void add(const std::string& txt) {
+        uint64_t size { txt.size() };
+        add(&size, sizeof(size));
+        add(txt.data(), txt.size());
+    }
+
+    void add(const FlagBase* flagp) {
+        auto flag_type = getTypeOfFlag(flagp);
+        add(&flag_type, sizeof(flag_type));
+        switch (flag_type) {
+            case FlagType::Bool: {
+                auto& value = static_cast<const Flag<bool>*>(flagp)->value;
+                add(&value, sizeof(value));
+                break;
+            }
+            case FlagType::String:
+                add(static_cast<const Flag<std::string>*>(flagp)->value);
+                break;
+            case FlagType::Int: {
+                auto& value = static_cast<const Flag<int>*>(flagp)->value;
+                add(&value, sizeof(value));
+                break;
+            }
+            case FlagType::Double: {
+                auto& value = static_cast<const Flag<double>*>(flagp)->value;
+                add(&value, sizeof(value));
+                break;
+            }
+            case FlagType::MultiString: {
+                auto& values = static_cast<const Flag<MultiString>*>(flagp)->value;
+                uint64_t size { values.size() };
+                add(&size, sizeof(size));
+                for (auto& value : values) {
+                    add(value);
+                }
+                break;
+            }
+            case FlagType::IntList:
+                addList(static_cast<const Flag<IntList>*>(flagp)->value);
+                break;
+            case FlagType::DoubleList:
+                addList(static_cast<const Flag<DoubleList>*>(flagp)->value);
+                break;
+        }
+    }
+
+    uint64_t value() const {
+        return value_;
+    }
+
+  private:
+    uint64_t value_ { 14695981039346656037ULL };
+
+    template <typename Type>
+    void addList(const std::vector<Type>& values) {
+        uint64_t size { values.size() };
+        add(&size, sizeof(size));
+        add(values.data(), values.size() * sizeof(Type));
+    }
+};
+
+// Non owning reference to an array, either in memory owned by a table
+// or in a mapped schema image
+template <typename Type>
+struct ArrayView {
+    const Type* data;
+    size_t size;
+
+    const Type& operator[](size_t idx) const {
+        return data[idx];
+    }
+
+    const Type* begin() const {
+        return data;
+    }
+
+    const Type* end() const {
+        return data + size;
+    }
+};
+
+template <typename Type>
+static ArrayView<Type> viewOf(const std::vector<Type>& values) {
+    return ArrayView<Type> { values.data(), values.size() };
+}
+
+static ArrayView<char> viewOf(const std::string& txt) {
+    return ArrayView<char> { txt.data(), txt.size() };
+}
+
+// Arrays stored in a schema image
+enum class SchemaSection : uint32_t {
+    FlagPool, FlagNames, FlagNameSlots, FlagTypes, FlagScopes, FlagAliases,
+    FlagDescriptions, FlagAttributes, FlagSlots,
+    TriePool, TrieSegments, TrieParents, TrieScopes, TrieChildOffsets,
+    TrieChildren, TrieSlots,
+    Count
+};
+
+static const size_t NUM_SCHEMA_SECTIONS = static_cast<size_t>(SchemaSection::Count);
+
+// A schema image is this header followed by the sections, each aligned
+// to 8 bytes. The checksum covers everything after the header.
+struct SchemaHeader {
+    char magic[8];
+    uint32_t format_version;
+    // Written as 0x01020304, to detect images of a different byte order
+    uint32_t byte_order;
+    uint64_t checksum;
+    uint64_t size;
+    struct {
+        uint64_t offset;
+        uint64_t count;
+        uint64_t element_size;
+    } sections[NUM_SCHEMA_SECTIONS];
+};
+
+static const char SCHEMA_MAGIC[8] = { 'H', 'W', 'S', 'C', 'H', 'E', 'M', 'A' };
+static const uint32_t SCHEMA_FORMAT_VERSION = 1;
+static const uint32_t SCHEMA_BYTE_ORDER = 0x01020304;
+
+// Read only mapping of a schema image; the FlagTable and the
+// CommandTrie look their definitions up in place, so the image must
+// outlive them
+class SchemaImage {
+  public:
+    SchemaImage() = default;
+    SchemaImage(const SchemaImage&) = delete;
+    SchemaImage& operator=(const SchemaImage&) = delete;
+
+    ~SchemaImage() {
+        unmap();
+    }
+
+    // Map the image; fail in case it can't be read, it was written
+    // by another version or its checksum doesn't match. A non zero
+    // checksum must also match the one returned by SchemaWriter.
+    bool map(const std::string& path, uint64_t checksum) {
+        unmap();
+#ifdef _WIN32
+        return false;
+#else
+        auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0
+                || static_cast<size_t>(file_stat.st_size) < sizeof(SchemaHeader)) {
+            ::close(fd);
+            return false;
+        }
+        size_ = static_cast<size_t>(file_stat.st_size);
+        auto data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            size_ = 0;
+            return false;
+        }
+        data_ = static_cast<const char*>(data);
+
+        if (!isValid(checksum)) {
+            unmap();
+            return false;
+        }
+        return true;
+#endif
+    }
+
+    // Set the view to the specified section; fail in case its elements
+    // don't have the size of Type
+    template <typename Type>
+    bool section(SchemaSection id, ArrayView<Type>& view) const {
+        auto& entry = header().sections[static_cast<size_t>(id)];
+        if (entry.element_size != sizeof(Type)) {
+            return false;
+        }
+        view.data = reinterpret_cast<const Type*>(data_ + entry.offset);
+        view.size = static_cast<size_t>(entry.count);
+        return true;
+    }
+
+  private:
+    const char* data_ { nullptr };
+    size_t size_ { 0 };
+
+    const SchemaHeader& header() const {
+        return *reinterpret_cast<const SchemaHeader*>(data_);
+    }
+
+    bool isValid(uint64_t checksum) const {
+        auto& image_header = header();
+        if (std::memcmp(image_header.magic, SCHEMA_MAGIC, sizeof(SCHEMA_MAGIC)) != 0
+                || image_header.format_version != SCHEMA_FORMAT_VERSION
+                || image_header.byte_order != SCHEMA_BYTE_ORDER
+                || image_header.size != size_
+                || (checksum != 0 && image_header.checksum != checksum)) {
+            return false;
+        }
+        for (auto& entry : image_header.sections) {
+            if (entry.offset % 8 != 0 || entry.offset > size_
+                    || entry.count * entry.element_size > size_ - entry.offset) {
+                return false;
+            }
+        }
+
+        Fingerprint fingerprint {};
+        fingerprint.add(data_ + sizeof(SchemaHeader), size_ - sizeof(SchemaHeader));
+        return fingerprint.value() == image_header.checksum;
+    }
+
+    void unmap() {
+#ifndef _WIN32
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+#endif
+        data_ = nullptr;
+        size_ = 0;
+    }
+};
+
+// Builds a schema image from the sections of the tables
+class SchemaWriter {
+  public:
+    SchemaWriter() {
+        std::memset(&header_, 0, sizeof(header_));
+    }
+
+    template <typename Type>
+    void add(SchemaSection id, ArrayView<Type> view) {
+        auto& entry = header_.sections[static_cast<size_t>(id)];
+        entry.offset = sizeof(SchemaHeader) + payload_.size();
+        entry.count = view.size;
+        entry.element_size = sizeof(Type);
+        payload_.append(reinterpret_cast<const char*>(view.data), view.size * sizeof(Type));
+        payload_.resize((payload_.size() + 7) & ~static_cast<size_t>(7), '\0');
+    }
+
+    // Write the image; return its checksum
+    uint64_t write(const std::string& path) {
+        static_assert(sizeof(SchemaHeader) % 8 == 0, "sections must stay aligned");
+        std::memcpy(header_.magic, SCHEMA_MAGIC, sizeof(SCHEMA_MAGIC));
+        header_.format_version = SCHEMA_FORMAT_VERSION;
+        header_.byte_order = SCHEMA_BYTE_ORDER;
+        header_.size = sizeof(SchemaHeader) + payload_.size();
+        Fingerprint fingerprint {};
+        fingerprint.add(payload_.data(), payload_.size());
+        header_.checksum = fingerprint.value();
+
+        std::ofstream file { path, std::ios::binary | std::ios::trunc };
+        file.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+        file.write(payload_.data(), payload_.size());
+        if (!file) {
+            throw horsewhisperer_error { "failed to write the schema image '" + path + "'" };
+        }
+        return header_.checksum;
+    }
+
+  private:
+    SchemaHeader header_;
+    std::string payload_;
+};
+
+//
+// Flag storage
+//
+
+// Non owning reference to a sequence of characters
+struct StringView {
+    const char* data;
+    size_t size;
+
+    std::string str() const {
+        return std::string(data, size);
+    }
+
+    bool operator==(const char* txt) const {
+        return std::strlen(txt) == size && std::equal(data, data + size, txt);
+    }
+
+    bool operator==(const std::string& txt) const {
+        return txt.size() == size && std::equal(data, data + size, txt.data());
+    }
+};
+
+// Position of a string in the FlagTable string pool
+struct StringRef {
+    uint32_t offset;
+    uint32_t size;
+};
+
+// Attributes of a flag definition, combined in a bit mask
+enum FlagAttribute : uint8_t {
+    // Not listed in the help
+    FLAG_HIDDEN = 1,
+    // The callback configures the parser or the library, so the flag is
+    // validated and set while tokenizing, even with concurrent validation
+    FLAG_VALIDATE_INLINE = 2,
+    // Controls how the actions run rather than what they do, so it isn't
+    // part of the fingerprint of an invocation
+    FLAG_NOT_INPUT = 4
+};
+
+// Definitions of all the flags, stored as a struct of arrays indexed by
+// flag id. Aliases and descriptions are stored in a single string pool.
+// Alias names are interned: each distinct name gets a small integer id
+// and refers to its first occurrence in the pool. Flags are then found
+// by (scope, name id) in an open addressing hash table.
+// The table owns the values of the global flags and the default values
+// of the action flags.
+// The arrays are read through views, so that the table can also be
+// attached to a schema image; define() then only binds the values to
+// the flags of the image, in definition order.
+class FlagTable {
+  public:
+    void clear() {
+        pool_.clear();
+        names_.clear();
+        name_slots_.assign(INITIAL_SLOTS, EMPTY_SLOT);
+        types_.clear();
+        scopes_.clear();
+        aliases_.clear();
+        descriptions_.clear();
+        attributes_.clear();
+        values_.clear();
+        flag_slots_.assign(INITIAL_SLOTS, FlagSlot { 0, EMPTY_SLOT, NO_FLAG });
+        num_flag_slots_used_ = 0;
+        attached_ = false;
+        refresh();
+    }
+
+    FlagTable() {
+        clear();
+    }
+
+    // Look the flags up in the image; fail in case its layout differs
+    bool attach(const SchemaImage& image) {
+        clear();
+        attached_ = image.section(SchemaSection::FlagPool, pool_view_)
+                    && image.section(SchemaSection::FlagNames, names_view_)
+                    && image.section(SchemaSection::FlagNameSlots, name_slots_view_)
+                    && image.section(SchemaSection::FlagTypes, types_view_)
+                    && image.section(SchemaSection::FlagScopes, scopes_view_)
+                    && image.section(SchemaSection::FlagAliases, aliases_view_)
+                    && image.section(SchemaSection::FlagDescriptions, descriptions_view_)
+                    && image.section(SchemaSection::FlagAttributes, attributes_view_)
+                    && image.section(SchemaSection::FlagSlots, flag_slots_view_);
+        if (!attached_) {
+            refresh();
+        }
+        return attached_;
+    }
+
+    void save(SchemaWriter& writer) const {
+        writer.add(SchemaSection::FlagPool, pool_view_);
+        writer.add(SchemaSection::FlagNames, names_view_);
+        writer.add(SchemaSection::FlagNameSlots, name_slots_view_);
+        writer.add(SchemaSection::FlagTypes, types_view_);
+        writer.add(SchemaSection::FlagScopes, scopes_view_);
+        writer.add(SchemaSection::FlagAliases, aliases_view_);
+        writer.add(SchemaSection::FlagDescriptions, descriptions_view_);
+        writer.add(SchemaSection::FlagAttributes, attributes_view_);
+        writer.add(SchemaSection::FlagSlots, flag_slots_view_);
+    }
+
+    // Define a flag; aliases are space separated. In case an alias is
+    // already used in the same scope, it will refer to the new flag.
+    FlagId define(uint32_t scope, const std::string& aliases,
+                  const std::string& description, std::unique_ptr<FlagBase> value,
+                  uint8_t attributes) {
+        if (attached_) {
+            auto id = static_cast<FlagId>(values_.size());
+            if (matches(id, scope, aliases, description, value->type, attributes)) {
+                values_.push_back(std::move(value));
+                return id;
+            }
+            detach();
+        }
+
+        auto id = static_cast<FlagId>(types_.size());
+        auto aliases_ref = addToPool(aliases);
+
+        types_.push_back(value->type);
+        scopes_.push_back(scope);
+        aliases_.push_back(aliases_ref);
+        descriptions_.push_back(addToPool(description));
+        attributes_.push_back(attributes);
+        values_.push_back(std::move(value));
+
+        for (size_t begin = 0; begin < aliases.size(); ) {
+            auto end = aliases.find(' ', begin);
+            if (end == std::string::npos) {
+                end = aliases.size();
+            }
+            if (end > begin) {
+                StringRef name { static_cast<uint32_t>(aliases_ref.offset + begin),
+                                 static_cast<uint32_t>(end - begin) };
+                addFlagSlot(scope, internName(name), id);
+            }
+            begin = end + 1;
+        }
+
+        refresh();
+        return id;
+    }
+
+    // Return the id of the specified name, or NO_NAME if unknown
+    uint32_t findName(const char* name, size_t size) const {
+        for (auto slot = hash(name, size) & (name_slots_view_.size - 1); ;
+                slot = (slot + 1) & (name_slots_view_.size - 1)) {
+            auto name_id = name_slots_view_[slot];
+            if (name_id == EMPTY_SLOT) {
+                return NO_NAME;
+            }
+            auto& ref = names_view_[name_id];
+            if (ref.size == size && std::equal(name, name + size,
+                                               pool_view_.data + ref.offset)) {
+                return name_id;
+            }
+        }
+    }
+
+    uint32_t findName(const std::string& name) const {
+        return findName(name.data(), name.size());
+    }
+
+    // Return the id of the flag with the specified name id in the
+    // specified scope, or NO_FLAG; flags of an image that are not bound
+    // yet are not found
+    FlagId find(uint32_t scope, uint32_t name_id) const {
+        if (name_id == NO_NAME) {
+            return NO_FLAG;
+        }
+        for (auto slot = slotHash(scope, name_id) & (flag_slots_view_.size - 1); ;
+                slot = (slot + 1) & (flag_slots_view_.size - 1)) {
+            auto& entry = flag_slots_view_[slot];
+            if (entry.name == EMPTY_SLOT) {
+                return NO_FLAG;
+            }
+            if (entry.scope == scope && entry.name == name_id) {
+                return entry.flag < values_.size() ? entry.flag : NO_FLAG;
+            }
+        }
+    }
+
+    FlagId find(uint32_t scope, const std::string& name) const {
+        return find(scope, findName(name));
+    }
+
+    size_t size() const {
+        return values_.size();
+    }
+
+    FlagType type(FlagId id) const {
+        return types_view_[id];
+    }
+
+    uint32_t scope(FlagId id) const {
+        return scopes_view_[id];
+    }
+
+    StringView aliases(FlagId id) const {
+        return view(aliases_view_[id]);
+    }
+
+    StringView description(FlagId id) const {
+        return view(descriptions_view_[id]);
+    }
+
+    bool hasAttribute(FlagId id, FlagAttribute attribute) const {
+        return (attributes_view_[id] & attribute) != 0;
+    }
+
+    FlagBase* value(FlagId id) const {
+        return values_[id].get();
+    }
+
+  private:
+    // Enumerators, so that they can be bound to references in C++11
+    enum : uint32_t { NO_NAME = UINT32_MAX, EMPTY_SLOT = UINT32_MAX };
+    enum : size_t { INITIAL_SLOTS = 64 };
+
+    struct FlagSlot {
+        uint32_t scope;
+        uint32_t name;
+        FlagId flag;
+    };
+
+    std::string pool_;
+
+    // Interned names and their hash table, containing name ids
+    std::vector<StringRef> names_;
+    std::vector<uint32_t> name_slots_;
+
+    // Flag columns
+    std::vector<FlagType> types_;
+    std::vector<uint32_t> scopes_;
+    std::vector<StringRef> aliases_;
+    std::vector<StringRef> descriptions_;
+    std::vector<uint8_t> attributes_;
+    std::vector<std::unique_ptr<FlagBase>> values_;
+
+    // (scope, name id) -> flag id
+    std::vector<FlagSlot> flag_slots_;
+    size_t num_flag_slots_used_;
+
+    // Views of the arrays above, or of the attached image
+    bool attached_;
+    ArrayView<char> pool_view_;
+    ArrayView<StringRef> names_view_;
+    ArrayView<uint32_t> name_slots_view_;
+    ArrayView<FlagType> types_view_;
+    ArrayView<uint32_t> scopes_view_;
+    ArrayView<StringRef> aliases_view_;
+    ArrayView<StringRef> descriptions_view_;
+    ArrayView<uint8_t> attributes_view_;
+    ArrayView<FlagSlot> flag_slots_view_;
+
+    static size_t hash(const char* data, size_t size) {
+        uint32_t h { 2166136261u };
+        for (size_t i = 0; i < size; i++) {
+            h = (h ^ static_cast<unsigned char>(data[i])) * 16777619u;
+        }
+        return h;
+    }
+
+    static size_t slotHash(uint32_t scope, uint32_t name_id) {
+        uint64_t key { (static_cast<uint64_t>(scope) << 32) | name_id };
+        return static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> 32);
+    }
+
+    // Called after each change of the arrays, which may move them
+    void refresh() {
+        pool_view_ = viewOf(pool_);
+        names_view_ = viewOf(names_);
+        name_slots_view_ = viewOf(name_slots_);
+        types_view_ = viewOf(types_);
+        scopes_view_ = viewOf(scopes_);
+        aliases_view_ = viewOf(aliases_);
+        descriptions_view_ = viewOf(descriptions_);
+        attributes_view_ = viewOf(attributes_);
+        flag_slots_view_ = viewOf(flag_slots_);
+    }
+
+    // Whether the flag of the image with the specified id has the
+    // specified definition
+    bool matches(FlagId id, uint32_t scope, const std::string& aliases,
+                 const std::string& description, FlagType type, uint8_t attributes) const {
+        return id < types_view_.size && types_view_[id] == type
+               && scopes_view_[id] == scope && attributes_view_[id] == attributes
+               && view(aliases_view_[id]) == aliases
+               && view(descriptions_view_[id]) == description;
+    }
+
+    // Copy the flags bound so far to the arrays, in case the
+    // definitions differ from the ones of the image
+    void detach() {
+        auto values = std::move(values_);
+        auto scopes = scopes_view_;
+        auto attributes = attributes_view_;
+        std::vector<std::string> aliases {};
+        std::vector<std::string> descriptions {};
+        for (FlagId id = 0; id < values.size(); id++) {
+            aliases.push_back(view(aliases_view_[id]).str());
+            descriptions.push_back(view(descriptions_view_[id]).str());
+        }
+
+        clear();
+        for (FlagId id = 0; id < values.size(); id++) {
+            define(scopes[id], aliases[id], descriptions[id], std::move(values[id]),
+                   attributes[id]);
+        }
+    }
+
+    StringRef addToPool(const std::string& txt) {
+        StringRef ref { static_cast<uint32_t>(pool_.size()),
+                        static_cast<uint32_t>(txt.size()) };
+        pool_ += txt;
+        pool_view_ = viewOf(pool_);
+        return ref;
+    }
+
+    StringView view(StringRef ref) const {
+        return StringView { pool_view_.data + ref.offset, ref.size };
+    }
+
+    uint32_t internName(StringRef ref) {
+        auto name = pool_.data() + ref.offset;
+        auto name_id = findName(name, ref.size);
+        if (name_id != NO_NAME) {
+            return name_id;
+        }
+
+        name_id = static_cast<uint32_t>(names_.size());
+        names_.push_back(ref);
+        if (names_.size() * 2 > name_slots_.size()) {
+            std::vector<uint32_t> slots(name_slots_.size() * 2, EMPTY_SLOT);
+            name_slots_.swap(slots);
+            for (uint32_t id = 0; id < names_.size(); id++) {
+                insertName(id);
+            }
+        } else {
+            insertName(name_id);
+        }
+        names_view_ = viewOf(names_);
+        name_slots_view_ = viewOf(name_slots_);
+        return name_id;
+    }
+
+    void insertName(uint32_t name_id) {
+        auto& ref = names_[name_id];
+        auto slot = hash(pool_.data() + ref.offset, ref.size) & (name_slots_.size() - 1);
+        while (name_slots_[slot] != EMPTY_SLOT) {
+            slot = (slot + 1) & (name_slots_.size() - 1);
+        }
+        name_slots_[slot] = name_id;
+    }
+
+    void addFlagSlot(uint32_t scope, uint32_t name_id, FlagId id) {
+        if ((num_flag_slots_used_ + 1) * 2 > flag_slots_.size()) {
+            std::vector<FlagSlot> slots(flag_slots_.size() * 2,
+                                        FlagSlot { 0, EMPTY_SLOT, NO_FLAG });
+            flag_slots_.swap(slots);
+            for (auto& entry : slots) {
+                if (entry.name != EMPTY_SLOT) {
+                    insertFlagSlot(entry);
+                }
+            }
+        }
+
+        if (insertFlagSlot(FlagSlot { scope, name_id, id })) {
+            num_flag_slots_used_++;
+        }
+    }
+
+    // Return false in case an existing entry was replaced
+    bool insertFlagSlot(const FlagSlot& new_entry) {
+        for (auto slot = slotHash(new_entry.scope, new_entry.name) & (flag_slots_.size() - 1); ;
+                slot = (slot + 1) & (flag_slots_.size() - 1)) {
+            auto& entry = flag_slots_[slot];
+            if (entry.name == EMPTY_SLOT) {
+                entry = new_entry;
+                return true;
+            }
+            if (entry.scope == new_entry.scope && entry.name == new_entry.name) {
+                entry.flag = new_entry.flag;
+                return false;
+            }
+        }
+    }
+};
+
+//
+// Command tree
+//
+
+// Actions are identified by a path of space separated segments, such as
+// "node list", where "node" is a group of actions. The paths form a trie
+// whose nodes are found in a single open addressing table keyed by
+// (parent node, segment), so that dispatching a command line costs one
+// probe per path segment, however many actions are defined.
+class CommandTrie {
+  public:
+    enum : uint32_t { ROOT = 0, NO_NODE = UINT32_MAX, NO_SCOPE = UINT32_MAX };
+
+    CommandTrie() {
+        clear();
+    }
+
+    // The root is kept, so that its list of children keeps its capacity
+    void clear() {
+        pool_.clear();
+        segments_.assign(1, StringRef { 0, 0 });
+        parents_.assign(1, NO_NODE);
+        children_.resize(1);
+        children_[ROOT].clear();
+        actions_.resize(1);
+        actions_[ROOT] = nullptr;
+        slots_.assign(INITIAL_SLOTS, NO_NODE);
+        attached_ = false;
+        refresh();
+    }
+
+    // Look the nodes up in the image; fail in case its layout differs.
+    // The actions are then bound to the nodes of the image by
+    // setAction().
+    bool attach(const SchemaImage& image) {
+        clear();
+        attached_ = image.section(SchemaSection::TriePool, pool_view_)
+                    && image.section(SchemaSection::TrieSegments, segments_view_)
+                    && image.section(SchemaSection::TrieParents, parents_view_)
+                    && image.section(SchemaSection::TrieScopes, scopes_view_)
+                    && image.section(SchemaSection::TrieChildOffsets, child_offsets_view_)
+                    && image.section(SchemaSection::TrieChildren, child_ids_view_)
+                    && image.section(SchemaSection::TrieSlots, slots_view_);
+        if (attached_) {
+            actions_.resize(parents_view_.size);
+        } else {
+            refresh();
+        }
+        return attached_;
+    }
+
+    void save(SchemaWriter& writer) const {
+        std::vector<uint32_t> scopes {};
+        std::vector<uint32_t> child_offsets { 0 };
+        std::vector<uint32_t> child_ids {};
+        for (uint32_t node = ROOT; node < parents_view_.size; node++) {
+            scopes.push_back(actions_[node] ? actions_[node]->scope
+                                            : static_cast<uint32_t>(NO_SCOPE));
+            for (auto child_node : children(node)) {
+                child_ids.push_back(child_node);
+            }
+            child_offsets.push_back(static_cast<uint32_t>(child_ids.size()));
+        }
+
+        writer.add(SchemaSection::TriePool, pool_view_);
+        writer.add(SchemaSection::TrieSegments, segments_view_);
+        writer.add(SchemaSection::TrieParents, parents_view_);
+        writer.add(SchemaSection::TrieScopes, viewOf(scopes));
+        writer.add(SchemaSection::TrieChildOffsets, viewOf(child_offsets));
+        writer.add(SchemaSection::TrieChildren, viewOf(child_ids));
+        writer.add(SchemaSection::TrieSlots, slots_view_);
+    }
+
+    // Return the node of the specified path, adding the missing ones
+    uint32_t insert(const std::string& path) {
+        if (attached_) {
+            auto node = find(path);
+            if (node != NO_NODE) {
+                return node;
+            }
+            detach();
+        }
+
+        uint32_t node { ROOT };
+        for (size_t begin = 0; begin < path.size(); ) {
+            auto end = path.find(' ', begin);
+            if (end == std::string::npos) {
+                end = path.size();
+            }
+            if (end > begin) {
+                auto next = child(node, path.data() + begin, end - begin);
+                node = next != NO_NODE ? next
+                                       : addNode(node, path.data() + begin, end - begin);
+            }
+            begin = end + 1;
+        }
+        return node;
+    }
+
+    // Return the node of the specified path, or NO_NODE
+    uint32_t find(const std::string& path) const {
+        uint32_t node { ROOT };
+        for (size_t begin = 0; begin < path.size() && node != NO_NODE; ) {
+            auto end = path.find(' ', begin);
+            if (end == std::string::npos) {
+                end = path.size();
+            }
+            if (end > begin) {
+                node = child(node, path.data() + begin, end - begin);
+            }
+            begin = end + 1;
+        }
+        return node;
+    }
+
+    // Return the child of the specified node, or NO_NODE
+    uint32_t child(uint32_t parent, const char* segment, size_t size) const {
+        for (auto slot = hash(parent, segment, size) & (slots_view_.size - 1); ;
+                slot = (slot + 1) & (slots_view_.size - 1)) {
+            auto node = slots_view_[slot];
+            if (node == NO_NODE) {
+                return NO_NODE;
+            }
+            auto& ref = segments_view_[node];
+            if (parents_view_[node] == parent && ref.size == size
+                    && std::equal(segment, segment + size, pool_view_.data + ref.offset)) {
+                return node;
+            }
+        }
+    }
+
+    uint32_t child(uint32_t parent, const char* segment) const {
+        return child(parent, segment, std::strlen(segment));
+    }
+
+    // Children are ordered by segment
+    ArrayView<uint32_t> children(uint32_t node) const {
+        if (attached_) {
+            auto begin = child_offsets_view_[node];
+            return ArrayView<uint32_t> { child_ids_view_.data + begin,
+                                         child_offsets_view_[node + 1] - begin };
+        }
+        return viewOf(children_[node]);
+    }
+
+    uint32_t parent(uint32_t node) const {
+        return parents_view_[node];
+    }
+
+    // Path of the node, with single spaces between the segments
+    std::string path(uint32_t node) const {
+        std::string result {};
+        for (; node != ROOT; node = parents_view_[node]) {
+            auto& ref = segments_view_[node];
+            result.insert(0, pool_view_.data + ref.offset, ref.size);
+            if (parents_view_[node] != ROOT) {
+                result.insert(0, 1, ' ');
+            }
+        }
+        return result;
+    }
+
+    // Whether an action of the specified scope can be bound to the node;
+    // nodes of an image only accept the action they were saved with
+    bool accepts(uint32_t node, uint32_t scope) const {
+        return !attached_ || scopes_view_[node] == scope;
+    }
+
+    const std::shared_ptr<Action>& action(uint32_t node) const {
+        return actions_[node];
+    }
+
+    void setAction(uint32_t node, std::shared_ptr<Action> action) {
+        actions_[node] = std::move(action);
+    }
+
+    // Copy the nodes of the actions bound so far to the arrays, in case
+    // the definitions differ from the ones of the image; the actions
+    // get new node ids
+    void detach() {
+        auto actions = std::move(actions_);
+        clear();
+        for (auto& action : actions) {
+            if (action) {
+                action->node = insert(action->name);
+                setAction(action->node, action);
+            }
+        }
+    }
+
+  private:
+    enum : size_t { INITIAL_SLOTS = 64 };
+
+    std::string pool_;
+
+    // Node columns
+    std::vector<StringRef> segments_;
+    std::vector<uint32_t> parents_;
+    std::vector<std::vector<uint32_t>> children_;
+    std::vector<std::shared_ptr<Action>> actions_;
+
+    // Node ids, by (parent, segment)
+    std::vector<uint32_t> slots_;
+
+    // Views of the arrays above, or of the attached image, which also
+    // has the scopes of the actions and the flattened lists of children
+    bool attached_;
+    ArrayView<char> pool_view_;
+    ArrayView<StringRef> segments_view_;
+    ArrayView<uint32_t> parents_view_;
+    ArrayView<uint32_t> scopes_view_;
+    ArrayView<uint32_t> child_offsets_view_;
+    ArrayView<uint32_t> child_ids_view_;
+    ArrayView<uint32_t> slots_view_;
+
+    static size_t hash(uint32_t parent, const char* data, size_t size) {
+        uint32_t h { 2166136261u ^ parent };
+        for (size_t i = 0; i < size; i++) {
+            h = (h ^ static_cast<unsigned char>(data[i])) * 16777619u;
+        }
+        return h;
+    }
+
+    void refresh() {
+        pool_view_ = viewOf(pool_);
+        segments_view_ = viewOf(segments_);
+        parents_view_ = viewOf(parents_);
+        slots_view_ = viewOf(slots_);
+    }
+
+    bool segmentLess(uint32_t lhs, uint32_t rhs) const {
+        auto& left = segments_[lhs];
+        auto& right = segments_[rhs];
+        auto order = std::memcmp(pool_.data() + left.offset, pool_.data() + right.offset,
+                                 std::min(left.size, right.size));
+        return order < 0 || (order == 0 && left.size < right.size);
+    }
+
+    uint32_t addNode(uint32_t parent, const char* segment, size_t size) {
+        auto node = static_cast<uint32_t>(parents_.size());
+        segments_.push_back(StringRef { static_cast<uint32_t>(pool_.size()),
+                                        static_cast<uint32_t>(size) });
+        pool_.append(segment, size);
+        parents_.push_back(parent);
+        children_.emplace_back();
+        actions_.emplace_back();
+
+        auto& siblings = children_[parent];
+        siblings.insert(std::lower_bound(siblings.begin(), siblings.end(), node,
+                                         [this](uint32_t lhs, uint32_t rhs) {
+                                             return segmentLess(lhs, rhs);
+                                         }),
+                        node);
+
+        if (parents_.size() * 2 > slots_.size()) {
+            std::vector<uint32_t> slots(slots_.size() * 2, NO_NODE);
+            slots_.swap(slots);
+            for (uint32_t id = ROOT + 1; id < parents_.size(); id++) {
+                insertSlot(id);
+            }
+        } else {
+            insertSlot(node);
+        }
+        refresh();
+        return node;
+    }
+
+    void insertSlot(uint32_t node) {
+        auto& ref = segments_[node];
+        auto slot = hash(parents_[node], pool_.data() + ref.offset, ref.size)
+                    & (slots_.size() - 1);
+        while (slots_[slot] != NO_NODE) {
+            slot = (slot + 1) & (slots_.size() - 1);
+        }
+        slots_[slot] = node;
+    }
+};
+
+#endif  // HORSEWHISPERER_DECLARATIONS_ONLY
+
+//
+// Logging
+//
+
+// Cached copy of the vlevel flag, so that HORSEWHISPERER_LOG can test
+// a level with a single relaxed load instead of a flag lookup; being a
+// static member of a class template, it can be defined in this header.
+template <typename Dummy = void>
+struct HORSEWHISPERER_EXPORT ActiveVerbosity {
+    static std::atomic<int> level;
+};
+
+template <typename Dummy>
+std::atomic<int> ActiveVerbosity<Dummy>::level { 0 };
+
+static inline bool isLogLevelEnabled(int level) {
+    return level <= ActiveVerbosity<>::level.load(std::memory_order_relaxed);
+}
+
+// Asynchronous log writer. Each thread appends its messages to its own
+// single-producer ring buffer without locking; a background thread
+// drains the buffers and writes them to the log stream in large
+// chunks. Messages of a given thread keep their order.
+class HORSEWHISPERER_EXPORT Logger {
+  public:
+    static Logger& Instance() {
+        static Logger instance;
+        return instance;
+    }
+
+    ~Logger() {
+        {
+            std::lock_guard<std::mutex> lock { registry_mutex_ };
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        if (writer_.joinable()) {
+            writer_.join();
+        }
+        drain();
+    }
+
+    void submit(std::string message) {
+        auto& buffer = threadBuffer();
+        auto head = buffer.head.load(std::memory_order_relaxed);
+
+        // In case the ring is full, wake the writer and wait for it
+        while (head - buffer.tail.load(std::memory_order_acquire)
+                >= LOG_BUFFER_CAPACITY) {
+            wake_.notify_one();
+            std::this_thread::yield();
+        }
+
+        buffer.slots[head % LOG_BUFFER_CAPACITY] = std::move(message);
+        buffer.head.store(head + 1, std::memory_order_release);
+    }
+
+    // Block until all the messages submitted so far are written
+    void flush() {
+        drain();
+    }
+
+    void setStream(std::ostream* stream) {
+        std::lock_guard<std::mutex> lock { drain_mutex_ };
+        stream_ = stream;
+    }
+
+  private:
+    static const size_t LOG_BUFFER_CAPACITY = 1024;
+
+    struct ThreadBuffer {
+        std::atomic<size_t> head { 0 };
+        std::atomic<size_t> tail { 0 };
+        std::vector<std::string> slots =
+            std::vector<std::string>(LOG_BUFFER_CAPACITY);
+    };
+
+    // Guards the buffer registry and the writer thread lifecycle
+    std::mutex registry_mutex_;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+    std::thread writer_;
+    std::condition_variable wake_;
+    bool stopping_ { false };
+
+    // Serializes the consumers of the ring buffers
+    std::mutex drain_mutex_;
+    std::ostream* stream_ { &std::cerr };
+
+    Logger() {
+#ifndef _WIN32
+        pthread_atfork(&Logger::lockForFork, &Logger::unlockAfterFork,
+                       &Logger::unlockAfterFork);
+#endif
+    }
+
+    // The locks are held across fork(), so that the child doesn't
+    // inherit them locked by the writer thread; in the child, which has
+    // no writer thread, messages are written by flush()
+    static void lockForFork() {
+        Instance().drain_mutex_.lock();
+        Instance().registry_mutex_.lock();
+    }
+
+    static void unlockAfterFork() {
+        Instance().registry_mutex_.unlock();
+        Instance().drain_mutex_.unlock();
+    }
+
+    ThreadBuffer& threadBuffer() {
+        thread_local std::shared_ptr<ThreadBuffer> buffer {};
+
+        if (!buffer) {
+            buffer = std::make_shared<ThreadBuffer>();
+            std::lock_guard<std::mutex> lock { registry_mutex_ };
+            buffers_.push_back(buffer);
+            if (!writer_.joinable() && !stopping_) {
+                writer_ = std::thread { &Logger::writerLoop, this };
+            }
+        }
+
+        return *buffer;
+    }
+
+    void writerLoop() {
+        std::unique_lock<std::mutex> lock { registry_mutex_ };
+        while (!stopping_) {
+            wake_.wait_for(lock, std::chrono::milliseconds(20));
+            lock.unlock();
+            drain();
+            lock.lock();
+
+            // Forget the buffers of the threads that exited
+            buffers_.erase(
+                std::remove_if(buffers_.begin(), buffers_.end(),
+                               [](const std::shared_ptr<ThreadBuffer>& b) {
+                                   return b.use_count() == 1
+                                          && b->head.load() == b->tail.load();
+                               }),
+                buffers_.end());
+        }
+    }
+
+    void drain() {
+        std::vector<std::shared_ptr<ThreadBuffer>> buffers {};
+        {
+            std::lock_guard<std::mutex> lock { registry_mutex_ };
+            buffers = buffers_;
+        }
+
+        std::lock_guard<std::mutex> lock { drain_mutex_ };
+        std::string chunk {};
+
+        for (auto& buffer : buffers) {
+            auto tail = buffer->tail.load(std::memory_order_relaxed);
+            auto head = buffer->head.load(std::memory_order_acquire);
+
+            for (; tail < head; tail++) {
+                auto& slot = buffer->slots[tail % LOG_BUFFER_CAPACITY];
+                chunk += slot;
+                chunk += '\n';
+                slot.clear();
+            }
+
+            buffer->tail.store(tail, std::memory_order_release);
+        }
+
+        if (!chunk.empty() && stream_) {
+            stream_->write(chunk.data(), chunk.size());
+            stream_->flush();
+        }
+    }
+};
+
+// Accumulates a single log message and hands it to the Logger when
+// destroyed; used through the HORSEWHISPERER_LOG macro.
+class LogMessage {
+  public:
+    ~LogMessage() {
+        Logger::Instance().submit(stream_.str());
+    }
+
+    std::ostream& stream() {
+        return stream_;
+    }
+
+  private:
+    std::ostringstream stream_;
+};
+
+#ifndef HORSEWHISPERER_DECLARATIONS_ONLY
+
+//
+// Cancellation
+//
+
+// Installs the signal handlers for its lifetime
+class SignalGuard {
+  public:
+    SignalGuard() {
+        SignalState<>::received.store(0);
+#ifndef _WIN32
+        struct sigaction action;
+        std::memset(&action, 0, sizeof(action));
+        action.sa_handler = SignalState<>::handle;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, &previous_int_);
+        sigaction(SIGTERM, &action, &previous_term_);
+#else
+        previous_int_ = std::signal(SIGINT, SignalState<>::handle);
+        previous_term_ = std::signal(SIGTERM, SignalState<>::handle);
+#endif
+    }
+
+    ~SignalGuard() {
+#ifndef _WIN32
+        sigaction(SIGINT, &previous_int_, nullptr);
+        sigaction(SIGTERM, &previous_term_, nullptr);
+#else
+        std::signal(SIGINT, previous_int_);
+        std::signal(SIGTERM, previous_term_);
+#endif
+    }
+
+  private:
+#ifndef _WIN32
+    struct sigaction previous_int_;
+    struct sigaction previous_term_;
+#else
+    using Handler = void (*)(int);
+    Handler previous_int_;
+    Handler previous_term_;
+#endif
+};
+
+// Links the token of the running action to the received signals and
+// cancels it when its deadline expires. The deadlines are enforced by
+// a background thread, started by the first action that has one and
+// then shared by the rest of the chain.
+class Watchdog {
+  public:
+    Watchdog() : armed_ { false }, stop_ { false }, has_deadline_ { false } {}
+
+    ~Watchdog() {
+        if (!thread_.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            stop_ = true;
+        }
+        wake_up_.notify_all();
+        thread_.join();
+    }
+
+    // Watch the token; a zero deadline means no time limit
+    void arm(CancellationToken token, std::chrono::milliseconds deadline) {
+        token.followSignals();
+        {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            token_ = std::move(token);
+            has_deadline_ = deadline.count() > 0;
+            deadline_ = std::chrono::steady_clock::now() + deadline;
+            armed_ = true;
+        }
+        if (has_deadline_ && !thread_.joinable()) {
+            thread_ = std::thread { [this]() { run(); } };
+        }
+        wake_up_.notify_all();
+    }
+
+    // Record the signal received while the token was watched, if any
+    void disarm() {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        armed_ = false;
+        auto signal_number = SignalState<>::received.load();
+        if (signal_number != 0) {
+            token_.cancel(CancellationReason::Signal, signal_number);
+        }
+    }
+
+  private:
+    bool armed_;
+    bool stop_;
+    bool has_deadline_;
+    std::chrono::steady_clock::time_point deadline_;
+    CancellationToken token_;
+    std::mutex mutex_;
+    std::condition_variable wake_up_;
+    std::thread thread_;
+
+    void run() {
+        std::unique_lock<std::mutex> lock { mutex_ };
+        while (!stop_) {
+            if (!armed_ || !has_deadline_) {
+                wake_up_.wait(lock);
+            } else if (std::chrono::steady_clock::now() >= deadline_) {
+                token_.cancel(CancellationReason::Timeout);
+                armed_ = false;
+            } else {
+                wake_up_.wait_until(lock, deadline_);
+            }
+        }
+    }
+};
+
+#endif  // HORSEWHISPERER_DECLARATIONS_ONLY
+
+//
+// Tracing
+//
+
+// Records spans of the parsing and of the actions and writes them as a
+// Chrome trace-event JSON file (chrome://tracing, Perfetto). Each thread
+// appends its spans to its own buffer; the file is written once, when
+// the actions are done, so that tracing does not slow the traced work.
+class HORSEWHISPERER_EXPORT Tracer {
+  public:
+    static Tracer& Instance() {
+        static Tracer instance;
+        return instance;
+    }
+
+    ~Tracer() {
+        if (dirty_.load()) {
+            write();
+        }
+    }
+
+    bool enabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    // Start recording; spans are written to the specified file
+    void setFile(std::string path) {
+        std::lock_guard<std::mutex> lock { registry_mutex_ };
+        path_ = std::move(path);
+        enabled_.store(!path_.empty());
+    }
+
+    // Stop recording and drop the recorded spans
+    void reset() {
+        std::lock_guard<std::mutex> lock { registry_mutex_ };
+        path_.clear();
+        enabled_.store(false);
+        dirty_.store(false);
+        for (auto& buffer : buffers_) {
+            std::lock_guard<std::mutex> buffer_lock { buffer->mutex };
+            buffer->spans.clear();
+        }
+    }
+
+    // Microseconds since the tracer was created
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - epoch_).count();
+    }
+
+    void record(std::string name, const char* category, int64_t begin, int64_t end) {
+        auto& buffer = threadBuffer();
+        std::lock_guard<std::mutex> lock { buffer.mutex };
+        buffer.spans.push_back(Span { std::move(name), category, begin, end });
+        dirty_.store(true, std::memory_order_relaxed);
+    }
+
+    // Append the string to the JSON document, escaping it
+    static void appendEscaped(std::string& json, const std::string& txt) {
+        for (auto c : txt) {
+            if (c == '"' || c == '\\') {
+                json += '\\';
+                json += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                json += escaped;
+            } else {
+                json += c;
+            }
+        }
+    }
+
+    // Write all the spans recorded so far, replacing the file
+    void write() {
+        std::lock_guard<std::mutex> lock { registry_mutex_ };
+        if (path_.empty()) {
+            return;
+        }
+
+        std::string json { "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" };
+        bool first { true };
+        for (auto& buffer : buffers_) {
+            std::lock_guard<std::mutex> buffer_lock { buffer->mutex };
+            for (auto& span : buffer->spans) {
+                json += first ? "\n" : ",\n";
+                first = false;
+                json += "{\"name\":\"";
+                appendEscaped(json, span.name);
+                json += "\",\"cat\":\"";
+                appendEscaped(json, span.category);
+                json += "\",\"ph\":\"X\",\"ts\":" + std::to_string(span.begin)
+                        + ",\"dur\":" + std::to_string(span.end - span.begin)
+                        + ",\"pid\":" + std::to_string(processId())
+                        + ",\"tid\":" + std::to_string(buffer->thread_id) + "}";
+            }
+        }
+        json += "\n]}\n";
+
+        std::ofstream file { path_, std::ios::binary | std::ios::trunc };
+        file.write(json.data(), json.size());
+        if (!file) {
+            std::cout << "Failed to write the trace file '" << path_ << "'" << std::endl;
+        }
+        dirty_.store(false);
+    }
+
+  private:
+    struct Span {
+        std::string name;
+        const char* category;
+        int64_t begin;
+        int64_t end;
+    };
+
+    struct ThreadBuffer {
+        uint32_t thread_id;
+        std::mutex mutex;
+        std::vector<Span> spans;
+    };
+
+    const std::chrono::steady_clock::time_point epoch_ {
+        std::chrono::steady_clock::now() };
+    std::atomic<bool> enabled_ { false };
+    std::atomic<bool> dirty_ { false };
+
+    // Guards the buffer registry and the file path
+    std::mutex registry_mutex_;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+    std::string path_;
+
+    Tracer() = default;
+
+    // Buffers are kept after their thread exits, until written
+    ThreadBuffer& threadBuffer() {
+        thread_local std::shared_ptr<ThreadBuffer> buffer {};
+
+        if (!buffer) {
+            buffer = std::make_shared<ThreadBuffer>();
+            std::lock_guard<std::mutex> lock { registry_mutex_ };
+            buffer->thread_id = static_cast<uint32_t>(buffers_.size()) + 1;
+            buffers_.push_back(buffer);
+        }
+
+        return *buffer;
+    }
+
+    static long processId() {
+#ifndef _WIN32
+        return static_cast<long>(getpid());
+#else
+        return 1;
+#endif
+    }
+
+};
+
+// Records a span covering its lifetime, in case tracing is enabled;
+// actions can use it to add their own spans to the trace:
+//     TraceScope scope { "upload" };
+class TraceScope {
+  public:
+    explicit TraceScope(const char* name, const char* category = "app")
+            : category_ { category },
+              begin_ { Tracer::Instance().enabled() ? Tracer::Instance().now() : -1 } {
+        if (begin_ >= 0) {
+            name_ = name;
+        }
+    }
+
+    explicit TraceScope(const std::string& name, const char* category = "app")
+            : category_ { category },
+              begin_ { Tracer::Instance().enabled() ? Tracer::Instance().now() : -1 } {
+        if (begin_ >= 0) {
+            name_ = name;
+        }
+    }
+
+    ~TraceScope() {
+        if (begin_ >= 0) {
+            auto& tracer = Tracer::Instance();
+            tracer.record(std::move(name_), category_, begin_, tracer.now());
+        }
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+  private:
+    std::string name_;
+    const char* category_;
+    int64_t begin_;
+};
+
+//
+// Argument streams
+//
+
+// Arguments of a streaming action, read while the action runs. Each
+// argument is returned as is, except "-", which is replaced by the lines
+// read from stdin, and "@path", replaced by the lines of the file; empty
+// lines are skipped. Input is read in fixed size chunks, so the memory
+// used doesn't depend on the number of arguments.
+class ArgumentStream {
+  public:
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    // Input iterator over the remaining arguments
+    class iterator {
+      public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::string;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string*;
+        using reference = const std::string&;
+
+        explicit iterator(ArgumentStream* stream) : stream_ { stream } {
+            advance();
+        }
+
+        const std::string& operator*() const {
+            return argument_;
+        }
+
+        const std::string* operator->() const {
+            return &argument_;
+        }
+
+        iterator& operator++() {
+            advance();
+            return *this;
+        }
+
+        bool operator==(const iterator& other) const {
+            return stream_ == other.stream_;
+        }
+
+        bool operator!=(const iterator& other) const {
+            return stream_ != other.stream_;
+        }
+
+      private:
+        ArgumentStream* stream_;
+        std::string argument_;
+
+        void advance() {
+            if (stream_ && !stream_->next(argument_)) {
+                stream_ = nullptr;
+            }
+        }
+    };
+
+    explicit ArgumentStream(const Arguments& arguments)
+            : arguments_ { arguments },
+              next_argument_ { 0 },
+              fd_ { -1 },
+              owns_fd_ { false },
+              eof_ { false },
+              begin_ { 0 },
+              end_ { 0 } {
+    }
+
+    ~ArgumentStream() {
+        closeSource();
+    }
+
+    ArgumentStream(const ArgumentStream&) = delete;
+    ArgumentStream& operator=(const ArgumentStream&) = delete;
+
+    // Store the next argument; return false once all are read. Throws a
+    // horsewhisperer_error in case stdin or a file can't be read.
+    bool next(std::string& argument) {
+        while (true) {
+            if (fd_ >= 0) {
+                while (readLine(argument)) {
+                    if (!argument.empty()) {
+                        return true;
+                    }
+                }
+                closeSource();
+            }
+
+            if (next_argument_ >= arguments_.size()) {
+                return false;
+            }
+
+            const auto& source = arguments_[next_argument_++];
+            if (source == "-") {
+                openSource(STDIN_FILENO, false, "stdin");
+            } else if (source.size() > 1 && source[0] == '@') {
+                auto path = source.substr(1);
+                int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0) {
+                    throw horsewhisperer_error { "failed to open " + path + ": "
+                                                 + std::strerror(errno) };
+                }
+                openSource(fd, true, std::move(path));
+            } else {
+                argument = source;
+                return true;
+            }
+        }
+    }
+
+    iterator begin() {
+        return iterator { this };
+    }
+
+    iterator end() {
+        return iterator { nullptr };
+    }
+
+  private:
+    const Arguments& arguments_;
+    size_t next_argument_;
+    // Input of the current "-" or "@path" argument
+    int fd_;
+    bool owns_fd_;
+    bool eof_;
+    std::string source_name_;
+    std::vector<char> chunk_;
+    size_t begin_;
+    size_t end_;
+
+    void openSource(int fd, bool owns_fd, std::string name) {
+        fd_ = fd;
+        owns_fd_ = owns_fd;
+        eof_ = false;
+        source_name_ = std::move(name);
+        chunk_.resize(CHUNK_SIZE);
+        begin_ = end_ = 0;
+    }
+
+    void closeSource() {
+        if (fd_ >= 0 && owns_fd_) {
+            close(fd_);
+        }
+        fd_ = -1;
+    }
+
+    // Read the next line, without its terminator
+    bool readLine(std::string& line) {
+        line.clear();
+        while (true) {
+            auto available = chunk_.data() + begin_;
+            auto newline = static_cast<const char*>(
+                std::memchr(available, '\n', end_ - begin_));
+            if (newline) {
+                line.append(available, newline - available);
+                begin_ = newline - chunk_.data() + 1;
+                break;
+            }
+            line.append(available, end_ - begin_);
+            begin_ = end_ = 0;
+
+            if (eof_) {
+                if (line.empty()) {
+                    return false;
+                }
+                break;
+            }
+
+            ssize_t bytes_read;
+            while ((bytes_read = read(fd_, chunk_.data(), chunk_.size())) < 0
+                    && errno == EINTR) {}
+            if (bytes_read < 0) {
+                throw horsewhisperer_error { "failed to read the arguments from "
+                                             + source_name_ + ": "
+                                             + std::strerror(errno) };
+            }
+            eof_ = bytes_read == 0;
+            end_ = static_cast<size_t>(bytes_read);
+        }
+
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        return true;
+    }
+};
+
+#ifndef HORSEWHISPERER_DECLARATIONS_ONLY
+
+//
+// Executor
+//
+
+// Work-stealing thread pool for the parallel work of the actions. Each
+// worker owns a deque of tasks: it runs its own tasks from the back and,
+// once it has none left, steals from the front of the other deques.
+// Tasks submitted by other threads are spread round-robin. The workers
+// are started on first use, are shared by the chained actions and are
+// stopped by shutdown(), after running the queued tasks.
+class Executor {
+  public:
+    Executor() : num_threads_ { 0 }, started_ { false }, stop_ { false },
+                 pending_ { 0 }, next_queue_ { 0 } {}
+
+    ~Executor() {
+        shutdown();
+    }
+
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    // Takes effect the next time the workers start; zero means all the
+    // available CPUs
+    void setNumThreads(unsigned int num_threads) {
+        num_threads_ = num_threads;
+    }
+
+    unsigned int numThreads() const {
+        return num_threads_ != 0 ? num_threads_
+                                 : std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // The returned future holds the result or the exception of the task.
+    // A task waiting for the future of another task may block a worker;
+    // nested work is better expressed with parallelFor.
+    template <typename Function>
+    auto submit(Function function) -> std::future<decltype(function())> {
+        using Result = decltype(function());
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::move(function));
+        auto result = task->get_future();
+        push([task]() { (*task)(); });
+        return result;
+    }
+
+    // Call body for each index in [begin, end), in chunks of grain indexes
+    // (a few chunks per worker if zero). The calling thread runs chunks as
+    // well, so parallelFor can be nested in a task. Once all the chunks
+    // are done, the first exception thrown by body, if any, is rethrown.
+    void parallelFor(size_t begin, size_t end, const std::function<void(size_t)>& body,
+                     size_t grain = 0) {
+        if (begin >= end) {
+            return;
+        }
+
+        auto size = end - begin;
+        if (grain == 0) {
+            grain = std::max<size_t>(1, size / (numThreads() * CHUNKS_PER_WORKER));
+        }
+        auto num_chunks = (size - 1) / grain + 1;
+
+        if (num_chunks == 1 || numThreads() == 1) {
+            for (auto idx = begin; idx < end; idx++) {
+                body(idx);
+            }
+            return;
+        }
+
+        LoopState loop { num_chunks };
+        for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+            auto chunk_begin = begin + chunk * grain;
+            auto chunk_end = std::min(end, chunk_begin + grain);
+            push([&loop, &body, chunk_begin, chunk_end]() {
+                try {
+                    for (auto idx = chunk_begin; idx < chunk_end; idx++) {
+                        body(idx);
+                    }
+                } catch (...) {
+                    loop.fail(std::current_exception());
+                }
+                loop.complete();
+            });
+        }
+
+        // Help until no task is left in the deques, then wait for the
+        // chunks still running on the workers
+        while (!loop.done() && runTask()) {}
+        loop.wait();
+
+        if (loop.error) {
+            std::rethrow_exception(loop.error);
+        }
+    }
+
+    // Run the queued tasks and join the workers
+    void shutdown() {
+        std::lock_guard<std::mutex> lifecycle_lock { lifecycle_mutex_ };
+        if (!started_.load()) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock { sleep_mutex_ };
+            stop_ = true;
+        }
+        wake_up_.notify_all();
+
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+        workers_.clear();
+        queues_.clear();
+        started_.store(false);
+    }
+
+  private:
+    enum { CHUNKS_PER_WORKER = 4 };
+
+    using Task = std::function<void()>;
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // Completion of the chunks of a parallelFor call
+    struct LoopState {
+        explicit LoopState(size_t num_chunks) : remaining { num_chunks } {}
+
+        std::mutex mutex;
+        std::condition_variable finished;
+        size_t remaining;
+        std::exception_ptr error;
+
+        void fail(std::exception_ptr chunk_error) {
+            std::lock_guard<std::mutex> lock { mutex };
+            if (!error) {
+                error = std::move(chunk_error);
+            }
+        }
+
+        void complete() {
+            std::lock_guard<std::mutex> lock { mutex };
+            if (--remaining == 0) {
+                finished.notify_all();
+            }
+        }
+
+        bool done() {
+            std::lock_guard<std::mutex> lock { mutex };
+            return remaining == 0;
+        }
+
+        void wait() {
+            std::unique_lock<std::mutex> lock { mutex };
+            finished.wait(lock, [this]() { return remaining == 0; });
+        }
+    };
+
+    // The executor and deque the current thread works for, if any
+    struct WorkerSlot {
+        const Executor* executor;
+        size_t queue_idx;
+    };
+
+    static WorkerSlot& currentWorker() {
+        thread_local WorkerSlot slot { nullptr, 0 };
+        return slot;
+    }
+
+    unsigned int num_threads_;
+    std::atomic<bool> started_;
+    std::mutex lifecycle_mutex_;
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+
+    // Sleeping workers wait for pending_ (the number of queued tasks)
+    // to be positive; it's incremented with sleep_mutex_ held, so that
+    // no wake up is lost
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_up_;
+    bool stop_;
+    std::atomic<size_t> pending_;
+    std::atomic<size_t> next_queue_;
+
+    void start() {
+        std::lock_guard<std::mutex> lifecycle_lock { lifecycle_mutex_ };
+        if (started_.load()) {
+            return;
+        }
+
+        stop_ = false;
+        auto num_threads = numThreads();
+        for (unsigned int idx = 0; idx < num_threads; idx++) {
+            queues_.emplace_back(new Queue());
+        }
+        for (unsigned int idx = 0; idx < num_threads; idx++) {
+            workers_.emplace_back([this, idx]() { work(idx); });
+        }
+        started_.store(true);
+    }
+
+    void push(Task task) {
+        if (!started_.load()) {
+            start();
+        }
+
+        auto& worker = currentWorker();
+        auto queue_idx = worker.executor == this ? worker.queue_idx
+                                                 : next_queue_++ % queues_.size();
+        {
+            std::lock_guard<std::mutex> lock { sleep_mutex_ };
+            pending_++;
+        }
+        {
+            std::lock_guard<std::mutex> lock { queues_[queue_idx]->mutex };
+            queues_[queue_idx]->tasks.push_back(std::move(task));
+        }
+        wake_up_.notify_one();
+    }
+
+    // Run a task of the current worker's deque or, failing that, one
+    // stolen from another deque; false if there's none
+    bool runTask() {
+        auto& worker = currentWorker();
+        bool is_worker = worker.executor == this;
+        auto first_idx = is_worker ? worker.queue_idx : next_queue_.load() % queues_.size();
+        Task task {};
+
+        if (is_worker) {
+            auto& own = *queues_[first_idx];
+            std::lock_guard<std::mutex> lock { own.mutex };
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+            }
+        }
+
+        for (size_t offset = 0; !task && offset < queues_.size(); offset++) {
+            auto& victim = *queues_[(first_idx + offset) % queues_.size()];
+            std::lock_guard<std::mutex> lock { victim.mutex };
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+            }
+        }
+
+        if (!task) {
+            return false;
+        }
+        pending_--;
+        task();
+        return true;
+    }
+
+    void work(size_t queue_idx) {
+        currentWorker() = WorkerSlot { this, queue_idx };
+        while (true) {
+            if (runTask()) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock { sleep_mutex_ };
+            wake_up_.wait(lock, [this]() { return pending_.load() > 0 || stop_; });
+            if (stop_ && pending_.load() == 0) {
+                break;
+            }
+        }
+        currentWorker() = WorkerSlot { nullptr, 0 };
+    }
+};
+
+//
+// Action cache
+//
+
+// Outcome of an idempotent action
+struct CachedOutcome {
+    int exit_code;
+    std::string output;
+};
+
+// Copies everything written to a stream into a string, while still
+// forwarding it to the original destination; the stream is restored
+// on destruction.
+class OutputRecorder : public std::streambuf {
+  public:
+    explicit OutputRecorder(std::ostream& stream)
+            : stream_ { stream },
+              original_ { stream.rdbuf(this) } {
+    }
+
+    ~OutputRecorder() {
+        stream_.rdbuf(original_);
+    }
+
+    const std::string& str() const {
+        return recorded_;
+    }
+
+  protected:
+    int overflow(int c) override {
+        if (c != traits_type::eof()) {
+            recorded_ += traits_type::to_char_type(c);
+            return original_->sputc(traits_type::to_char_type(c));
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        recorded_.append(s, n);
+        return original_->sputn(s, n);
+    }
+
+    int sync() override {
+        return original_->pubsync();
+    }
+
+  private:
+    std::ostream& stream_;
+    std::streambuf* original_;
+    std::string recorded_;
+};
+
+// Output of the chain with OutputMode::Buffered, written to the original
+// buffer of the stream in large blocks; flushes (std::endl) are honoured
+// only on live output, so that every line doesn't cost a write. When
+// capturing, the output is only written by commit() and take() hands it
+// over instead.
+class ChainOutput : public std::streambuf {
+  public:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+
+    ChainOutput(std::ostream& stream, bool live, bool capturing)
+            : stream_ { stream },
+              original_ { stream.rdbuf(this) },
+              live_ { live },
+              capturing_ { capturing } {
+    }
+
+    ~ChainOutput() {
+        commit();
+        stream_.rdbuf(original_);
+    }
+
+    // Write the pending output
+    void commit() {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        write();
+    }
+
+    // Return the pending output, without writing it
+    std::string take() {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        std::string output {};
+        output.swap(pending_);
+        return output;
+    }
+
+  protected:
+    int overflow(int c) override {
+        if (c != traits_type::eof()) {
+            char character = traits_type::to_char_type(c);
+            xsputn(&character, 1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    // The actions can write from several threads
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        pending_.append(s, static_cast<size_t>(n));
+        if (!capturing_ && pending_.size() >= BLOCK_SIZE) {
+            write();
+        }
+        return n;
+    }
+
+    int sync() override {
+        if (live_ && !capturing_) {
+            commit();
+        }
+        return 0;
+    }
+
+  private:
+    std::ostream& stream_;
+    std::streambuf* original_;
+    bool live_;
+    bool capturing_;
+    std::mutex mutex_;
+    // Keeps its capacity, so it grows only up to the largest block
+    std::string pending_;
+
+    void write() {
+        if (!pending_.empty()) {
+            original_->sputn(pending_.data(), static_cast<std::streamsize>(pending_.size()));
+            pending_.clear();
+        }
+        original_->pubsync();
+    }
+};
+
+// Routes the output of each concurrent invocation of a per-argument action
+// to its own buffer, written in argument order once all of them completed;
+// in live mode the complete lines are written at once instead, prefixed by
+// the argument. Output from other threads goes straight through.
+class InvocationOutput : public std::streambuf {
+  public:
+    static const size_t NONE = static_cast<size_t>(-1);
+
+    InvocationOutput(std::ostream& stream, const Arguments& arguments, bool live)
+            : stream_ { stream },
+              original_ { stream.rdbuf(this) },
+              arguments_ { arguments },
+              live_ { live },
+              buffers_(arguments.size()) {
+    }
+
+    ~InvocationOutput() {
+        for (size_t idx = 0; idx < buffers_.size(); idx++) {
+            forward(idx, buffers_[idx]);
+        }
+        stream_.rdbuf(original_);
+    }
+
+    // Invocation run by the calling thread, shared by the streams
+    static size_t& current() {
+        static thread_local size_t idx { NONE };
+        return idx;
+    }
+
+  protected:
+    int overflow(int c) override {
+        if (c != traits_type::eof()) {
+            char character = traits_type::to_char_type(c);
+            xsputn(&character, 1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    // Each buffer is written only by the thread running its invocation
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        auto idx = current();
+        if (idx == NONE) {
+            std::lock_guard<std::mutex> lock { mutex_ };
+            return original_->sputn(s, n);
+        }
+
+        auto& buffer = buffers_[idx];
+        buffer.append(s, static_cast<size_t>(n));
+        if (live_) {
+            auto end = buffer.rfind('\n');
+            if (end != std::string::npos) {
+                auto lines = buffer.substr(0, end + 1);
+                buffer.erase(0, end + 1);
+                forward(idx, lines);
+            }
+        }
+        return n;
+    }
+
+    int sync() override {
+        std::lock_guard<std::mutex> lock { mutex_ };
+        return original_->pubsync();
+    }
+
+  private:
+    std::ostream& stream_;
+    std::streambuf* original_;
+    const Arguments& arguments_;
+    bool live_;
+    std::vector<std::string> buffers_;
+    std::mutex mutex_;
+
+    void forward(size_t idx, const std::string& output) {
+        if (output.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock { mutex_ };
+        if (!live_) {
+            original_->sputn(output.data(), static_cast<std::streamsize>(output.size()));
+            return;
+        }
+
+        std::string prefixed {};
+        size_t begin { 0 };
+        while (begin < output.size()) {
+            auto end = output.find('\n', begin);
+            end = end == std::string::npos ? output.size() : end + 1;
+            prefixed += arguments_[idx];
+            prefixed += ": ";
+            prefixed.append(output, begin, end - begin);
+            begin = end;
+        }
+        if (prefixed.back() != '\n') {
+            prefixed += '\n';
+        }
+        original_->sputn(prefixed.data(), static_cast<std::streamsize>(prefixed.size()));
+        original_->pubsync();
+    }
+};
+
+// On-disk cache of the outcomes of idempotent actions. Each outcome is
+// stored in its own file, named after the invocation fingerprint; once
+// the files exceed the size limit, the least recently written ones are
+// evicted. I/O errors are not fatal; they simply cause cache misses.
+// The directory must be private to the user, otherwise the cache is not
+// used, so that nobody else can plant outcomes to be replayed.
+class ActionCache {
+  public:
+    static const uint64_t DEFAULT_SIZE_LIMIT = 64 * 1024 * 1024;
+
+    ActionCache() {
+        reset();
+    }
+
+    void reset() {
+        directory_ = "";
+        size_limit_ = DEFAULT_SIZE_LIMIT;
+        stats_ = ActionCacheStats { 0, 0, 0, 0 };
+    }
+
+    void setDirectory(std::string directory) {
+        directory_ = std::move(directory);
+    }
+
+    void setSizeLimit(uint64_t max_bytes) {
+        size_limit_ = max_bytes;
+    }
+
+    ActionCacheStats stats() const {
+        return stats_;
+    }
+
+    bool lookup(uint64_t key, std::chrono::seconds ttl, CachedOutcome& outcome) {
+        if (!privateDirectory(false)) {
+            stats_.misses++;
+            return false;
+        }
+
+        std::ifstream entry { entryPath(key), std::ios::binary };
+        EntryHeader header {};
+
+        if (!entry.read(reinterpret_cast<char*>(&header), sizeof(header))
+                || header.magic != ENTRY_MAGIC || header.key != key) {
+            stats_.misses++;
+            return false;
+        }
+
+        if (ttl.count() > 0 && now() - header.created > ttl.count()) {
+            HORSEWHISPERER_LOG(2) << "Cached outcome " << entryPath(key)
+                                  << " has expired";
+            std::remove(entryPath(key).c_str());
+            stats_.misses++;
+            return false;
+        }
+
+        std::string output(header.output_size, '\0');
+        if (!entry.read(&output[0], output.size())) {
+            stats_.misses++;
+            return false;
+        }
+
+        outcome.exit_code = header.exit_code;
+        outcome.output = std::move(output);
+        stats_.hits++;
+        return true;
+    }
+
+    void store(uint64_t key, const CachedOutcome& outcome) {
+#ifndef _WIN32
+        if (!privateDirectory(true)) {
+            return;
+        }
+
+        // The header padding is written too
+        EntryHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = ENTRY_MAGIC;
+        header.key = key;
+        header.created = now();
+        header.exit_code = outcome.exit_code;
+        header.output_size = outcome.output.size();
+
+        // A unique temporary file, so that an existing file or symlink is
+        // never written through
+        auto path = entryPath(key);
+        std::string tmp_path { path + ".XXXXXX" };
+        int fd = mkstemp(&tmp_path[0]);
+        if (fd < 0) {
+            HORSEWHISPERER_LOG(2) << "Failed to create the cached outcome " << tmp_path
+                                  << ": " << std::strerror(errno);
+            return;
+        }
+        auto written = writeAll(fd, reinterpret_cast<const char*>(&header), sizeof(header))
+                       && writeAll(fd, outcome.output.data(), outcome.output.size());
+        if (::close(fd) != 0 || !written) {
+            HORSEWHISPERER_LOG(2) << "Failed to write the cached outcome " << tmp_path;
+            unlink(tmp_path.c_str());
+            return;
+        }
+
+        // Readers must never see a partially written entry
+        if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+            unlink(tmp_path.c_str());
+            return;
+        }
+
+        stats_.stores++;
+        evict();
+#else
+        (void) key;
+        (void) outcome;
+#endif
+    }
+
+  private:
+    static const uint32_t ENTRY_MAGIC = 0x31435748;  // "HWC1"
+
+    struct EntryHeader {
+        uint32_t magic;
+        uint64_t key;
+        int64_t created;
+        int32_t exit_code;
+        uint64_t output_size;
+    };
+
+    std::string directory_;
+    uint64_t size_limit_;
+    ActionCacheStats stats_;
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // $XDG_CACHE_HOME/horsewhisperer or ~/.cache/horsewhisperer by
+    // default; empty when neither is known
+    std::string directory() const {
+        if (!directory_.empty()) {
+            return directory_;
+        }
+        auto cache_home = std::getenv("XDG_CACHE_HOME");
+        if (cache_home && *cache_home) {
+            return std::string { cache_home } + "/horsewhisperer";
+        }
+        auto home = std::getenv("HOME");
+        if (home && *home) {
+            return std::string { home } + "/.cache/horsewhisperer";
+        }
+        return "";
+    }
+
+    // Whether the directory is a real directory owned by the user and
+    // accessible only by them, optionally creating it first
+    bool privateDirectory(bool create) const {
+#ifdef _WIN32
+        (void) create;
+        return false;
+#else
+        auto path = directory();
+        if (path.empty()) {
+            return false;
+        }
+        if (create && directory_.empty()) {
+            // The parent of the default directory, i.e. ~/.cache
+            mkdir(path.substr(0, path.rfind('/')).c_str(), 0700);
+        }
+        if (create) {
+            mkdir(path.c_str(), 0700);
+        }
+
+        struct stat dir_stat;
+        if (lstat(path.c_str(), &dir_stat) != 0) {
+            return false;
+        }
+        if (!S_ISDIR(dir_stat.st_mode) || dir_stat.st_uid != geteuid()
+                || (dir_stat.st_mode & 0077) != 0) {
+            if (create) {
+                HORSEWHISPERER_LOG(1) << "Not using the action cache " << path
+                                      << "; it must be a directory accessible "
+                                      << "only by its owner";
+            }
+            return false;
+        }
+        return true;
+#endif
+    }
+
+#ifndef _WIN32
+    static bool writeAll(int fd, const char* data, size_t size) {
+        while (size > 0) {
+            auto written = ::write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+#endif
+
+    std::string entryPath(uint64_t key) const {
+        std::ostringstream path {};
+        path << directory() << "/" << std::hex << std::setw(16)
+             << std::setfill('0') << key << ".hwc";
+        return path.str();
+    }
+
+    // Remove the oldest entries until the cache fits its size limit
+    void evict() {
+#ifndef _WIN32
+        struct Entry {
+            std::string path;
+            uint64_t size;
+            time_t mtime;
+        };
+
+        auto dir_path = directory();
+        DIR* dir = opendir(dir_path.c_str());
+        if (!dir) {
+            return;
+        }
+
+        std::vector<Entry> entries {};
+        uint64_t total_size { 0 };
+
+        while (auto dir_entry = readdir(dir)) {
+            std::string name { dir_entry->d_name };
+            if (name.size() < 4 || name.compare(name.size() - 4, 4, ".hwc") != 0) {
+                continue;
+            }
+            struct stat entry_stat;
+            auto path = dir_path + "/" + name;
+            if (stat(path.c_str(), &entry_stat) == 0) {
+                entries.push_back(Entry { path,
+                                          static_cast<uint64_t>(entry_stat.st_size),
+                                          entry_stat.st_mtime });
+                total_size += entry_stat.st_size;
+            }
+        }
+        closedir(dir);
+
+        if (total_size <= size_limit_) {
+            return;
+        }
+
+        std::sort(entries.begin(), entries.end(),
+                  [](const Entry& a, const Entry& b) { return a.mtime < b.mtime; });
+
+        for (auto& entry : entries) {
+            if (total_size <= size_limit_) {
+                break;
+            }
+            if (std::remove(entry.path.c_str()) == 0) {
+                total_size -= entry.size;
+                stats_.evictions++;
+            }
+        }
+#endif
+    }
+};
+
+//
+// Journal
+//
+
+// Append-only record of the contexts of a chain that were executed, so
+// that a failed chain can be resumed without running again the actions
+// that completed. Each record stores the fingerprint of the invocation
+// (covering the action, its arguments and the flag values), the exit
+// code, the action name and the arguments; it's written with a single
+// write() and synced to disk before the next action starts. A record
+// torn by a crash fails its checksum and is truncated away on resume.
+class Journal {
+  public:
+    ~Journal() {
+        close();
+    }
+
+    // Open the journal at the specified path; when resuming, the valid
+    // records are loaded and new ones are appended after them, otherwise
+    // the journal is truncated
+    bool open(const std::string& path, bool resume) {
+        close();
+#ifdef _WIN32
+        return false;
+#else
+        auto flags = O_RDWR | O_CREAT | O_CLOEXEC | (resume ? 0 : O_TRUNC);
+        fd_ = ::open(path.c_str(), flags, 0644);
+        if (fd_ < 0) {
+            return false;
+        }
+        if (resume && !load(path)) {
+            close();
+            return false;
+        }
+        return lseek(fd_, 0, SEEK_END) >= 0;
+#endif
+    }
+
+    bool isOpen() const {
+        return fd_ >= 0;
+    }
+
+    // Whether the journal has a successful record of the invocation with
+    // the specified fingerprint; each record is consumed by one context,
+    // so that the same invocation chained twice runs again if it
+    // completed only once
+    bool takeCompleted(uint64_t fingerprint) {
+        auto completed = completed_.find(fingerprint);
+        if (completed == completed_.end() || completed->second == 0) {
+            return false;
+        }
+        completed->second--;
+        return true;
+    }
+
+    bool record(uint64_t fingerprint, int exit_code, const std::string& action_name,
+                const Arguments& arguments) {
+#ifdef _WIN32
+        return false;
+#else
+        // The payload is the action name followed by the arguments,
+        // each one NUL terminated
+        std::string payload { action_name };
+        payload += '\0';
+        for (auto& arg : arguments) {
+            payload += arg;
+            payload += '\0';
+        }
+
+        RecordHeader header { RECORD_MAGIC, exit_code, fingerprint, 0,
+                              static_cast<uint64_t>(payload.size()) };
+        header.checksum = checksum(header, payload.data());
+
+        std::string record(sizeof(header), '\0');
+        std::memcpy(&record[0], &header, sizeof(header));
+        record += payload;
+
+        size_t written { 0 };
+        while (written < record.size()) {
+            auto result = ::write(fd_, record.data() + written, record.size() - written);
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            written += static_cast<size_t>(result);
+        }
+        return fsync(fd_) == 0;
+#endif
+    }
+
+    void close() {
+#ifndef _WIN32
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+#endif
+        fd_ = -1;
+        completed_.clear();
+    }
+
+  private:
+    static const uint32_t RECORD_MAGIC = 0x314A5748;  // "HWJ1"
+
+    struct RecordHeader {
+        uint32_t magic;
+        int32_t exit_code;
+        uint64_t fingerprint;
+        uint64_t checksum;
+        uint64_t payload_size;
+    };
+
+    int fd_ { -1 };
+
+    // Number of successful records of each fingerprint
+    std::map<uint64_t, size_t> completed_;
+
+    static uint64_t checksum(RecordHeader header, const char* payload) {
+        header.checksum = 0;
+        Fingerprint fingerprint {};
+        fingerprint.add(&header, sizeof(header));
+        fingerprint.add(payload, static_cast<size_t>(header.payload_size));
+        return fingerprint.value();
+    }
+
+#ifndef _WIN32
+    // Read the records up to the first torn or corrupted one, which is
+    // truncated together with anything following it
+    bool load(const std::string& path) {
+        std::string contents {};
+        char buffer[64 * 1024];
+        ssize_t result;
+        while ((result = ::read(fd_, buffer, sizeof(buffer))) != 0) {
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            contents.append(buffer, static_cast<size_t>(result));
+        }
+
+        size_t offset { 0 };
+        while (contents.size() - offset >= sizeof(RecordHeader)) {
+            RecordHeader header;
+            std::memcpy(&header, contents.data() + offset, sizeof(header));
+            auto payload = contents.data() + offset + sizeof(header);
+            if (header.magic != RECORD_MAGIC
+                    || header.payload_size > contents.size() - offset - sizeof(header)
+                    || header.checksum != checksum(header, payload)) {
+                break;
+            }
+            if (header.exit_code == EXIT_SUCCESS) {
+                completed_[header.fingerprint]++;
+            }
+            offset += sizeof(header) + static_cast<size_t>(header.payload_size);
+        }
+
+        if (offset < contents.size()) {
+            HORSEWHISPERER_LOG(1) << "Discarding " << contents.size() - offset
+                                  << " bytes of incomplete records from the journal "
+                                  << path;
+            if (ftruncate(fd_, static_cast<off_t>(offset)) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+#endif
+};
+
+//
+// Performance counters
+//
+
+// Counts the events of the calling thread around each action, with
+// perf_event_open. Each event is opened on its own, so that when the
+// kernel refuses the hardware ones (perf_event_paranoid, or no PMU in a
+// VM) the software ones are still counted; kernel-side counting is
+// dropped first when it's not permitted. Counts are scaled in case the
+// kernel multiplexed the counters. Work the action hands to the executor
+// runs on other threads and is not counted.
+class PerfCounters {
+  public:
+    PerfCounters() {
+        for (auto& fd : fds_) {
+            fd = -1;
+        }
+    }
+
+    ~PerfCounters() {
+        close();
+    }
+
+    // Open the events not opened yet; return whether any hardware event
+    // is available
+    bool open() {
+#ifdef __linux__
+        for (size_t idx = 0; idx < NUM_EVENTS; idx++) {
+            if (fds_[idx] < 0) {
+                fds_[idx] = openEvent(event(idx), false);
+            }
+            if (fds_[idx] < 0) {
+                fds_[idx] = openEvent(event(idx), true);
+            }
+        }
+#endif
+        return hasHardwareEvents();
+    }
+
+    bool hasHardwareEvents() const {
+        for (size_t idx = 0; idx < NUM_EVENTS; idx++) {
+            if (fds_[idx] >= 0 && event(idx).type == HARDWARE) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void start() {
+#ifdef __linux__
+        for (auto fd : fds_) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+        start_ = std::chrono::steady_clock::now();
+    }
+
+    ActionCounters stop(std::string action_name) {
+        auto wall_time = std::chrono::steady_clock::now() - start_;
+        int64_t values[NUM_EVENTS];
+        for (size_t idx = 0; idx < NUM_EVENTS; idx++) {
+            values[idx] = read(fds_[idx]);
+        }
+
+        return ActionCounters {
+            std::move(action_name),
+            std::chrono::duration_cast<std::chrono::nanoseconds>(wall_time).count(),
+            values[0], values[1], values[2], values[3], values[4], values[5], values[6] };
+    }
+
+    void close() {
+        for (auto& fd : fds_) {
+#ifndef _WIN32
+            if (fd >= 0) {
+                ::close(fd);
+            }
+#endif
+            fd = -1;
+        }
+    }
+
+  private:
+    // perf_event_attr types
+    static const uint32_t HARDWARE = 0;
+    static const uint32_t SOFTWARE = 1;
+
+    struct Event {
+        uint32_t type;
+        uint64_t config;
+    };
+
+    // In the order of the ActionCounters fields
+    static const size_t NUM_EVENTS = 7;
+    static const Event& event(size_t idx) {
+        static const Event events[NUM_EVENTS] {
+            { SOFTWARE, 1 },  // PERF_COUNT_SW_TASK_CLOCK
+            { HARDWARE, 0 },  // PERF_COUNT_HW_CPU_CYCLES
+            { HARDWARE, 1 },  // PERF_COUNT_HW_INSTRUCTIONS
+            { HARDWARE, 3 },  // PERF_COUNT_HW_CACHE_MISSES
+            { HARDWARE, 5 },  // PERF_COUNT_HW_BRANCH_MISSES
+            { SOFTWARE, 3 },  // PERF_COUNT_SW_CONTEXT_SWITCHES
+            { SOFTWARE, 2 },  // PERF_COUNT_SW_PAGE_FAULTS
+        };
+        return events[idx];
+    }
+
+    int fds_[NUM_EVENTS];
+    std::chrono::steady_clock::time_point start_;
+
+#ifdef __linux__
+    static int openEvent(const Event& event, bool exclude_kernel) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = event.type;
+        attr.config = event.config;
+        attr.disabled = 1;
+        attr.exclude_kernel = exclude_kernel ? 1 : 0;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1,
+                                        PERF_FLAG_FD_CLOEXEC));
+    }
+#endif
+
+    // Disable the counter and read its value; -1 if it's not available
+    static int64_t read(int fd) {
+#ifdef __linux__
+        if (fd < 0) {
+            return -1;
+        }
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t data[3];  // value, time enabled, time running
+        if (::read(fd, data, sizeof(data)) != static_cast<ssize_t>(sizeof(data))) {
+            return -1;
+        }
+        if (data[2] == 0) {
+            // Never scheduled; nothing was counted only if never enabled
+            return data[1] == 0 ? 0 : -1;
+        }
+        if (data[2] < data[1]) {
+            return static_cast<int64_t>(static_cast<double>(data[0])
+                                        * data[1] / data[2]);
+        }
+        return static_cast<int64_t>(data[0]);
+#else
+        (void) fd;
+        return -1;
+#endif
+    }
+};
+
+//
+// Resource accounting
+//
+
+// Resources used by the whole process so far, from getrusage() and
+// /proc/self/io; the difference between the snapshots taken around an
+// action is charged to it, including the work of the executor threads
+struct ResourceSnapshot {
+    int64_t user_cpu_us { -1 };
+    int64_t system_cpu_us { -1 };
+    int64_t max_rss_kb { -1 };
+    int64_t minor_faults { -1 };
+    int64_t major_faults { -1 };
+    int64_t voluntary_switches { -1 };
+    int64_t involuntary_switches { -1 };
+    int64_t read_chars { -1 };
+    int64_t write_chars { -1 };
+    int64_t read_bytes { -1 };
+    int64_t write_bytes { -1 };
+
+    // Bytes read from /proc/self/io to take the snapshot, which are not
+    // charged to the action
+    int64_t own_read_chars { 0 };
+
+    static ResourceSnapshot take() {
+        ResourceSnapshot snapshot {};
+#ifndef _WIN32
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+            snapshot.user_cpu_us = microseconds(usage.ru_utime);
+            snapshot.system_cpu_us = microseconds(usage.ru_stime);
+            snapshot.max_rss_kb = usage.ru_maxrss;
+            snapshot.minor_faults = usage.ru_minflt;
+            snapshot.major_faults = usage.ru_majflt;
+            snapshot.voluntary_switches = usage.ru_nvcsw;
+            snapshot.involuntary_switches = usage.ru_nivcsw;
+        }
+        readProcIo(snapshot);
+#endif
+        return snapshot;
+    }
+
+    // Usage between the specified earlier snapshot and this one
+    ActionResources since(const ResourceSnapshot& before, std::string action_name,
+                          int exit_code) const {
+        return ActionResources { std::move(action_name), exit_code,
+                                 delta(before.user_cpu_us, user_cpu_us),
+                                 delta(before.system_cpu_us, system_cpu_us),
+                                 delta(before.max_rss_kb, max_rss_kb),
+                                 delta(before.minor_faults, minor_faults),
+                                 delta(before.major_faults, major_faults),
+                                 delta(before.voluntary_switches, voluntary_switches),
+                                 delta(before.involuntary_switches, involuntary_switches),
+                                 delta(before.read_chars, read_chars
+                                                          - before.own_read_chars),
+                                 delta(before.write_chars, write_chars),
+                                 delta(before.read_bytes, read_bytes),
+                                 delta(before.write_bytes, write_bytes) };
+    }
+
+#ifndef _WIN32
+    static int64_t microseconds(const struct timeval& time) {
+        return static_cast<int64_t>(time.tv_sec) * 1000000 + time.tv_usec;
+    }
+#endif
+
+  private:
+    static int64_t delta(int64_t before, int64_t after) {
+        return (before < 0 || after < 0) ? -1 : after - before;
+    }
+
+#ifndef _WIN32
+
+    // The file is missing without CONFIG_TASK_IO_ACCOUNTING; the fields
+    // are then left at -1
+    static void readProcIo(ResourceSnapshot& snapshot) {
+        auto fd = ::open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        char buffer[512];
+        auto size = ::read(fd, buffer, sizeof(buffer) - 1);
+        ::close(fd);
+        if (size <= 0) {
+            return;
+        }
+        buffer[size] = '\0';
+
+        struct Field {
+            const char* name;
+            int64_t* value;
+        };
+        Field fields[] { { "rchar: ", &snapshot.read_chars },
+                         { "wchar: ", &snapshot.write_chars },
+                         { "read_bytes: ", &snapshot.read_bytes },
+                         { "write_bytes: ", &snapshot.write_bytes } };
+        for (auto line = buffer; *line; ) {
+            for (auto& field : fields) {
+                auto length = std::strlen(field.name);
+                if (std::strncmp(line, field.name, length) == 0) {
+                    *field.value = std::strtoll(line + length, nullptr, 10);
+                }
+            }
+            auto newline = std::strchr(line, '\n');
+            if (!newline) {
+                break;
+            }
+            line = newline + 1;
+        }
+        snapshot.own_read_chars = size;
+    }
+#endif
+};
+
+//
+// Forked actions
+//
+
+// Shared memory channel to the child processes running forked actions,
+// mapped before forking them. It's a ring of fixed size slots, one for
+// each child that can run at a time; a child writes its exit code, the
+// output it wrote to std::cout and its result to its slot, which the
+// parent reads once the child has exited. Pages are only committed when
+// written, so the capacity of the slots costs address space only.
+class ForkChannel {
+  public:
+    static const size_t SLOT_SIZE = 4 * 1024 * 1024;
+    static const size_t RESULT_CAPACITY = 64 * 1024;
+
+    struct Slot {
+        // Set by the child once the action returned
+        uint32_t completed;
+        uint32_t output_truncated;
+        int32_t exit_code;
+        uint32_t result_size;
+        uint64_t output_size;
+        char result[RESULT_CAPACITY];
+
+        static size_t outputCapacity() {
+            return SLOT_SIZE - sizeof(Slot);
+        }
+
+        char* output() {
+            return reinterpret_cast<char*>(this) + sizeof(Slot);
+        }
+    };
+
+    ~ForkChannel() {
+        unmap();
+    }
+
+    bool map(size_t num_slots) {
+        unmap();
+#ifdef _WIN32
+        return false;
+#else
+        auto data = mmap(nullptr, num_slots * SLOT_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (data == MAP_FAILED) {
+            return false;
+        }
+        data_ = static_cast<char*>(data);
+        num_slots_ = num_slots;
+        for (size_t idx = 0; idx < num_slots; idx++) {
+            free_slots_.push_back(idx);
+        }
+        return true;
+#endif
+    }
+
+    // Take the next free slot of the ring, cleared; false if all of them
+    // are in use
+    bool acquire(size_t& idx) {
+        if (free_slots_.empty()) {
+            return false;
+        }
+        idx = free_slots_.front();
+        free_slots_.pop_front();
+        auto& free_slot = slot(idx);
+        free_slot.completed = 0;
+        free_slot.output_truncated = 0;
+        free_slot.exit_code = EXIT_FAILURE;
+        free_slot.result_size = 0;
+        free_slot.output_size = 0;
+        return true;
+    }
+
+    void release(size_t idx) {
+        free_slots_.push_back(idx);
+    }
+
+    Slot& slot(size_t idx) {
+        return *reinterpret_cast<Slot*>(data_ + idx * SLOT_SIZE);
+    }
+
+  private:
+    char* data_ { nullptr };
+    size_t num_slots_ { 0 };
+    std::deque<size_t> free_slots_;
+
+    void unmap() {
+#ifndef _WIN32
+        if (data_) {
+            munmap(data_, num_slots_ * SLOT_SIZE);
+        }
+#endif
+        data_ = nullptr;
+        num_slots_ = 0;
+        free_slots_.clear();
+    }
+};
+
+// Stream buffer writing the output of a forked action straight to its
+// slot; what doesn't fit is dropped and the slot is marked as truncated
+class SlotOutput : public std::streambuf {
+  public:
+    explicit SlotOutput(ForkChannel::Slot& slot) : slot_ { slot } {
+        setp(slot.output(), slot.output() + ForkChannel::Slot::outputCapacity());
+    }
+
+    void finish() {
+        slot_.output_size = static_cast<uint64_t>(pptr() - pbase());
+    }
+
+  protected:
+    // The output flushed before a crash is kept
+    int sync() override {
+        finish();
+        return 0;
+    }
+
+    int overflow(int c) override {
+        if (c != traits_type::eof()) {
+            slot_.output_truncated = 1;
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        auto available = static_cast<std::streamsize>(epptr() - pptr());
+        if (n > available) {
+            slot_.output_truncated = 1;
+        }
+        auto size = std::min(n, available);
+        std::memcpy(pptr(), s, static_cast<size_t>(size));
+        pbump(static_cast<int>(size));
+        return n;
+    }
+
+  private:
+    ForkChannel::Slot& slot_;
+};
+
+// Outcome of a forked action, read from its slot once the child exited
+struct ForkedOutcome {
+    // Skipped since it already completed according to the journal
+    bool skipped { false };
+    bool timed_out { false };
+    int exit_code { EXIT_FAILURE };
+    bool output_truncated { false };
+    std::string output;
+    std::string result;
+    // Set in case the child crashed or couldn't be started
+    std::string failure;
+    ActionResources resources;
+};
+
+//
+// HorseWhisperer
+//
+
+class HORSEWHISPERER_EXPORT HorseWhisperer {
+  public:
+    // Return reference to instance of HorseWhisperer singleton
+    static HorseWhisperer& Instance() {
+        static HorseWhisperer instance;
+        return instance;
+    }
+
+    // No args constructor creates the pointer to the root context and
+    // implicitly declares the --help flag.
+    // Initializations are performed by init().
+    HorseWhisperer() {
+        init();
+    }
+
+    void reset() {
+        clean();
+        init();
+    }
+
+    void setAppName(std::string name) {
+        application_name_ = std::move(name);
+    }
+
+    void setHelpBanner(std::string banner) {
+        help_banner_ = std::move(banner);
+    }
+
+    void setVersionString(std::string version_string, std::string short_flag_string) {
+        version_string_ = version_string;
+        version_short_flag_string_ = short_flag_string;
+        std::string flag_string = "version";
+        if (short_flag_string != "") {
+            flag_string = short_flag_string + " " + flag_string;
+        }
+        defineGlobalFlag<bool>(flag_string, "Display version information and quit",
+                               false, nullptr);
+    }
+
+    void setDelimiters(const std::vector<std::string>& delimiters) {
+        delimiters_ = delimiters;
+    }
+
+    bool isDelimiter(const char* argument) const {
+        if (std::find(delimiters_.begin(), delimiters_.end(), argument)
+                != delimiters_.end()) {
+            return true;
+        }
+        return false;
+    }
+
+    // A lone "-" is an argument (stdin, for streaming actions)
+    static bool isFlagToken(const char* token) {
+        return token[0] == '-' && token[1] != '\0';
+    }
+
+    bool isActionFlag(const std::string& action_name, const std::string& flagname) {
+        for (auto scope = findAction(action_name).get(); scope; scope = scope->group.get()) {
+            if (flag_table_.find(scope->scope, flagname) != NO_FLAG) {
+                return true;
             }
         }
         return false;
     }
 
-    void setContextFlags(ContextPtr& action_context, const std::string& action_name) {
+    void setContextFlags(ContextPtr& action_context, const Action& action) {
         // Copy the specific action flags, so that, in case this
         // action has been chained multiple times, each context
         // will have a different flag instance, thus allowing to
         // parse and store different flag values - example:
         // `app_name action_1 --flag_a foo + action_1 --flag_a bar`
-        for (auto& k_v : actions_[action_name]->flags) {
-            // However, if we have already been set as an alias in
-            // setActionFlags we don't have to do it again.
-            if (action_context->flags[k_v.first]) {
-                continue;
-            }
-            switch (getTypeOfFlag(k_v.second.get())) {
-                case FlagType::Bool: {
-                    action_context->flags[k_v.first] = std::make_shared<Flag<bool>>(
-                        *(std::static_pointer_cast<Flag<bool>>(k_v.second)));
-                    break;
-                }
-                case FlagType::String: {
-                    action_context->flags[k_v.first] = std::make_shared<Flag<std::string>>(
-                        *(std::static_pointer_cast<Flag<std::string>>(k_v.second)));
-                    break;
-                }
-                case FlagType::Int: {
-                    action_context->flags[k_v.first] = std::make_shared<Flag<int>>(
-                        *(std::static_pointer_cast<Flag<int>>(k_v.second)));
-                    break;
-                }
-                case FlagType::Double: {
-                    action_context->flags[k_v.first] = std::make_shared<Flag<double>>(
-                        *(std::static_pointer_cast<Flag<double>>(k_v.second)));
-                    break;
-                }
-                case FlagType::MultiString: {
-                    action_context->flags[k_v.first] = std::make_shared<Flag<MultiString>>(
-                        *(std::static_pointer_cast<Flag<MultiString>>(k_v.second)));
-                }
+        // Flag ids are assigned in increasing order, so the context
+        // flags are sorted by id
+        // The flags of the groups containing the action are copied too
+        size_t num_flags { 0 };
+        for (auto scope = &action; scope; scope = scope->group.get()) {
+            num_flags += scope->flag_ids.size();
+        }
+        action_context->flags.reserve(num_flags);
+        if (action.make_options) {
+            action_context->options = action.make_options();
+        }
+        for (auto scope = &action; scope; scope = scope->group.get()) {
+            for (auto id : scope->flag_ids) {
+                action_context->flags.emplace_back(id, flag_table_.value(id)->clone());
+                action_context->flags.back().second->bind(action_context->options.get());
             }
+        }
+        if (action.group) {
+            std::sort(action_context->flags.begin(), action_context->flags.end(),
+                      [](const std::pair<FlagId, std::unique_ptr<FlagBase>>& lhs,
+                         const std::pair<FlagId, std::unique_ptr<FlagBase>>& rhs) {
+                          return lhs.first < rhs.first;
+                      });
+        }
+    }
+
+    ParseResult parse(int argc, char* argv[]) {
+        auto& tracer = Tracer::Instance();
+        auto tokenize_begin = tracer.now();
+
+        deferred_validations_.clear();
+        deferring_validation_ = concurrent_validation_;
+        tokenizing_ = true;
+        auto result = tokenize(argc, argv);
+        tokenizing_ = false;
+        deferring_validation_ = false;
+
+        // Tracing may have been enabled by --trace-file while tokenizing
+        if (tracer.enabled()) {
+            traceTokenization(argv, tokenize_begin, tracer.now());
+        }
+        pending_flag_spans_.clear();
 
-            std::istringstream iss { k_v.second->aliases };
-            std::string tmp;
-            while (iss >> tmp) {
-                action_context->flags[tmp] = action_context->flags[k_v.first];
+        if (result != ParseResult::OK) {
+            deferred_validations_.clear();
+            return result;
+        }
+
+        // Groups only select their actions
+        for (const auto& context : context_mgr_) {
+            if (context->action && context->action->is_group) {
+                std::cout << "Missing action for group '" << context->action->name
+                          << "'. See \"" << application_name_ << " "
+                          << context->action->name << " --help\" for available actions."
+                          << std::endl;
+                deferred_validations_.clear();
+                return ParseResult::FAILURE;
             }
         }
+
+        result = convertActionArguments();
+        if (result != ParseResult::OK) {
+            deferred_validations_.clear();
+            return result;
+        }
+
+        validateActionArguments();
+
+        parsed_ = true;
+        return ParseResult::OK;
     }
 
-    ParseResult parse(int argc, char* argv[]) {
+    // Process the command line tokens, building the chain of contexts
+    ParseResult tokenize(int argc, char* argv[]) {
         for (int arg_idx = 1; arg_idx < argc; arg_idx++) {
             // Identify if it's a flag
             if (argv[arg_idx][0] == '-') {
@@ -416,14 +4443,27 @@ class HORSEWHISPERER_EXPORT HorseWhisperer {
             } else if (isDelimiter(argv[arg_idx])) {  // skip over delimiter
                 continue;
             } else {
-                std::string action = argv[arg_idx];
+                auto node = findActionNode(CommandTrie::ROOT, argv[arg_idx]);
+
+                // Each of the following tokens that names an action of
+                // the group selects it
+                while (node != CommandTrie::NO_NODE && command_trie_.action(node)->is_group
+                       && arg_idx + 1 < argc) {
+                    auto child = findActionNode(node, argv[arg_idx + 1]);
+                    if (child == CommandTrie::NO_NODE) {
+                        break;
+                    }
+                    node = child;
+                    arg_idx++;
+                }
 
-                if (isActionDefined(action)) {
+                if (node != CommandTrie::NO_NODE) {
+                    auto& action_entry = command_trie_.action(node);
+                    const std::string& action = action_entry->name;
                     ContextPtr action_context { new Context() };
-                    action_context->flags = std::map<std::string, std::shared_ptr<FlagBase>> {};
-                    setContextFlags(action_context, action);
-                    action_context->action = actions_[argv[arg_idx]];
-                    action_context->arguments = Arguments {};
+                    setContextFlags(action_context, *action_entry);
+                    action_context->action = action_entry;
+                    action_context->position = arg_idx;
                     context_mgr_.push_back(std::move(action_context));
                     current_context_idx_++;
 
@@ -440,7 +4480,7 @@ class HORSEWHISPERER_EXPORT HorseWhisperer {
                             ++arg_idx;
                             if (arg_idx >= argc) {  // have we run out of tokens?
                                 break;
-                            } else if (argv[arg_idx][0] == '-') {  // is it a flag token?
+                            } else if (isFlagToken(argv[arg_idx])) {  // is it a flag token?
                                 auto parse_flag_outcome = parseFlag(argv, arg_idx);
                                 if (parse_flag_outcome != ParseResult::OK) {
                                     return parse_flag_outcome;
@@ -478,7 +4518,7 @@ class HORSEWHISPERER_EXPORT HorseWhisperer {
                             if (arg_idx >= argc) {
                                 // No more tokens
                                 break;
-                            } else if (argv[arg_idx][0] == '-') {
+                            } else if (isFlagToken(argv[arg_idx])) {
                                 auto parse_flag_outcome = parseFlag(argv, arg_idx);
                                 if (parse_flag_outcome != ParseResult::OK) {
                                     return parse_flag_outcome;
@@ -508,30 +4548,188 @@ class HORSEWHISPERER_EXPORT HorseWhisperer {
             }
         }
 
-        validateActionArguments();
+        return ParseResult::OK;
+    }
 
-        parsed_ = true;
+    // Convert the arguments of the actions with typed parameters, in
+    // command line order, writing them to the bound variables; the
+    // parameters without argument get their default value
+    ParseResult convertActionArguments() {
+        for (auto& context : context_mgr_) {
+            if (!context->action || context->action->parameters.empty()) {
+                continue;
+            }
+            TraceScope trace { context->action->name, "arguments" };
+            auto& parameters = context->action->parameters;
+            for (size_t idx = 0; idx < parameters.size(); idx++) {
+                auto value = parameters[idx].value->clone();
+                value->bind(context->options.get());
+                if (idx < context->arguments.size()) {
+                    auto result = convertArgument(*context, idx, *value);
+                    if (result != ParseResult::OK) {
+                        return result;
+                    }
+                }
+            }
+        }
         return ParseResult::OK;
     }
 
+    ParseResult convertArgument(const Context& context, size_t idx, FlagBase& value) {
+        const auto& argument = context.arguments[idx];
+        const char* expected { nullptr };
+
+        switch (value.type) {
+            case FlagType::Bool:
+                if (argument == "true" || argument == "false") {
+                    setArgument<bool>(context, idx, value, argument == "true");
+                } else {
+                    expected = "'true' or 'false'";
+                }
+                break;
+            case FlagType::String:
+                setArgument<std::string>(context, idx, value, argument);
+                break;
+            case FlagType::Int: {
+                int parsed;
+                if (parseInteger(argument, parsed)) {
+                    setArgument<int>(context, idx, value, parsed);
+                } else {
+                    expected = "a value of type integer";
+                }
+                break;
+            }
+            case FlagType::Double:
+                if (validateDouble(argument)) {
+                    setArgument<double>(context, idx, value, std::stod(argument));
+                } else {
+                    expected = "a value of type double";
+                }
+                break;
+            case FlagType::MultiString:
+                setArgument<MultiString>(context, idx, value,
+                                         MultiString(context.arguments.begin() + idx,
+                                                     context.arguments.end()));
+                break;
+            case FlagType::IntList: {
+                IntList values {};
+                if (parseList(argument.c_str(), values)) {
+                    setArgument<IntList>(context, idx, value, std::move(values));
+                } else {
+                    expected = "a list of integers";
+                }
+                break;
+            }
+            case FlagType::DoubleList: {
+                DoubleList values {};
+                if (parseList(argument.c_str(), values)) {
+                    setArgument<DoubleList>(context, idx, value, std::move(values));
+                } else {
+                    expected = "a list of doubles";
+                }
+                break;
+            }
+        }
+
+        if (expected) {
+            std::cout << describeArgument(context, idx) << " expects " << expected
+                      << ", got '" << argument << "'" << std::endl;
+            return ParseResult::FAILURE;
+        }
+        return ParseResult::OK;
+    }
+
+    template <typename Type>
+    static void setArgument(const Context& context, size_t idx, FlagBase& value,
+                            Type argument) {
+        auto& parameter = static_cast<Flag<Type>&>(value);
+        if (parameter.flag_callback) {
+            try {
+                parameter.flag_callback(argument);
+            } catch (action_validation_error&) {
+                throw;
+            } catch (std::exception& e) {
+                throw action_validation_error { "failed to validate "
+                                                + describeArgument(context, idx)
+                                                + " - " + e.what() };
+            }
+        }
+        parameter.set(std::move(argument));
+    }
+
+    static std::string describeArgument(const Context& context, size_t idx) {
+        return "argument " + std::to_string(idx + 1) + " ('"
+               + context.action->parameters[idx].name + "') of action '"
+               + context.action->name + "'";
+    }
+
     void validateActionArguments() {
-        if (context_mgr_.size() > 1) {
+        TraceScope trace { "validateActionArguments", "parse" };
+        if (concurrent_validation_) {
+            validateConcurrently();
+        } else if (context_mgr_.size() > 1) {
             for (auto & context : context_mgr_) {
                 if (context->action && context->action->arguments_callback) {
-                    try {
-                        context->action->arguments_callback(context->arguments);
-                    } catch (action_validation_error) {
-                        throw;
-                    } catch (std::exception& e) {
-                        throw action_validation_error { "failed to validate "
-                                                        + context->action->name
-                                                        + " argument - " + e.what() };
-                    }
+                    validateContextArguments(*context);
                 }
             }
         }
     }
 
+    static void validateContextArguments(const Context& context) {
+        TraceScope trace { context.action->name, "arguments" };
+        try {
+            context.action->arguments_callback(context.arguments);
+        } catch (action_validation_error) {
+            throw;
+        } catch (std::exception& e) {
+            throw action_validation_error { "failed to validate "
+                                            + context.action->name
+                                            + " argument - " + e.what() };
+        }
+    }
+
+    // Run the flag validations deferred while tokenizing together with
+    // the arguments callbacks; errors are reported deterministically,
+    // as the first failure in command line order. The validated flag
+    // values are stored only once all the validations succeeded.
+    void validateConcurrently() {
+        auto validations = std::move(deferred_validations_);
+        deferred_validations_.clear();
+
+        for (size_t idx = 1; idx < context_mgr_.size(); idx++) {
+            const Context* context = context_mgr_[idx].get();
+            if (context->action && context->action->arguments_callback) {
+                validations.push_back(DeferredValidation {
+                    context->position,
+                    [context]() { validateContextArguments(*context); },
+                    nullptr });
+            }
+        }
+
+        std::stable_sort(validations.begin(), validations.end(),
+                         [](const DeferredValidation& a, const DeferredValidation& b) {
+                             return a.position < b.position;
+                         });
+
+        std::vector<std::function<void()>> tasks {};
+        for (auto& validation : validations) {
+            tasks.push_back(validation.validate);
+        }
+
+        for (auto& error : runConcurrently(tasks, validation_threads_)) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        for (auto& validation : validations) {
+            if (validation.store) {
+                validation.store();
+            }
+        }
+    }
+
     // Dynamically output help information based on registered global and action
     // specific flags
     void help(bool show_actions_help) {
@@ -555,30 +4753,124 @@ class HORSEWHISPERER_EXPORT HorseWhisperer {
         current_context_idx_ = GLOBAL_CONTEXT_IDX - 1;
         int previous_exit_code = EXIT_SUCCESS;
 
-        if (context_mgr_.size() > 1) {
+        action_counters_.clear();
+        action_resources_.clear();
+        action_results_.clear();
+        forked_outcomes_.clear();
+        auto counting = countersRequested();
+        if (counting && !perf_counters_.open()) {
+            HORSEWHISPERER_LOG(1) << "Hardware counters are not available; "
+                                  << "counting the software events only";
+        }
+
+        if (context_mgr_.size() > 1 && !openJournal()) {
+            previous_exit_code = EXIT_FAILURE;
+        } else if (context_mgr_.size() > 1) {
+            SignalGuard signal_guard {};
+            Watchdog watchdog {};
+            // Buffered output is still live on terminals, as with stdio
+            // line buffering
+            std::unique_ptr<ChainOutput> chain_output {};
+            if (output_mode_ == OutputMode::Buffered || output_capture_) {
+                chain_output.reset(new ChainOutput { std::cout,
+                                                     output_mode_ != OutputMode::Buffered
+                                                         || isTerminal(),
+                                                     output_capture_ });
+            }
+
             for (size_t i = 0; i < context_mgr_.size(); i++) {
                 current_context_idx_++;
+                if (chain_output) {
+                    chain_output->commit();
+                }
                 if (context_mgr_[i]->action) {
                     auto& current_action = context_mgr_[i]->action;
-                    if (previous_exit_code != EXIT_SUCCESS) {
+                    // Computed before the action can change any flag
+                    auto fingerprint = journal_.isOpen()
+                                       ? fingerprintContext(*context_mgr_[i]) : 0;
+                    // Forked actions run in batches; the outcomes of the ones
+                    // that ran are reported even after a failure
+                    auto forked_outcome = forked_outcomes_.find(i);
+                    auto forked_ran = forked_outcome != forked_outcomes_.end();
+                    if (previous_exit_code != EXIT_SUCCESS && !forked_ran) {
                         std::cout << "Not starting action '"
                                   << current_action->name
                                   << "'. Previous action failed to complete "
                                   << "successfully." << std::endl;
-                    } else if (!current_action->action_callback) {
+                    } else if (!hasCallback(*current_action)) {
                         std::cout << "No calback has been defined for action '"
                                   << current_action->name << "'." << std::endl;
                         previous_exit_code = EXIT_FAILURE;
+                    } else if (forked_ran ? forked_outcome->second.skipped
+                                          : journal_.isOpen()
+                                            && journal_.takeCompleted(fingerprint)) {
+                        HORSEWHISPERER_LOG(1) << "Skipping action '"
+                                              << current_action->name
+                                              << "'; it already completed according "
+                                              << "to the journal";
                     } else {
                         // Record the current_context_idx_. Calling parse inside
                         // an action_callback allows the context list to grow
                         // during execution but has the side effect of mutating
                         // the current_context_index.
                         int tmp = current_context_idx_;
-
-                        previous_exit_code = current_action->action_callback(
-                                                context_mgr_[i]->arguments);
+                        int exit_code;
+                        if (current_action->forked && forkSupported()) {
+                            exit_code = runForkedAction(i);
+                        } else {
+                            auto resources_before = ResourceSnapshot::take();
+                            if (counting) {
+                                perf_counters_.start();
+                            }
+                            exit_code = runAction(*context_mgr_[i], watchdog);
+                            if (counting) {
+                                action_counters_.push_back(
+                                    perf_counters_.stop(current_action->name));
+                            }
+                            recordResources(resources_before, current_action->name,
+                                            exit_code);
+                            action_results_.push_back(ActionResult {
+                                current_action->name, exit_code,
+                                std::move(action_result_), std::string {} });
+                            action_result_.clear();
+                        }
                         current_context_idx_ = tmp;
+
+                        auto signal_number = SignalState<>::received.load();
+                        if (signal_number != 0) {
+                            std::cout << "Action '" << current_action->name
+                                      << "' interrupted by signal " << signal_number
+                                      << "; skipping the following actions." << std::endl;
+                            previous_exit_code = 128 + signal_number;
+                            break;
+                        }
+
+                        if (cancellation_token_.reason() == CancellationReason::Timeout) {
+                            std::cout << "Action '" << current_action->name
+                                      << "' exceeded its deadline of "
+                                      << actionDeadline(*current_action).count()
+                                      << " ms." << std::endl;
+                            exit_code = ACTION_TIMEOUT_EXIT_CODE;
+                        }
+
+                        if (journal_.isOpen()
+                                && !journal_.record(fingerprint, exit_code,
+                                                    current_action->name,
+                                                    context_mgr_[i]->arguments)) {
+                            std::cout << "Failed to record action '"
+                                      << current_action->name << "' in the journal: "
+                                      << std::strerror(errno) << std::endl;
+                            exit_code = EXIT_FAILURE;
+                        }
+
+                        if (output_capture_) {
+                            action_results_.back().output = chain_output->take();
+                        }
+
+                        // The first failure of a batch of forked actions is kept
+                        if (previous_exit_code == EXIT_SUCCESS) {
+                            previous_exit_code = exit_code;
+                        }
                     }
 
                     if (!current_action->chainable) {
@@ -597,113 +4889,341 @@ class HORSEWHISPERER_EXPORT HorseWhisperer {
                       << " --help\" for available actions." << std::endl;
         }
 
+        // The workers were shared by the chained actions
+        executor_.shutdown();
+        forked_outcomes_.clear();
+        journal_.close();
+        if (counting) {
+            reportCounters();
+            perf_counters_.close();
+        }
+        Logger::Instance().flush();
+        if (Tracer::Instance().enabled()) {
+            Tracer::Instance().write();
+        }
         return previous_exit_code;
     }
 
     template <typename Type>
     void defineGlobalFlag(std::string aliases, std::string description,
-                          Type default_value, FlagCallback<Type> flag_callback) {
-        auto flagp = std::make_shared<Flag<Type>>();
-        flagp->aliases = std::move(aliases);
+                          Type default_value, FlagCallback<Type> flag_callback,
+                          FlagBinding<Type> binding = nullptr,
+                          uint8_t attributes = 0) {
+        std::unique_ptr<Flag<Type>> flagp { new Flag<Type>() };
         flagp->value = std::move(default_value);
-        flagp->description = std::move(description);
         flagp->flag_callback = std::move(flag_callback);
-        // Aliases are space separated
-        std::istringstream iss { flagp->aliases };
-        while (iss) {
-            std::string tmp;
-            iss >> tmp;
-            context_mgr_[GLOBAL_CONTEXT_IDX]->flags[tmp] = flagp;
-        }
+        flagp->binding = std::move(binding);
+        flagp->bind(nullptr);
 
-        // vlevel is special and we don't want it showing up in the help list
-        if (flagp->aliases != "vlevel") {
-            registered_flags_["global"].push_back(flagp);
+        if (description == "<hidden>") {
+            attributes |= FLAG_HIDDEN;
         }
+        flag_table_.define(GLOBAL_SCOPE, aliases, description,
+                           std::move(flagp), attributes);
     }
 
     template <typename Type>
-    void defineActionFlag(std::string action_name, std::string aliases, std::string description,
-                          Type default_value, FlagCallback<Type> flag_callback) {
-        auto flagp = std::make_shared<Flag<Type>>();
-        flagp->aliases = std::move(aliases);
+    void defineActionFlag(const std::string& action_name, std::string aliases,
+                          std::string description, Type default_value,
+                          FlagCallback<Type> flag_callback,
+                          FlagBinding<Type> binding = nullptr) {
+        // Action flags are bound in each context
+        std::unique_ptr<Flag<Type>> flagp { new Flag<Type>() };
         flagp->value = std::move(default_value);
-        flagp->description = std::move(description);
         flagp->flag_callback = std::move(flag_callback);
-        // Aliases are space separated
-        std::istringstream iss { flagp->aliases };
-        std::string tmp;
-        auto &action = actions_[action_name];
+        flagp->binding = std::move(binding);
+        auto& action = findAction(action_name);
         assert(action);
-        while (iss >> tmp) {
-            action->flags[tmp] = flagp;
-        }
-        registered_flags_[action_name].push_back(flagp);
+        action->flag_ids.push_back(
+            flag_table_.define(action->scope, aliases, description, std::move(flagp),
+                               description == "<hidden>" ? FLAG_HIDDEN : 0));
     }
 
-    void defineAction(std::string name, int arity, bool chainable,
-                      std::string description, std::string help_string,
-                      ActionCallback action_callback,
-                      ArgumentsCallback arguments_callback,
-                      bool variable_arity) {
+    Action& defineAction(std::string name, int arity, bool chainable,
+                         std::string description, std::string help_string,
+                         ActionCallback action_callback,
+                         ArgumentsCallback arguments_callback,
+                         bool variable_arity) {
         auto actionp = std::make_shared<Action>();
         actionp->name = std::move(name);
-        actionp->arity = std::move(arity);
+        actionp->is_group = false;
+        actionp->node = command_trie_.insert(actionp->name);
+        actionp->group = defineGroupOf(actionp->node);
+        actionp->scope = next_action_scope_++;
+        if (!command_trie_.accepts(actionp->node, actionp->scope)) {
+            // The definitions differ from the ones of the schema image
+            command_trie_.detach();
+            actionp->node = command_trie_.insert(actionp->name);
+        }
+        actionp->arity = arity;
         actionp->description = std::move(description);
         actionp->help_string_ = std::move(help_string);
         actionp->action_callback = std::move(action_callback);
         actionp->arguments_callback = std::move(arguments_callback);
-        actionp->chainable = std::move(chainable);
-        actionp->variable_arity = std::move(variable_arity);
-        actions_[actionp->name] = actionp;
+        actionp->chainable = chainable;
+        actionp->variable_arity = variable_arity;
+        actionp->idempotent = false;
+        actionp->cache_ttl = std::chrono::seconds { 0 };
+        actionp->deadline = std::chrono::milliseconds { 0 };
+        actionp->forked = false;
+        actionp->per_argument = false;
+        actionp->exit_code_policy = ExitCodePolicy::FirstFailure;
+        auto& action = *actionp;
+        command_trie_.setAction(action.node, std::move(actionp));
+        return action;
+    }
+
+    template <typename Type>
+    void defineActionArgument(const std::string& action_name, std::string name,
+                              std::string description, Type default_value,
+                              FlagCallback<Type> validation_callback,
+                              FlagBinding<Type> binding) {
+        std::shared_ptr<Flag<Type>> value { new Flag<Type>() };
+        value->value = std::move(default_value);
+        value->flag_callback = std::move(validation_callback);
+        value->binding = std::move(binding);
+        auto& action = findAction(action_name);
+        assert(action);
+        action->parameters.push_back(
+            Parameter { std::move(name), std::move(description), std::move(value) });
+    }
+
+    void defineActionWithOptions(std::string name, int arity, bool chainable,
+                                 std::string description, std::string help_string,
+                                 std::function<std::shared_ptr<void>()> make_options,
+                                 std::function<int(const Arguments&, const void*)> action_callback,
+                                 ArgumentsCallback arguments_callback,
+                                 bool variable_arity) {
+        auto& action = defineAction(std::move(name), arity, chainable,
+                                    std::move(description), std::move(help_string),
+                                    nullptr, std::move(arguments_callback),
+                                    variable_arity);
+        action.make_options = std::move(make_options);
+        action.options_callback = std::move(action_callback);
+    }
+
+    void defineStreamingAction(std::string name, int arity, bool chainable,
+                               std::string description, std::string help_string,
+                               StreamingActionCallback action_callback,
+                               ArgumentsCallback arguments_callback) {
+        defineAction(std::move(name), arity, chainable, std::move(description),
+                     std::move(help_string), nullptr, std::move(arguments_callback),
+                     true).streaming_callback = std::move(action_callback);
+    }
+
+    void defineActionGroup(std::string path, std::string description,
+                           std::string help_string) {
+        // The group may have been added by the definition of one of its
+        // actions; keep it, as its actions refer to it
+        auto& existing = command_trie_.action(command_trie_.insert(path));
+        if (existing && existing->is_group) {
+            existing->description = std::move(description);
+            existing->help_string_ = std::move(help_string);
+            return;
+        }
+
+        defineAction(std::move(path), 0, false, std::move(description),
+                     std::move(help_string), nullptr, nullptr, false).is_group = true;
+    }
+
+    // Return the group containing the specified node, defining the
+    // missing groups of its path
+    std::shared_ptr<Action> defineGroupOf(uint32_t node) {
+        auto parent = command_trie_.parent(node);
+        if (parent == CommandTrie::ROOT) {
+            return nullptr;
+        }
+        if (!command_trie_.action(parent)) {
+            defineActionGroup(command_trie_.path(parent), "", "");
+        }
+        assert(command_trie_.action(parent)->is_group);
+        return command_trie_.action(parent);
+    }
+
+    uint64_t saveSchema(const std::string& path) const {
+        SchemaWriter writer {};
+        flag_table_.save(writer);
+        command_trie_.save(writer);
+        return writer.write(path);
+    }
+
+    bool loadSchema(const std::string& path, uint64_t checksum) {
+        std::unique_ptr<SchemaImage> image { new SchemaImage() };
+        if (!image->map(path, checksum)) {
+            return false;
+        }
+
+        clean();
+        schema_ = std::move(image);
+        auto attached = flag_table_.attach(*schema_) && command_trie_.attach(*schema_);
+        if (!attached) {
+            clean();
+        }
+        // The built-in flags are bound first
+        init();
+        return attached;
+    }
+
+    void setConcurrentValidation(bool enabled, unsigned int num_threads) {
+        concurrent_validation_ = enabled;
+        validation_threads_ = num_threads;
+    }
+
+    void setActionForked(const std::string& action_name) {
+        auto& action = findAction(action_name);
+        assert(action);
+        action->forked = true;
+    }
+
+    void setActionPerArgument(const std::string& action_name, ExitCodePolicy policy) {
+        auto& action = findAction(action_name);
+        assert(action);
+        // The arguments of a streaming action are read while it runs
+        assert(!action->streaming_callback);
+        assert(action->arity <= 1);
+        action->per_argument = true;
+        action->exit_code_policy = policy;
+    }
+
+    void setOutputMode(OutputMode mode) {
+        output_mode_ = mode;
+    }
+
+    void setOutputCapture(bool enabled) {
+        output_capture_ = enabled;
+    }
+
+    void setMaxForkedActions(unsigned int max_processes) {
+        max_forked_actions_ = max_processes;
+    }
+
+    // In a forked child the result goes to the slot of the action
+    void setActionResult(std::string result) {
+        if (!fork_slot_) {
+            action_result_ = std::move(result);
+            return;
+        }
+        if (result.size() > ForkChannel::RESULT_CAPACITY) {
+            throw horsewhisperer_error { "the result of a forked action can't exceed "
+                                         + std::to_string(ForkChannel::RESULT_CAPACITY)
+                                         + " bytes" };
+        }
+        std::memcpy(fork_slot_->result, result.data(), result.size());
+        fork_slot_->result_size = static_cast<uint32_t>(result.size());
+    }
+
+    const std::vector<ActionResult>& actionResults() const {
+        return action_results_;
+    }
+
+    void setActionIdempotent(const std::string& action_name, std::chrono::seconds ttl) {
+        auto& action = findAction(action_name);
+        assert(action);
+        action->idempotent = true;
+        action->cache_ttl = ttl;
+    }
+
+    void setActionDeadline(const std::string& action_name,
+                           std::chrono::milliseconds deadline) {
+        auto& action = findAction(action_name);
+        assert(action);
+        action->deadline = deadline;
+    }
+
+    CancellationToken cancellationToken() const {
+        return cancellation_token_;
+    }
+
+    ActionCache& actionCache() {
+        return action_cache_;
+    }
+
+    const std::vector<ActionCounters>& actionCounters() const {
+        return action_counters_;
+    }
+
+    const std::vector<ActionResources>& actionResources() const {
+        return action_resources_;
+    }
+
+    Executor& executor() {
+        return executor_;
     }
 
     template <typename Type>
     Type getFlagValue(std::string const& name) {
-        int context_idx = getContextIdxIfDefined(name);
-        if (context_idx != NO_CONTEXT_IDX) {
-            return std::static_pointer_cast<Flag<Type>>(context_mgr_[context_idx]->flags[name])->value;
+        auto flagp = lookupFlag(name);
+        if (flagp) {
+            return static_cast<Flag<Type>*>(flagp)->value;
         }
 
         throw undefined_flag_error { "undefined flag: " + name };
     }
 
     FlagType checkAndGetTypeOfFlag(const std::string& flag_name) {
-        int context_idx = getContextIdxIfDefined(flag_name);
+        auto flagp = lookupFlag(flag_name);
 
-        if (context_idx == NO_CONTEXT_IDX) {
+        if (!flagp) {
             throw undefined_flag_error { "undefined flag: " + flag_name };
         }
 
-        return getTypeOfFlag(context_mgr_[context_idx]->flags[flag_name].get());
+        return getTypeOfFlag(flagp);
     }
 
     // ALSO check both contexts
     template <typename Type>
     void setFlag(std::string const& name, Type value) {
-        int context_idx = getContextIdxIfDefined(name);
-        if (context_idx != NO_CONTEXT_IDX) {
-            auto flagp = std::static_pointer_cast<Flag<Type>>(
-                                    context_mgr_[context_idx]->flags[name]);
-
-            if (flagp->flag_callback) {
-                try {
-                    flagp->flag_callback(value);
-                } catch (flag_validation_error) {
-                    throw;
-                } catch (std::exception& e) {
-                    throw flag_validation_error { "failed to validate '" + name
-                                                  + "' flag: " + e.what() };
-                }
+        auto id = lookupFlagId(name);
+        auto flagp = static_cast<Flag<Type>*>(flagValue(id));
+        if (flagp) {
+            // A deferred value is stored once all the validations succeed
+            if (flagp->flag_callback && deferring_validation_
+                    && !flag_table_.hasAttribute(id, FLAG_VALIDATE_INLINE)) {
+                deferFlagValidation(name, flagp, value);
+                return;
+            } else if (flagp->flag_callback) {
+                auto& tracer = Tracer::Instance();
+                auto begin = tracer.now();
+                validateFlagValue(name, *flagp, value);
+                traceFlagValidation(name, begin, tracer.now());
             }
 
-            flagp->value = std::move(value);
+            flagp->set(std::move(value));
             return;
         }
 
         throw undefined_flag_error { "undefined flag: " + name };
     }
 
+    template <typename Type>
+    static void validateFlagValue(const std::string& name, Flag<Type>& flag,
+                                  Type& value) {
+        try {
+            flag.flag_callback(value);
+        } catch (flag_validation_error) {
+            throw;
+        } catch (std::exception& e) {
+            throw flag_validation_error { "failed to validate '" + name
+                                          + "' flag: " + e.what() };
+        }
+    }
+
+    // The callback may modify the value it validates, so it's given a
+    // copy which is stored once all the validations succeed
+    template <typename Type>
+    void deferFlagValidation(const std::string& name,
+                             Flag<Type>* flagp,
+                             const Type& value) {
+        auto validated = std::make_shared<Type>(value);
+        deferred_validations_.push_back(DeferredValidation {
+            validation_position_,
+            [name, flagp, validated]() {
+                TraceScope trace { name, "flag" };
+                validateFlagValue(name, *flagp, *validated);
+            },
+            [flagp, validated]() { flagp->set(*validated); } });
+    }
+
     std::vector<std::string> getParsedActions() {
         std::vector<std::string> action_container {};
 
@@ -730,89 +5250,855 @@ class HORSEWHISPERER_EXPORT HorseWhisperer {
            << std::to_string(current_context_idx_);
         if (context_mgr_.size() > 1) {
             for (size_t idx = 1; idx < context_mgr_.size(); idx++) {
-                ss << "\n" << context_mgr_[idx]->toString();
+                ss << "\n" << contextToString(*context_mgr_[idx]);
+            }
+        }
+        std::cout << ss.str() << "\n";
+    }
+
+  private:
+    // Validation postponed until the command line is tokenized
+    struct DeferredValidation {
+        // Position of the validated token in the command line
+        int position;
+        std::function<void()> validate;
+        // Stores the validated value, if any
+        std::function<void()> store;
+    };
+
+    // Index of the context currently being processed
+    int current_context_idx_;
+
+    // Container of contexts
+    std::vector<ContextPtr> context_mgr_;
+
+    // Registered actions and groups, by path
+    CommandTrie command_trie_;
+
+    // Schema image the definitions are bound to, if any
+    std::unique_ptr<SchemaImage> schema_;
+
+    // Definitions of the global and action flags
+    FlagTable flag_table_;
+
+    // Flag scope of the next defined action
+    uint32_t next_action_scope_;
+
+    // Whether CL args have been parsed
+    bool parsed_;
+
+    // Action delimeters
+    std::vector<std::string> delimiters_;
+
+    // Application name
+    std::string application_name_;
+
+    // Text header of the help message
+    std::string help_banner_;
+
+    // Version information
+    std::string version_string_;
+    std::string version_short_flag_string_;
+
+    // Margins, indicated as number of columns
+    unsigned int description_margin_left_;
+    unsigned int description_margin_right_;
+
+    // Outcomes of the idempotent actions
+    ActionCache action_cache_;
+
+    // Contexts executed by the chain, for --journal and --resume
+    Journal journal_;
+
+    // Counters of the actions executed by the chain, for --hw-counters
+    PerfCounters perf_counters_;
+    std::vector<ActionCounters> action_counters_;
+
+    // Resources used by the actions executed by the chain
+    std::vector<ActionResources> action_resources_;
+
+    // Result set by the running action and the results of the chain
+    std::string action_result_;
+    std::vector<ActionResult> action_results_;
+
+    // How the output of the actions is written, and whether it's captured
+    // in their results instead
+    OutputMode output_mode_;
+    bool output_capture_;
+
+    // Forked actions: the maximum number of children running at a time
+    // (all the CPUs if zero), the outcomes of the current batch by
+    // context index and, in a child, the slot of its action
+    unsigned int max_forked_actions_;
+    std::map<size_t, ForkedOutcome> forked_outcomes_;
+    ForkChannel::Slot* fork_slot_;
+
+    // Concurrent validation settings and state
+    bool concurrent_validation_;
+    unsigned int validation_threads_;
+    bool deferring_validation_;
+    int validation_position_;
+    std::vector<DeferredValidation> deferred_validations_;
+
+    // The built-in --timeout, --journal, --resume and --hw-counters flags
+    FlagId timeout_flag_id_;
+    FlagId journal_flag_id_;
+    FlagId resume_flag_id_;
+    FlagId hw_counters_flag_id_;
+    FlagId hw_counters_file_flag_id_;
+
+    // Tracing state; the definition span goes from init() to the first
+    // parse() call
+    struct PendingSpan {
+        int position;
+        int64_t begin;
+        int64_t end;
+    };
+    bool tokenizing_;
+    bool definition_traced_;
+    int64_t definition_begin_;
+    std::vector<PendingSpan> pending_flag_spans_;
+
+    // Token of the running (or last run) action
+    CancellationToken cancellation_token_;
+
+    // Thread pool of the actions, sized by the --jobs flag
+    Executor executor_;
+
+    void clean() {
+        context_mgr_.clear();
+        command_trie_.clear();
+        flag_table_.clear();
+        schema_.reset();
+        delimiters_.clear();
+        action_cache_.reset();
+        journal_.close();
+        perf_counters_.close();
+        action_counters_.clear();
+        action_resources_.clear();
+        action_result_.clear();
+        action_results_.clear();
+        forked_outcomes_.clear();
+        executor_.shutdown();
+    }
+
+    void init() {
+        Tracer::Instance().reset();
+        definition_begin_ = Tracer::Instance().now();
+        definition_traced_ = false;
+        tokenizing_ = false;
+        pending_flag_spans_.clear();
+        current_context_idx_ = GLOBAL_CONTEXT_IDX;
+        next_action_scope_ = GLOBAL_SCOPE + 1;
+
+        ContextPtr global_context { new Context() };
+        global_context->action = nullptr;
+        global_context->position = 0;
+        context_mgr_.push_back(std::move(global_context));
+
+        parsed_ = false;
+        application_name_ = "";
+        help_banner_ = "";
+        version_string_ = "";
+        version_short_flag_string_ = "";
+        description_margin_left_ = DESCRIPTION_MARGIN_LEFT_DEFAULT;
+        description_margin_right_ = DESCRIPTION_MARGIN_RIGHT_DEFAULT;
+        concurrent_validation_ = false;
+        validation_threads_ = 0;
+        deferring_validation_ = false;
+        validation_position_ = 0;
+        deferred_validations_.clear();
+        max_forked_actions_ = 0;
+        fork_slot_ = nullptr;
+        output_mode_ = OutputMode::Ordered;
+        output_capture_ = false;
+
+        defineGlobalFlag<bool>("h help", "Show this message", false, nullptr);
+        // vlevel is special and we don't want it showing up in the help list
+        defineGlobalFlag<int>("vlevel", "", 0,
+                              [] (int& level) {
+                                  ActiveVerbosity<>::level.store(level);
+                              }, nullptr,
+                              FLAG_HIDDEN | FLAG_VALIDATE_INLINE | FLAG_NOT_INPUT);
+        ActiveVerbosity<>::level.store(0);
+        defineGlobalFlag<bool>("verbose", "Set verbose output", false,
+                               [this] (bool val) { setFlag<int>("vlevel", 1); },
+                               nullptr, FLAG_VALIDATE_INLINE | FLAG_NOT_INPUT);
+        defineGlobalFlag<double>("timeout", "Maximum number of seconds each action "
+                                 "can run before being cancelled", 0,
+                                 [] (double& timeout) {
+                                     if (timeout < 0) {
+                                         throw flag_validation_error {
+                                             "the timeout can't be negative" };
+                                     }
+                                 }, nullptr, FLAG_NOT_INPUT);
+        timeout_flag_id_ = flag_table_.find(GLOBAL_SCOPE, "timeout");
+        defineGlobalFlag<std::string>("journal", "Record the executed actions to the "
+                                      "specified journal file", "", nullptr,
+                                      nullptr, FLAG_NOT_INPUT);
+        journal_flag_id_ = flag_table_.find(GLOBAL_SCOPE, "journal");
+        defineGlobalFlag<std::string>("resume", "Skip the actions that completed "
+                                      "successfully according to the specified "
+                                      "journal file, and keep recording to it", "",
+                                      nullptr, nullptr, FLAG_NOT_INPUT);
+        resume_flag_id_ = flag_table_.find(GLOBAL_SCOPE, "resume");
+        defineGlobalFlag<bool>("hw-counters", "Count the CPU events of each action "
+                               "and print them once the actions are done", false,
+                               nullptr, nullptr, FLAG_NOT_INPUT);
+        hw_counters_flag_id_ = flag_table_.find(GLOBAL_SCOPE, "hw-counters");
+        defineGlobalFlag<std::string>("hw-counters-file", "Count the CPU events of "
+                                      "each action and write them to the specified "
+                                      "JSON file", "", nullptr, nullptr,
+                                      FLAG_NOT_INPUT);
+        hw_counters_file_flag_id_ = flag_table_.find(GLOBAL_SCOPE, "hw-counters-file");
+        defineGlobalFlag<std::string>("trace-file", "Write a trace of the parsing and "
+                                      "of the actions to the specified file", "",
+                                      [] (std::string& path) {
+                                          Tracer::Instance().setFile(path);
+                                      }, nullptr, FLAG_VALIDATE_INLINE | FLAG_NOT_INPUT);
+        defineGlobalFlag<int>("j jobs", "Number of threads running the parallel work "
+                              "of the actions; all the available CPUs if 0", 0,
+                              [this] (int& jobs) {
+                                  if (jobs < 0) {
+                                      throw flag_validation_error {
+                                          "the number of jobs can't be negative" };
+                                  }
+                                  executor_.setNumThreads(jobs);
+                              }, nullptr, FLAG_VALIDATE_INLINE | FLAG_NOT_INPUT);
+        executor_.setNumThreads(0);
+        cancellation_token_ = CancellationToken {};
+    }
+
+    // The fingerprint of an invocation covers the application, the
+    // action, its arguments and the values of all the flags it can see,
+    // except for the built-in ones that don't affect what the action does
+    // (verbosity, tracing, jobs, timeout, journal and counters), so that
+    // resumed runs match
+    uint64_t fingerprintContext(const Context& context) const {
+        Fingerprint fingerprint {};
+        fingerprint.add(application_name_);
+        fingerprint.add(version_string_);
+        fingerprint.add(context.action->name);
+
+        uint64_t num_args { context.arguments.size() };
+        fingerprint.add(&num_args, sizeof(num_args));
+        for (auto& arg : context.arguments) {
+            fingerprint.add(arg);
+        }
+
+        for (FlagId id = 0; id < flag_table_.size(); id++) {
+            if (flag_table_.scope(id) == GLOBAL_SCOPE
+                    && !flag_table_.hasAttribute(id, FLAG_NOT_INPUT)) {
+                addFlagToFingerprint(fingerprint, id, flag_table_.value(id));
+            }
+        }
+        for (auto& id_value : context.flags) {
+            addFlagToFingerprint(fingerprint, id_value.first, id_value.second.get());
+        }
+
+        return fingerprint.value();
+    }
+
+    void recordResources(const ResourceSnapshot& before, const std::string& action_name,
+                         int exit_code) {
+        action_resources_.push_back(
+            ResourceSnapshot::take().since(before, action_name, exit_code));
+        auto& resources = action_resources_.back();
+        HORSEWHISPERER_LOG(3) << "Action '" << action_name << "' used "
+                              << resources.user_cpu_us << " us user and "
+                              << resources.system_cpu_us << " us system CPU time, "
+                              << "raised the peak RSS by "
+                              << resources.max_rss_growth_kb << " KiB, had "
+                              << resources.minor_faults << " minor and "
+                              << resources.major_faults << " major faults, "
+                              << resources.voluntary_switches << " voluntary and "
+                              << resources.involuntary_switches
+                              << " involuntary context switches, read "
+                              << resources.read_chars << " and wrote "
+                              << resources.write_chars << " bytes";
+    }
+
+    bool countersRequested() const {
+        return static_cast<Flag<bool>*>(flag_table_.value(hw_counters_flag_id_))->value
+               || !static_cast<Flag<std::string>*>(
+                       flag_table_.value(hw_counters_file_flag_id_))->value.empty();
+    }
+
+    // Print the counters of the executed actions as a table on stderr
+    // and/or write them to the --hw-counters-file as JSON
+    void reportCounters() const {
+        if (static_cast<Flag<bool>*>(flag_table_.value(hw_counters_flag_id_))->value) {
+            // Formatted apart, so that stderr keeps its format flags
+            std::ostringstream table {};
+            writeCountersTable(table);
+            std::cerr << table.str() << std::flush;
+        }
+
+        auto& path = static_cast<Flag<std::string>*>(
+                         flag_table_.value(hw_counters_file_flag_id_))->value;
+        if (path.empty()) {
+            return;
+        }
+        std::string json { "{\"hardware_events\":" };
+        json += perf_counters_.hasHardwareEvents() ? "true" : "false";
+        json += ",\"actions\":[";
+        for (size_t idx = 0; idx < action_counters_.size(); idx++) {
+            auto& counters = action_counters_[idx];
+            json += idx == 0 ? "\n{\"action\":\"" : ",\n{\"action\":\"";
+            Tracer::appendEscaped(json, counters.action);
+            json += "\"";
+            auto appendCounter = [&json](const char* name, int64_t value) {
+                json += std::string { ",\"" } + name + "\":"
+                        + (value < 0 ? "null" : std::to_string(value));
+            };
+            appendCounter("wall_time_ns", counters.wall_time_ns);
+            appendCounter("task_clock_ns", counters.task_clock_ns);
+            appendCounter("cycles", counters.cycles);
+            appendCounter("instructions", counters.instructions);
+            appendCounter("cache_misses", counters.cache_misses);
+            appendCounter("branch_misses", counters.branch_misses);
+            appendCounter("context_switches", counters.context_switches);
+            appendCounter("page_faults", counters.page_faults);
+            json += "}";
+        }
+        json += "\n]}\n";
+
+        std::ofstream file { path, std::ios::binary | std::ios::trunc };
+        file.write(json.data(), json.size());
+        if (!file) {
+            std::cout << "Failed to write the counters file '" << path << "'"
+                      << std::endl;
+        }
+    }
+
+    void writeCountersTable(std::ostream& out) const {
+        size_t name_width { 6 };
+        for (auto& counters : action_counters_) {
+            name_width = std::max(name_width, counters.action.size());
+        }
+
+        auto writeCounter = [&out](int64_t value) {
+            out << std::setw(14);
+            if (value < 0) {
+                out << "-";
+            } else {
+                out << value;
+            }
+        };
+        auto writeMillis = [&out](int64_t nanoseconds) {
+            out << std::setw(10);
+            if (nanoseconds < 0) {
+                out << "-";
+            } else {
+                out << std::fixed << std::setprecision(3) << nanoseconds / 1e6;
+            }
+        };
+
+        out << std::left << std::setw(static_cast<int>(name_width)) << "action"
+            << std::right << std::setw(10) << "wall ms" << std::setw(10) << "task ms"
+            << std::setw(14) << "cycles" << std::setw(14) << "instructions"
+            << std::setw(14) << "cache misses" << std::setw(14) << "branch misses"
+            << std::setw(14) << "ctx switches" << std::setw(14) << "page faults"
+            << "\n";
+        for (auto& counters : action_counters_) {
+            out << std::left << std::setw(static_cast<int>(name_width))
+                << counters.action << std::right;
+            writeMillis(counters.wall_time_ns);
+            writeMillis(counters.task_clock_ns);
+            writeCounter(counters.cycles);
+            writeCounter(counters.instructions);
+            writeCounter(counters.cache_misses);
+            writeCounter(counters.branch_misses);
+            writeCounter(counters.context_switches);
+            writeCounter(counters.page_faults);
+            out << "\n";
+        }
+        if (!perf_counters_.hasHardwareEvents()) {
+            out << "Hardware counters are not available (see "
+                << "/proc/sys/kernel/perf_event_paranoid); only the software "
+                << "events were counted.\n";
+        }
+    }
+
+    // Open the journal specified by --journal or --resume, if any
+    bool openJournal() {
+        auto& journal_path = static_cast<Flag<std::string>*>(
+                                 flag_table_.value(journal_flag_id_))->value;
+        auto& resume_path = static_cast<Flag<std::string>*>(
+                                flag_table_.value(resume_flag_id_))->value;
+        if (!journal_path.empty() && !resume_path.empty()) {
+            std::cout << "The --journal and --resume flags can't be used together."
+                      << std::endl;
+            return false;
+        }
+
+        auto& path = resume_path.empty() ? journal_path : resume_path;
+        if (!path.empty() && !journal_.open(path, !resume_path.empty())) {
+            std::cout << "Failed to open the journal '" << path << "': "
+                      << std::strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void addFlagToFingerprint(Fingerprint& fingerprint, FlagId id,
+                              const FlagBase* flagp) const {
+        auto aliases = flag_table_.aliases(id);
+        fingerprint.add(aliases.str());
+        fingerprint.add(flagp);
+    }
+
+    // While tokenizing, the spans of the flag validations are kept until
+    // it's known whether tracing is enabled; they are named after the
+    // command line token
+    void traceFlagValidation(const std::string& name, int64_t begin, int64_t end) {
+        auto& tracer = Tracer::Instance();
+        if (tokenizing_) {
+            pending_flag_spans_.push_back(PendingSpan { validation_position_, begin, end });
+        } else if (tracer.enabled()) {
+            tracer.record(name, "flag", begin, end);
+        }
+    }
+
+    void traceTokenization(char* argv[], int64_t begin, int64_t end) {
+        auto& tracer = Tracer::Instance();
+        if (!definition_traced_) {
+            tracer.record("definition", "definition", definition_begin_, begin);
+            definition_traced_ = true;
+        }
+        tracer.record("tokenize", "parse", begin, end);
+
+        for (auto& span : pending_flag_spans_) {
+            std::string name { argv[span.position] };
+            name.erase(0, name.find_first_not_of('-'));
+            name.erase(std::min(name.find('='), name.size()));
+            tracer.record(std::move(name), "flag", span.begin, span.end);
+        }
+    }
+
+    // Effective deadline of the action, given the --timeout flag
+    std::chrono::milliseconds actionDeadline(const Action& action) const {
+        auto deadline = action.deadline;
+        auto timeout = static_cast<Flag<double>*>(
+                            flag_table_.value(timeout_flag_id_))->value;
+        if (timeout > 0) {
+            std::chrono::milliseconds timeout_ms {
+                std::max(1LL, static_cast<long long>(timeout * 1000)) };
+            if (deadline.count() == 0 || timeout_ms < deadline) {
+                deadline = timeout_ms;
+            }
+        }
+        return deadline;
+    }
+
+    // Run the action callback with a new cancellation token, watched
+    // by the watchdog
+    int runAction(const Context& context, Watchdog& watchdog) {
+        TraceScope trace { context.action->name, "action" };
+        cancellation_token_ = CancellationToken {};
+        watchdog.arm(cancellation_token_, actionDeadline(*context.action));
+
+        // The input of a streaming action isn't part of its fingerprint,
+        // so its outcome is never cached
+        int exit_code;
+        if (context.action->idempotent && !context.action->streaming_callback) {
+            exit_code = runIdempotentAction(context);
+        } else {
+            exit_code = callAction(context);
+        }
+
+        watchdog.disarm();
+        return exit_code;
+    }
+
+    static bool hasCallback(const Action& action) {
+        return action.action_callback || action.options_callback
+               || action.streaming_callback;
+    }
+
+    static bool isTerminal() {
+#ifdef _WIN32
+        return false;
+#else
+        return isatty(STDOUT_FILENO) != 0;
+#endif
+    }
+
+    static bool forkSupported() {
+#ifdef _WIN32
+        return false;
+#else
+        return true;
+#endif
+    }
+
+    // Replay the outcome of a forked action, running first the batch of
+    // forked actions that starts with it in case it didn't run yet
+    int runForkedAction(size_t context_idx) {
+        auto& name = context_mgr_[context_idx]->action->name;
+        if (!forked_outcomes_.count(context_idx)) {
+            runForkedBatch(context_idx);
+        }
+
+        auto& outcome = forked_outcomes_[context_idx];
+        std::cout << outcome.output;
+        if (outcome.output_truncated) {
+            std::cout << "\nThe output of action '" << name << "' was truncated to "
+                      << outcome.output.size() << " bytes." << std::endl;
+        }
+        if (!outcome.failure.empty()) {
+            std::cout << outcome.failure << std::endl;
+        }
+        std::cout << std::flush;
+
+        cancellation_token_ = CancellationToken {};
+        if (outcome.timed_out) {
+            cancellation_token_.cancel(CancellationReason::Timeout);
+        }
+        action_resources_.push_back(outcome.resources);
+        action_results_.push_back(ActionResult { name, outcome.exit_code, outcome.result,
+                                                 std::string {} });
+        return outcome.exit_code;
+    }
+
+    // Run in child processes, up to max_forked_actions_ at a time, the
+    // forked actions of the chain that start at the specified context and
+    // collect their outcomes; the parent enforces their deadlines and, on
+    // SIGINT/SIGTERM, terminates them
+    void runForkedBatch(size_t first) {
+        std::vector<size_t> batch {};
+        for (auto idx = first; idx < context_mgr_.size(); idx++) {
+            auto& context = *context_mgr_[idx];
+            if (!context.action || !context.action->forked || !hasCallback(*context.action)) {
+                break;
+            }
+            if (idx != first && journal_.isOpen()
+                    && journal_.takeCompleted(fingerprintContext(context))) {
+                forked_outcomes_[idx].skipped = true;
+            } else {
+                batch.push_back(idx);
+            }
+            if (!context.action->chainable) {
+                break;
+            }
+        }
+
+#ifndef _WIN32
+        // The children must not inherit buffered output, nor an executor
+        // whose workers don't exist in them
+        executor_.shutdown();
+        std::cout.flush();
+        std::cerr.flush();
+        std::fflush(stdout);
+        Logger::Instance().flush();
+
+        auto max_children = max_forked_actions_ != 0
+                            ? max_forked_actions_
+                            : std::max(1u, std::thread::hardware_concurrency());
+        ForkChannel channel {};
+        if (!channel.map(std::min<size_t>(batch.size(), max_children))) {
+            auto error = std::strerror(errno);
+            for (auto idx : batch) {
+                forked_outcomes_[idx].failure = "Failed to map the memory shared with "
+                                                "the forked actions: "
+                                                + std::string { error };
+            }
+            return;
+        }
+
+        struct Child {
+            pid_t pid;
+            size_t context_idx;
+            size_t slot_idx;
+            int64_t trace_begin;
+            bool has_deadline;
+            std::chrono::steady_clock::time_point deadline;
+            bool timed_out;
+        };
+        std::vector<Child> children {};
+        size_t next { 0 };
+        bool terminating { false };
+        auto parent_max_rss_kb = ResourceSnapshot::take().max_rss_kb;
+
+        while (next < batch.size() || !children.empty()) {
+            size_t slot_idx;
+            while (!terminating && next < batch.size() && channel.acquire(slot_idx)) {
+                auto context_idx = batch[next++];
+                auto& context = *context_mgr_[context_idx];
+                auto trace_begin = Tracer::Instance().now();
+                auto pid = forkAction(context, channel.slot(slot_idx));
+                if (pid < 0) {
+                    forked_outcomes_[context_idx].failure = "Failed to fork action '"
+                        + context.action->name + "': " + std::strerror(errno);
+                    channel.release(slot_idx);
+                    continue;
+                }
+                auto deadline = actionDeadline(*context.action);
+                children.push_back(Child { pid, context_idx, slot_idx, trace_begin,
+                                           deadline.count() > 0,
+                                           std::chrono::steady_clock::now() + deadline,
+                                           false });
+            }
+
+            if (!terminating && SignalState<>::received.load() != 0) {
+                terminating = true;
+                for (auto& child : children) {
+                    kill(child.pid, SIGTERM);
+                }
+            }
+
+            bool reaped { false };
+            for (auto child = children.begin(); child != children.end();) {
+                int status { 0 };
+                struct rusage usage;
+                auto result = wait4(child->pid, &status, WNOHANG, &usage);
+                if (result == child->pid || (result < 0 && errno != EINTR)) {
+                    if (result < 0) {
+                        // Reaped by someone else; its usage is unknown
+                        std::memset(&usage, 0, sizeof(usage));
+                        status = -1;
+                    }
+                    collectForkedOutcome(child->context_idx, channel.slot(child->slot_idx),
+                                         status, usage, child->timed_out,
+                                         parent_max_rss_kb);
+                    if (Tracer::Instance().enabled()) {
+                        Tracer::Instance().record(context_mgr_[child->context_idx]->action->name,
+                                                  "forked action", child->trace_begin,
+                                                  Tracer::Instance().now());
+                    }
+                    channel.release(child->slot_idx);
+                    child = children.erase(child);
+                    reaped = true;
+                    continue;
+                }
+                if (child->has_deadline && !child->timed_out
+                        && std::chrono::steady_clock::now() >= child->deadline) {
+                    kill(child->pid, SIGKILL);
+                    child->timed_out = true;
+                }
+                ++child;
+            }
+
+            if (!reaped && !children.empty()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds { 1 });
             }
         }
-        std::cout << ss.str() << "\n";
+#endif
     }
 
-  private:
-    // Index of the context currently being processed
-    int current_context_idx_;
-
-    // Container of contexts
-    std::vector<ContextPtr> context_mgr_;
+#ifndef _WIN32
+    // SIGINT and SIGTERM are blocked until the child has restored their
+    // default handlers, so that it can be terminated like any process
+    pid_t forkAction(const Context& context, ForkChannel::Slot& slot) {
+        sigset_t blocked, previous_mask;
+        sigemptyset(&blocked);
+        sigaddset(&blocked, SIGINT);
+        sigaddset(&blocked, SIGTERM);
+        sigprocmask(SIG_BLOCK, &blocked, &previous_mask);
+
+        auto pid = fork();
+        if (pid == 0) {
+            std::signal(SIGINT, SIG_DFL);
+            std::signal(SIGTERM, SIG_DFL);
+            sigprocmask(SIG_SETMASK, &previous_mask, nullptr);
+            runForkedChild(context, slot);
+        }
 
-    // Registered flags
-    std::map<std::string, std::shared_ptr<Action>> actions_;
+        sigprocmask(SIG_SETMASK, &previous_mask, nullptr);
+        return pid;
+    }
 
-    // Maps contexts (global and single actions) to registered flags
-    std::map<std::string, std::vector<std::shared_ptr<FlagBase>>> registered_flags_;
+    // Run the action in the child, reporting through the slot; never returns
+    void runForkedChild(const Context& context, ForkChannel::Slot& slot) {
+        fork_slot_ = &slot;
+        SlotOutput output { slot };
+        std::cout.rdbuf(&output);
+
+        int exit_code { EXIT_FAILURE };
+        try {
+            cancellation_token_ = CancellationToken {};
+            if (context.action->idempotent && !context.action->streaming_callback) {
+                exit_code = runIdempotentAction(context);
+            } else {
+                exit_code = callAction(context);
+            }
+        } catch (std::exception& e) {
+            std::cout << "Action '" << context.action->name << "' failed: "
+                      << e.what() << "\n";
+        } catch (...) {
+            std::cout << "Action '" << context.action->name << "' failed.\n";
+        }
 
-    // Whether CL args have been parsed
-    bool parsed_;
+        std::cout.flush();
+        output.finish();
+        slot.exit_code = exit_code;
+        slot.completed = 1;
 
-    // Action delimeters
-    std::vector<std::string> delimiters_;
+        std::fflush(stdout);
+        std::cerr.flush();
+        executor_.shutdown();
+        Logger::Instance().flush();
+        _exit(EXIT_SUCCESS);
+    }
 
-    // Application name
-    std::string application_name_;
+    void collectForkedOutcome(size_t context_idx, ForkChannel::Slot& slot, int status,
+                              const struct rusage& usage, bool timed_out,
+                              int64_t parent_max_rss_kb) {
+        auto& name = context_mgr_[context_idx]->action->name;
+        auto& outcome = forked_outcomes_[context_idx];
+        outcome.output.assign(slot.output(),
+                              std::min<uint64_t>(slot.output_size,
+                                                 ForkChannel::Slot::outputCapacity()));
+        outcome.output_truncated = slot.output_truncated != 0;
+        outcome.result.assign(slot.result,
+                              std::min<size_t>(slot.result_size,
+                                               size_t { ForkChannel::RESULT_CAPACITY }));
+        outcome.timed_out = timed_out;
+
+        if (timed_out) {
+            outcome.exit_code = ACTION_TIMEOUT_EXIT_CODE;
+        } else if (status != -1 && WIFEXITED(status) && slot.completed) {
+            outcome.exit_code = slot.exit_code;
+        } else if (status != -1 && WIFSIGNALED(status)) {
+            outcome.exit_code = 128 + WTERMSIG(status);
+            outcome.failure = "Forked action '" + name + "' was terminated by signal "
+                              + std::to_string(WTERMSIG(status)) + ".";
+        } else {
+            outcome.exit_code = EXIT_FAILURE;
+            outcome.failure = "Forked action '" + name + "' exited before completing.";
+        }
 
-    // Text header of the help message
-    std::string help_banner_;
+        // The process only inherits the peak RSS of the parent
+        outcome.resources = ActionResources {
+            name, outcome.exit_code,
+            ResourceSnapshot::microseconds(usage.ru_utime),
+            ResourceSnapshot::microseconds(usage.ru_stime),
+            std::max<int64_t>(0, usage.ru_maxrss - parent_max_rss_kb),
+            usage.ru_minflt, usage.ru_majflt, usage.ru_nvcsw, usage.ru_nivcsw,
+            -1, -1, -1, -1 };
+    }
+#endif
 
-    // Version information
-    std::string version_string_;
-    std::string version_short_flag_string_;
+    int callAction(const Context& context) {
+        if (context.action->per_argument && context.arguments.size() > 1) {
+            return callPerArgument(context);
+        }
+        if (context.action->streaming_callback) {
+            ArgumentStream arguments { context.arguments };
+            return context.action->streaming_callback(arguments);
+        }
+        if (context.action->options_callback) {
+            return context.action->options_callback(context.arguments,
+                                                    context.options.get());
+        }
+        return context.action->action_callback(context.arguments);
+    }
 
-    // Margins, indicated as number of columns
-    unsigned int description_margin_left_;
-    unsigned int description_margin_right_;
+    // Invoke the callback with each argument on the executor; with the
+    // FirstFailure policy, the arguments not started yet are skipped
+    // after a failure
+    int callPerArgument(const Context& context) {
+        auto& action = *context.action;
+        auto& arguments = context.arguments;
+        std::vector<int> exit_codes(arguments.size(), EXIT_SUCCESS);
+        std::atomic<bool> failed { false };
+        auto stop_at_failure = action.exit_code_policy == ExitCodePolicy::FirstFailure;
+
+        auto live = output_mode_ == OutputMode::Live;
+        InvocationOutput output { std::cout, arguments, live };
+        InvocationOutput errors { std::cerr, arguments, live };
+
+        executor_.parallelFor(0, arguments.size(), [&](size_t idx) {
+            if ((stop_at_failure && failed.load(std::memory_order_relaxed))
+                    || cancellation_token_.isCancelled()) {
+                return;
+            }
+            // A thread waiting for its chunks can run other invocations
+            auto previous = InvocationOutput::current();
+            InvocationOutput::current() = idx;
+            Arguments argument { arguments[idx] };
+            int exit_code;
+            try {
+                exit_code = action.options_callback
+                            ? action.options_callback(argument, context.options.get())
+                            : action.action_callback(argument);
+            } catch (...) {
+                InvocationOutput::current() = previous;
+                throw;
+            }
+            InvocationOutput::current() = previous;
+            exit_codes[idx] = exit_code;
+            if (exit_code != EXIT_SUCCESS) {
+                failed.store(true, std::memory_order_relaxed);
+            }
+        });
 
-    void clean() {
-        context_mgr_.clear();
-        actions_.clear();
-        registered_flags_.clear();
-        delimiters_.clear();
+        if (stop_at_failure) {
+            for (auto exit_code : exit_codes) {
+                if (exit_code != EXIT_SUCCESS) {
+                    return exit_code;
+                }
+            }
+            return EXIT_SUCCESS;
+        }
+        int worst_code { EXIT_SUCCESS };
+        for (auto exit_code : exit_codes) {
+            if (std::abs(static_cast<long>(exit_code))
+                    > std::abs(static_cast<long>(worst_code))) {
+                worst_code = exit_code;
+            }
+        }
+        return worst_code;
     }
 
-    void init() {
-        current_context_idx_ = GLOBAL_CONTEXT_IDX;
-
-        ContextPtr global_context { new Context() };
-        global_context->action = nullptr;
-        context_mgr_.push_back(std::move(global_context));
+    // Replay the cached outcome of the action, if any; otherwise run
+    // its callback, recording its output, and cache the outcome
+    int runIdempotentAction(const Context& context) {
+        auto key = fingerprintContext(context);
+        CachedOutcome outcome {};
+
+        if (action_cache_.lookup(key, context.action->cache_ttl, outcome)) {
+            HORSEWHISPERER_LOG(2) << "Replaying the cached outcome of action '"
+                                  << context.action->name << "'";
+            std::cout << outcome.output << std::flush;
+            return outcome.exit_code;
+        }
 
-        parsed_ = false;
-        application_name_ = "";
-        help_banner_ = "";
-        version_string_ = "";
-        version_short_flag_string_ = "";
-        description_margin_left_ = DESCRIPTION_MARGIN_LEFT_DEFAULT;
-        description_margin_right_ = DESCRIPTION_MARGIN_RIGHT_DEFAULT;
+        {
+            OutputRecorder recorder { std::cout };
+            outcome.exit_code = callAction(context);
+            outcome.output = recorder.str();
+        }
 
-        defineGlobalFlag<bool>("h help", "Show this message", false, nullptr);
-        defineGlobalFlag<int>("vlevel", "", 0, nullptr);
-        defineGlobalFlag<bool>("verbose", "Set verbose output", false,
-                               [this] (bool val) { setFlag<int>("vlevel", 1); });
+        // The outcome of a cancelled action is not meaningful, and a
+        // failure may be transient
+        if (!cancellation_token_.isCancelled() && outcome.exit_code == EXIT_SUCCESS) {
+            action_cache_.store(key, outcome);
+        }
+        return outcome.exit_code;
     }
 
     ParseResult parseFlag(char* argv[], int& i) {
+        validation_position_ = i;
+
         // It's a flag. Get the array offset
         int offset = 1;
         if (argv[i][1] == '-') {
             ++offset;
         }
-        std::string flagname { &argv[i][offset] };
+        const char* name_begin { &argv[i][offset] };
 
-        // check if flag looks like key=value
-        size_t k_v { flagname.find("=") };
+        // check if flag looks like key=value; k_v is then the position
+        // of the first char after '='
+        const char* equal_sign { std::strchr(name_begin, '=') };
+        size_t k_v { std::string::npos };
+        std::string flagname {};
 
-        if (k_v != std::string::npos) {
-            flagname = flagname.substr(0, k_v);
-            // += offset to take - or -- into account
-            // increment to get the first char after '='
-            ++k_v += offset;
+        if (equal_sign) {
+            flagname.assign(name_begin, equal_sign);
+            k_v = static_cast<size_t>(equal_sign - argv[i]) + 1;
+        } else {
+            flagname.assign(name_begin);
         }
 
         // Deal with special vlevel flags
@@ -848,13 +6134,32 @@ class HORSEWHISPERER_EXPORT HorseWhisperer {
         FlagType flag_type = checkAndGetTypeOfFlag(flagname);
 
         if (flag_type == FlagType::MultiString) {
+            // Counted first, so that the values are allocated once
+            auto end = i;
+            while (argv[end+1] && argv[end+1][0] != '-'
+                   && !isDelimiter(argv[end+1])
+                   && !isActionDefined(argv[end+1])) {
+                ++end;
+            }
             MultiString value {};
-            while (argv[i+1] && argv[i+1][0] != '-'
-                   && !isDelimiter(argv[i+1])
-                   && !isActionDefined(argv[i+1])) {
+            value.reserve(static_cast<size_t>(end - i));
+            while (i < end) {
                 value.emplace_back(argv[++i]);
             }
             return setAndValidateMultiFlag(flag_type, flagname, std::move(value));
+        } else if (flag_type == FlagType::IntList || flag_type == FlagType::DoubleList) {
+            // Values can be comma separated and/or space separated
+            SmallVector<const char*, 8> tokens {};
+            if (k_v != std::string::npos) {
+                tokens.push_back(&argv[i][k_v]);
+            } else {
+                while (argv[i+1] && isListToken(argv[i+1])
+                       && !isDelimiter(argv[i+1])
+                       && !isActionDefined(argv[i+1])) {
+                    tokens.push_back(argv[++i]);
+                }
+            }
+            return setAndValidateListFlag(flag_type, flagname, tokens);
         } else {
             std::string value {};
 
@@ -865,11 +6170,11 @@ class HORSEWHISPERER_EXPORT HorseWhisperer {
                 value = argv[i];
             }
 
-            return setAndValidateFlag(flag_type, flagname, value);
+            return setAndValidateFlag(flag_type, flagname, std::move(value));
         }
     }
 
-    ParseResult setAndValidateFlag(FlagType flag_type, std::string flagname,
+    ParseResult setAndValidateFlag(FlagType flag_type, const std::string& flagname,
                                    std::string value) {
         if (flag_type == FlagType::Bool) {
             bool b_val { true };
@@ -894,7 +6199,7 @@ class HORSEWHISPERER_EXPORT HorseWhisperer {
             }
 
             if (flag_type == FlagType::String) {
-                setFlag<std::string>(flagname, std::string(value));
+                setFlag<std::string>(flagname, std::move(value));
                 return ParseResult::OK;
             } else if (flag_type == FlagType::Int) {
                 if (validateInteger(value)) {
@@ -921,7 +6226,7 @@ class HORSEWHISPERER_EXPORT HorseWhisperer {
         return ParseResult::FAILURE;
     }
 
-    ParseResult setAndValidateMultiFlag(FlagType flag_type, std::string flagname,
+    ParseResult setAndValidateMultiFlag(FlagType flag_type, const std::string& flagname,
                                         MultiString value) {
         if (flag_type == FlagType::MultiString) {
             if (value.empty()) {
@@ -936,32 +6241,68 @@ class HORSEWHISPERER_EXPORT HorseWhisperer {
         return ParseResult::FAILURE;
     }
 
-    // Display help information for the global context
-    void globalHelp(bool show_actions_help) {
-        std::cout << help_banner_ << std::endl;
-        std::cout << std::endl;
+    ParseResult setAndValidateListFlag(FlagType flag_type, const std::string& flagname,
+                                       const SmallVector<const char*, 8>& tokens) {
+        if (tokens.empty()) {
+            std::cout << "Missing values for flag: " << flagname << std::endl;
+            return ParseResult::FAILURE;
+        }
 
-        if (show_actions_help) {
-            std::cout << "Global options:";
+        if (flag_type == FlagType::IntList) {
+            IntList values {};
+            for (auto token : tokens) {
+                if (!parseList(token, values)) {
+                    std::cout << "Flag '" << flagname
+                              << "' expects a list of integers" << std::endl;
+                    return ParseResult::INVALID_FLAG;
+                }
+            }
+            setFlag<IntList>(flagname, std::move(values));
         } else {
-            std::cout << "Options:";
+            DoubleList values {};
+            for (auto token : tokens) {
+                if (!parseList(token, values)) {
+                    std::cout << "Flag '" << flagname
+                              << "' expects a list of doubles" << std::endl;
+                    return ParseResult::INVALID_FLAG;
+                }
+            }
+            setFlag<DoubleList>(flagname, std::move(values));
         }
 
-        for (const auto& flag : registered_flags_["global"]) {
-            writeFlagHelp(flag.get());
+        return ParseResult::OK;
+    }
+
+    // Display help information for the global context
+    void globalHelp(bool show_actions_help) {
+        auto indent = descriptionIndent();
+        std::string help {};
+        help.reserve((flag_table_.size() + command_trie_.children(CommandTrie::ROOT).size)
+                     * (description_margin_right_ + 1));
+        help += help_banner_;
+        help += "\n\n";
+        help += show_actions_help ? "Global options:" : "Options:";
+
+        for (FlagId id = 0; id < flag_table_.size(); id++) {
+            if (flag_table_.scope(id) == GLOBAL_SCOPE) {
+                writeFlagHelp(help, id, indent);
+            }
         }
 
         if (show_actions_help) {
-            std::cout << "\n\nActions:\n";
-            for (const auto& action : actions_) {
-                writeActionDescription(action.second.get());
+            help += "\n\nActions:\n";
+            for (auto node : command_trie_.children(CommandTrie::ROOT)) {
+                if (command_trie_.action(node)) {
+                    writeActionDescription(help, command_trie_.action(node).get(), indent);
+                }
             }
 
-            std::cout << "\nFor action specific help run \"" << application_name_
-                      << " <action> --help\"";
+            help += "\nFor action specific help run \"" + application_name_
+                    + " <action> --help\"";
         }
 
-        std::cout << std::endl << std::endl;
+        help += "\n\n";
+        std::cout << help << std::flush;
     }
 
     // Display help information for the current action context
@@ -973,142 +6314,261 @@ class HORSEWHISPERER_EXPORT HorseWhisperer {
             return;
         }
 
-        std::cout << context_mgr_[current_context_idx_]->action->help_string_;
+        auto& action = context_mgr_[current_context_idx_]->action;
+        auto indent = descriptionIndent();
+        std::string help { action->help_string_ };
 
-        if (registered_flags_.find(context_mgr_[current_context_idx_]->action->name)
-                != registered_flags_.end()) {
-            std::cout << "\n  " << context_mgr_[current_context_idx_]->action->name
-                      << " specific flags:\n";
-            for (const auto& f : registered_flags_[
-                                    context_mgr_[current_context_idx_]->action->name]) {
-                writeFlagHelp(f.get());
+        if (!action->parameters.empty()) {
+            help += "\n  " + action->name + " arguments:\n";
+            for (auto& parameter : action->parameters) {
+                writeParameterHelp(help, parameter, indent);
+            }
+        }
+        if (!action->flag_ids.empty()) {
+            help += "\n  " + action->name + " specific flags:\n";
+            for (auto id : action->flag_ids) {
+                writeFlagHelp(help, id, indent);
             }
         }
-        std::cout << std::endl << std::endl;
-    }
 
-    // Output the help information related to a single flag
-    void writeFlagHelp(const FlagBase* flag) {
-        std::stringstream aliases_stream { flag->aliases };
-        std::stringstream output {};
-        std::string alias {};
-        std::string arg {};
-        size_t last_alias_size { 0 };
+        // Flags inherited from the containing groups
+        for (auto group = action->group.get(); group; group = group->group.get()) {
+            if (!group->flag_ids.empty()) {
+                help += "\n  " + group->name + " flags:\n";
+                for (auto id : group->flag_ids) {
+                    writeFlagHelp(help, id, indent);
+                }
+            }
+        }
 
-        if (flag->description == "<hidden>")
-          return;
+        // Only the subtree of a group is listed
+        if (action->is_group) {
+            help += "\n\n  Actions:\n";
+            for (auto node : command_trie_.children(action->node)) {
+                if (command_trie_.action(node)) {
+                    writeActionDescription(help, command_trie_.action(node).get(), indent);
+                }
+            }
+            help += "\nFor action specific help run \"" + application_name_
+                    + " " + action->name + " <action> --help\"";
+        }
+
+        help += "\n\n";
+        std::cout << help << std::flush;
+    }
 
-        switch (getTypeOfFlag(flag)) {
+    // Output the help information related to a single flag
+    static std::string valuePlaceholder(FlagType type) {
+        switch (type) {
             case FlagType::Bool:
-                // No argument
-                break;
+                return "<bool>";
             case FlagType::String:
-                arg = " <str>";
-                break;
+                return "<str>";
             case FlagType::Int:
-                arg = " <int>";
-                break;
+                return "<int>";
             case FlagType::Double:
-                arg = " <float>";
-                break;
+                return "<float>";
             case FlagType::MultiString:
-                arg = " <str>...";
-                break;
+                return "<str>...";
+            case FlagType::IntList:
+                return "<int>[,<int>...]";
+            case FlagType::DoubleList:
+                return "<float>[,<float>...]";
         }
+        return "";
+    }
 
-        while (aliases_stream >> alias) {
-            if (alias != "") {
-                output << "\n";
-                output << std::setw(description_margin_left_) << std::left;
-                last_alias_size = alias.size();
+    // Continuation lines of the descriptions start at the margin, or
+    // after 4 spaces if it's narrower
+    std::string descriptionIndent() const {
+        return std::string(std::max(description_margin_left_, 4u), ' ');
+    }
 
-                if (last_alias_size == 1) {
-                    output << "   -" + alias + arg;
-                } else if (last_alias_size > 1) {
-                    output << "  --" + alias + arg;
-                }
-            }
+    // Append the label, padded with spaces up to the margin
+    void appendLabel(std::string& help, const std::string& label) const {
+        help += label;
+        if (label.size() < description_margin_left_) {
+            help.append(description_margin_left_ - label.size(), ' ');
         }
+    }
 
-        auto newLine = [&output](unsigned int margin) {
-            output << "\n" << std::setw(margin) << std::left;
-            // Same length as above to fill the field in the same way
-            output << "    ";
-        };
+    void writeParameterHelp(std::string& help, const Parameter& parameter,
+                            const std::string& indent) const {
+        auto label = "  " + parameter.name + " " + valuePlaceholder(parameter.value->type);
+        help += '\n';
+        appendLabel(help, label);
 
-        // New line condition: (2 or 3 spaces + dash prefix + alias
-        // size + 2 spaces to separate from description) > margin
-        if (last_alias_size + 6 > description_margin_left_) {
-            newLine(description_margin_left_);
+        // New line condition: label + 2 spaces to separate from description
+        if (label.size() + 2 > description_margin_left_) {
+            help += '\n';
+            help += indent;
+        }
+
+        wordWrap(help, parameter.description.data(), parameter.description.size(),
+                 getDescriptionWidth(), indent);
+    }
+
+    void writeFlagHelp(std::string& help, FlagId id, const std::string& indent) const {
+        if (flag_table_.hasAttribute(id, FLAG_HIDDEN))
+          return;
+
+        std::string arg {};
+        if (flag_table_.type(id) != FlagType::Bool) {
+            // Bool flags take no argument
+            arg = " " + valuePlaceholder(flag_table_.type(id));
         }
 
-        bool first_line { true };
-        for (auto& line : wordWrap(flag->description, getDescriptionWidth())) {
-            if (!first_line) {
-                newLine(description_margin_left_);
+        // One line for each of the space separated aliases
+        auto aliases = flag_table_.aliases(id);
+        size_t last_alias_size { 0 };
+        size_t alias_begin { 0 };
+        while (alias_begin < aliases.size) {
+            auto alias_end = alias_begin;
+            while (alias_end < aliases.size && aliases.data[alias_end] != ' ') {
+                alias_end++;
+            }
+            if (alias_end > alias_begin) {
+                last_alias_size = alias_end - alias_begin;
+                std::string label { last_alias_size == 1 ? "   -" : "  --" };
+                label.append(aliases.data + alias_begin, last_alias_size);
+                help += '\n';
+                appendLabel(help, label + arg);
             }
-            output << line;
-            first_line = false;
+            alias_begin = alias_end + 1;
         }
 
-        std::cout << output.str();
+        // New line condition: (2 or 3 spaces + dash prefix + alias
+        // size + 2 spaces to separate from description) > margin
+        if (last_alias_size + 6 > description_margin_left_) {
+            help += '\n';
+            help += indent;
+        }
+
+        auto description = flag_table_.description(id);
+        wordWrap(help, description.data, description.size, getDescriptionWidth(), indent);
     }
 
     // Output the action description related to a specific action
-    void writeActionDescription(const Action* action) {
-        std::stringstream action_stream;
-        action_stream << "  " << action->name;
-
-        std::cout << std::setw(description_margin_left_) << std::left
-                  << action_stream.str();
+    void writeActionDescription(std::string& help, const Action* action,
+                                const std::string& indent) const {
+        appendLabel(help, "  " + action->name);
 
         // New line condition: (2 spaces + action name + 2 spaces to
         // separate from description) > margin
         if (action->name.size() + 4 > description_margin_left_) {
-            std::cout << "\n";
-            std::cout << std::setw(description_margin_left_) << std::left
-                      << "    ";
+            help += '\n';
+            help += indent;
         }
 
-        std::cout << std::setw(description_margin_left_) << std::left;
+        wordWrap(help, action->description.data(), action->description.size(),
+                 getDescriptionWidth(), indent);
+        help += '\n';
+    }
+
+    bool isFlagDefined(const std::string& name) {
+        return lookupFlag(name) != nullptr;
+    }
+
+    // Return the value of the specified flag of the current action or,
+    // if not defined there, of the global context; nullptr otherwise
+    FlagBase* lookupFlag(const std::string& name) {
+        return flagValue(lookupFlagId(name));
+    }
 
-        bool first_line { true };
-        for (auto& line : wordWrap(action->description, getDescriptionWidth())) {
-            if (!first_line) {
-                std::cout << std::setw(description_margin_left_) << std::left
-                          << "    "
-                          << std::setw(description_margin_left_) << std::left;
+    // Return the id of the flag with the specified name visible in the
+    // current context, or NO_FLAG
+    FlagId lookupFlagId(const std::string& name) const {
+        auto name_id = flag_table_.findName(name);
+        auto& context = context_mgr_[current_context_idx_];
+        // The flags of an action hide the ones of its groups
+        for (auto scope = context->action.get(); scope; scope = scope->group.get()) {
+            auto id = flag_table_.find(scope->scope, name_id);
+            if (id != NO_FLAG) {
+                return id;
             }
-            std::cout << line << "\n";
-            first_line = false;
         }
+        return flag_table_.find(GLOBAL_SCOPE, name_id);
     }
 
-    bool isFlagDefined(std::string name) {
-        if (getContextIdxIfDefined(name) != NO_CONTEXT_IDX) {
-            return true;
-        } else {
-            return false;
+    // Value of the flag in the current context
+    FlagBase* flagValue(FlagId id) {
+        if (id == NO_FLAG) {
+            return nullptr;
         }
+        if (flag_table_.scope(id) == GLOBAL_SCOPE) {
+            return flag_table_.value(id);
+        }
+        return context_mgr_[current_context_idx_]->flag(id);
     }
 
-    int getContextIdxIfDefined(std::string const& name) {
-        if (context_mgr_[current_context_idx_]->flags.find(name)
-                != context_mgr_[current_context_idx_]->flags.end()) {
-            return current_context_idx_;
-        } else if (context_mgr_[GLOBAL_CONTEXT_IDX]->flags.find(name)
-                != context_mgr_[GLOBAL_CONTEXT_IDX]->flags.end()) {
-            return GLOBAL_CONTEXT_IDX;
-        } else {
-            return NO_CONTEXT_IDX;
+    std::string contextToString(const Context& context) {
+        std::stringstream ss {};
+        ss << "Action " << context.action->name;
+        if (context.arguments.size() > 0) {
+            ss << "  - arguments:";
+            for (auto& arg : context.arguments) {
+                ss << " " << arg;
+            }
+        }
+        for (auto& id_value : context.flags) {
+            auto flagp = id_value.second.get();
+            ss << "\n  flag " << flag_table_.aliases(id_value.first).str() << ":";
+            switch (getTypeOfFlag(flagp)) {
+                case FlagType::Bool:
+                    ss << " " << static_cast<Flag<bool>*>(flagp)->value;
+                    break;
+                case FlagType::String:
+                    ss << " " << static_cast<Flag<std::string>*>(flagp)->value;
+                    break;
+                case FlagType::Int:
+                    ss << " " << static_cast<Flag<int>*>(flagp)->value;
+                    break;
+                case FlagType::Double:
+                    ss << " " << static_cast<Flag<double>*>(flagp)->value;
+                    break;
+                case FlagType::MultiString:
+                    for (auto& s : static_cast<Flag<MultiString>*>(flagp)->value) {
+                        ss << " " << s;
+                    }
+                    break;
+                case FlagType::IntList:
+                    appendList(ss, static_cast<Flag<IntList>*>(flagp)->value);
+                    break;
+                case FlagType::DoubleList:
+                    appendList(ss, static_cast<Flag<DoubleList>*>(flagp)->value);
+                    break;
+            }
+        }
+        return ss.str();
+    }
+
+    template <typename Type>
+    static void appendList(std::ostream& os, const std::vector<Type>& values) {
+        for (size_t idx = 0; idx < values.size(); idx++) {
+            os << (idx ? "," : " ") << values[idx];
         }
     }
 
-    bool isActionDefined(const std::string& name) {
-        return !(actions_.find(name) == actions_.end());
+    // Whether the token starts the path of an action
+    bool isActionDefined(const char* name) const {
+        return findActionNode(CommandTrie::ROOT, name) != CommandTrie::NO_NODE;
+    }
+
+    // Return the child node of the action or group named by the token,
+    // or NO_NODE; nodes of a schema image may have no action bound
+    uint32_t findActionNode(uint32_t parent, const char* token) const {
+        auto node = command_trie_.child(parent, token);
+        return (node != CommandTrie::NO_NODE && command_trie_.action(node))
+               ? node : static_cast<uint32_t>(CommandTrie::NO_NODE);
+    }
+
+    const std::shared_ptr<Action>& findAction(const std::string& name) const {
+        static const std::shared_ptr<Action> no_action {};
+        auto node = command_trie_.find(name);
+        return node != CommandTrie::NO_NODE ? command_trie_.action(node) : no_action;
     }
 
-    unsigned int getDescriptionWidth() {
+    unsigned int getDescriptionWidth() const {
         return description_margin_right_ - description_margin_left_;
     }
 };
@@ -1118,78 +6578,175 @@ class HORSEWHISPERER_EXPORT HorseWhisperer {
 //
 
 template <typename Type>
-static void DefineGlobalFlag(std::string aliases,
-                                std::string description,
-                                Type default_value,
-                                FlagCallback<Type> flag_callback) {
-    HorseWhisperer::Instance().defineGlobalFlag<Type>(aliases,
-                                                      description,
-                                                      default_value,
-                                                      flag_callback);
+HORSEWHISPERER_API void DefineGlobalFlag(std::string aliases,
+                                         std::string description,
+                                         Type default_value,
+                                         FlagCallback<Type> flag_callback) {
+    HorseWhisperer::Instance().defineGlobalFlag<Type>(std::move(aliases),
+                                                      std::move(description),
+                                                      std::move(default_value),
+                                                      std::move(flag_callback));
+}
+
+template <typename Type>
+HORSEWHISPERER_API void DefineActionFlag(std::string action_name,
+                                         std::string aliases,
+                                         std::string description,
+                                         Type default_value,
+                                         FlagCallback<Type> flag_callback) {
+    HorseWhisperer::Instance().defineActionFlag<Type>(action_name,
+                                                      std::move(aliases),
+                                                      std::move(description),
+                                                      std::move(default_value),
+                                                      std::move(flag_callback));
+}
+
+// The value of a bound flag is also written to the variable returned by
+// its binding, which initially holds the default value
+template <typename Type>
+HORSEWHISPERER_API void DefineGlobalFlag(std::string aliases,
+                                         std::string description,
+                                         FlagBinding<Type> binding,
+                                         Type default_value,
+                                         FlagCallback<Type> flag_callback) {
+    HorseWhisperer::Instance().defineGlobalFlag<Type>(std::move(aliases),
+                                                      std::move(description),
+                                                      std::move(default_value),
+                                                      std::move(flag_callback),
+                                                      std::move(binding));
 }
 
 template <typename Type>
-static void DefineActionFlag(std::string action_name,
-                                std::string aliases,
-                                std::string description,
-                                Type default_value,
-                                FlagCallback<Type> flag_callback) {
+HORSEWHISPERER_API void DefineActionFlag(std::string action_name,
+                                         std::string aliases,
+                                         std::string description,
+                                         FlagBinding<Type> binding,
+                                         Type default_value,
+                                         FlagCallback<Type> flag_callback) {
     HorseWhisperer::Instance().defineActionFlag<Type>(action_name,
-                                                      aliases,
-                                                      description,
-                                                      default_value,
-                                                      flag_callback);
+                                                      std::move(aliases),
+                                                      std::move(description),
+                                                      std::move(default_value),
+                                                      std::move(flag_callback),
+                                                      std::move(binding));
+}
+
+// Declares the next positional parameter of the action; parse() converts
+// and validates its argument and writes it to the variable returned by
+// the binding
+template <typename Type>
+HORSEWHISPERER_API void DefineActionArgument(std::string action_name,
+                                             std::string name,
+                                             std::string description,
+                                             FlagBinding<Type> binding,
+                                             Type default_value,
+                                             FlagCallback<Type> validation_callback) {
+    HorseWhisperer::Instance().defineActionArgument<Type>(action_name,
+                                                          std::move(name),
+                                                          std::move(description),
+                                                          std::move(default_value),
+                                                          std::move(validation_callback),
+                                                          std::move(binding));
 }
 
 template <typename Type>
-static Type GetFlag(std::string const& flag_name) {
+HORSEWHISPERER_API Type GetFlag(std::string const& flag_name) {
     return HorseWhisperer::Instance().getFlagValue<Type>(flag_name);
 }
 
-static FlagType GetFlagType(std::string const& flag_name) {
+HORSEWHISPERER_API FlagType GetFlagType(std::string const& flag_name) {
     return HorseWhisperer::Instance().checkAndGetTypeOfFlag(flag_name);
 }
 
 template <typename Type>
-static void SetFlag(std::string const& flag_name, Type value) {
+HORSEWHISPERER_API void SetFlag(std::string const& flag_name, Type value) {
     HorseWhisperer::Instance().setFlag<Type>(flag_name, std::move(value));
 }
 
-static void DefineAction(std::string action_name,
-                         int arity,
-                         bool chainable,
-                         std::string description,
-                         std::string help_string,
-                         ActionCallback action_callback,
-                         ArgumentsCallback arguments_callback = nullptr,
-                         bool variable_arity = false) {
-    HorseWhisperer::Instance().defineAction(action_name,
+HORSEWHISPERER_API void DefineAction(std::string action_name,
+                                     int arity,
+                                     bool chainable,
+                                     std::string description,
+                                     std::string help_string,
+                                     ActionCallback action_callback,
+                                     ArgumentsCallback arguments_callback,
+                                     bool variable_arity) {
+    HorseWhisperer::Instance().defineAction(std::move(action_name),
                                             arity,
                                             chainable,
-                                            description,
-                                            help_string,
-                                            action_callback,
-                                            arguments_callback,
+                                            std::move(description),
+                                            std::move(help_string),
+                                            std::move(action_callback),
+                                            std::move(arguments_callback),
                                             variable_arity);
 }
 
-static bool IsActionFlag(std::string action, std::string flagname) {
+// Used by DefineAction<Options>; make_options creates the options struct
+// of each context, which is handed to the action callback
+HORSEWHISPERER_API void DefineActionWithOptions(std::string action_name,
+                                                int arity,
+                                                bool chainable,
+                                                std::string description,
+                                                std::string help_string,
+                                                std::function<std::shared_ptr<void>()> make_options,
+                                                std::function<int(const Arguments&, const void*)> action_callback,
+                                                ArgumentsCallback arguments_callback,
+                                                bool variable_arity) {
+    HorseWhisperer::Instance().defineActionWithOptions(std::move(action_name),
+                                                       arity,
+                                                       chainable,
+                                                       std::move(description),
+                                                       std::move(help_string),
+                                                       std::move(make_options),
+                                                       std::move(action_callback),
+                                                       std::move(arguments_callback),
+                                                       variable_arity);
+}
+
+// Defines an action with at least arity arguments which reads them
+// through an ArgumentStream while it runs, so that "-" and "@path"
+// arguments can provide any number of arguments in constant memory
+HORSEWHISPERER_API void DefineStreamingAction(std::string action_name,
+                                              int arity,
+                                              bool chainable,
+                                              std::string description,
+                                              std::string help_string,
+                                              StreamingActionCallback action_callback,
+                                              ArgumentsCallback arguments_callback) {
+    HorseWhisperer::Instance().defineStreamingAction(std::move(action_name),
+                                                     arity,
+                                                     chainable,
+                                                     std::move(description),
+                                                     std::move(help_string),
+                                                     std::move(action_callback),
+                                                     std::move(arguments_callback));
+}
+
+HORSEWHISPERER_API void DefineActionGroup(std::string path,
+                                          std::string description,
+                                          std::string help_string) {
+    HorseWhisperer::Instance().defineActionGroup(std::move(path),
+                                                 std::move(description),
+                                                 std::move(help_string));
+}
+
+HORSEWHISPERER_API bool IsActionFlag(std::string action, std::string flagname) {
     return HorseWhisperer::Instance().isActionFlag(action, flagname);
 }
 
-static void SetAppName(std::string name) {
-    HorseWhisperer::Instance().setAppName(name);
+HORSEWHISPERER_API void SetAppName(std::string name) {
+    HorseWhisperer::Instance().setAppName(std::move(name));
 }
 
-static void SetHelpBanner(std::string banner) {
-    HorseWhisperer::Instance().setHelpBanner(banner);
+HORSEWHISPERER_API void SetHelpBanner(std::string banner) {
+    HorseWhisperer::Instance().setHelpBanner(std::move(banner));
 }
 
-static void SetVersion(std::string version_string, std::string short_flag_string = "") {
+HORSEWHISPERER_API void SetVersion(std::string version_string, std::string short_flag_string) {
     HorseWhisperer::Instance().setVersionString(version_string, short_flag_string);
 }
 
-static void SetDelimiters(std::vector<std::string> const& delimiters) {
+HORSEWHISPERER_API void SetDelimiters(std::vector<std::string> const& delimiters) {
     HorseWhisperer::Instance().setDelimiters(delimiters);
 }
 
@@ -1198,34 +6755,295 @@ static void SetDelimiters(std::vector<std::string> const& delimiters) {
 // callback invalidates or fails to validate an argument.
 // Throw a flag_validation_error in case any flag validation
 // callback invalidates or fails to validate a flag value.
-static ParseResult Parse(int argc, char** argv) {
+HORSEWHISPERER_API ParseResult Parse(int argc, char** argv) {
     return HorseWhisperer::Instance().parse(argc, argv);
 }
 
-static void ShowHelp(bool show_actions_help) {
+HORSEWHISPERER_API void ShowHelp(bool show_actions_help) {
     HorseWhisperer::Instance().help(show_actions_help);
 }
 
-static void ShowVersion() {
+HORSEWHISPERER_API void ShowVersion() {
     HorseWhisperer::Instance().version();
 }
 
-static std::vector<std::string> GetParsedActions() {
+HORSEWHISPERER_API std::vector<std::string> GetParsedActions() {
     return HorseWhisperer::Instance().getParsedActions();
 }
 
-static int Start() {
+HORSEWHISPERER_API int Start() {
     return HorseWhisperer::Instance().whisper();
 }
 
-static void Reset() {
+HORSEWHISPERER_API void Reset() {
     HorseWhisperer::Instance().reset();
 }
 
-static void SetHelpMargins(unsigned int left_margin, unsigned int right_margin) {
+HORSEWHISPERER_API void SetHelpMargins(unsigned int left_margin, unsigned int right_margin) {
     HorseWhisperer::Instance().setHelpMargins(left_margin, right_margin);
 }
 
+// Mark an action as idempotent: its outcome (exit code and output on
+// stdout) depends only on its arguments and flags. Start() will then
+// replay a cached outcome of an identical invocation, if one younger
+// than ttl exists, instead of calling the action callback; a zero ttl
+// means that cached outcomes never expire.
+HORSEWHISPERER_API void SetActionIdempotent(std::string action_name,
+                                            std::chrono::seconds ttl = std::chrono::seconds { 0 }) {
+    HorseWhisperer::Instance().setActionIdempotent(action_name, ttl);
+}
+
+// When enabled, Parse() postpones the flag validation callbacks until
+// the whole command line is tokenized and then runs them, together with
+// the arguments validation callbacks, on up to num_threads threads (all
+// the available CPUs if zero). Callbacks must be thread safe. In case
+// of multiple failures, the error of the first failing flag or action in
+// command line order is thrown.
+HORSEWHISPERER_API void SetConcurrentValidation(bool enabled, unsigned int num_threads) {
+    HorseWhisperer::Instance().setConcurrentValidation(enabled, num_threads);
+}
+
+// Actions still running after their deadline, or after the number of
+// seconds given by the --timeout flag, are cancelled and whisper()
+// returns ACTION_TIMEOUT_EXIT_CODE
+HORSEWHISPERER_API void SetActionDeadline(std::string action_name,
+                                          std::chrono::milliseconds deadline) {
+    HorseWhisperer::Instance().setActionDeadline(action_name, deadline);
+}
+
+// Forked actions run in child processes; consecutive forked actions of
+// a chain run concurrently, and their output is replayed in chain order
+HORSEWHISPERER_API void SetActionForked(std::string action_name) {
+    HorseWhisperer::Instance().setActionForked(action_name);
+}
+
+// The callback of a variable-arity action is invoked once per argument,
+// in parallel on the --jobs workers, and its exit codes are combined with
+// the specified policy
+HORSEWHISPERER_API void SetActionPerArgument(std::string action_name,
+                                             ExitCodePolicy policy) {
+    HorseWhisperer::Instance().setActionPerArgument(action_name, policy);
+}
+
+// By default the output of the actions is written when flushed, except
+// for per-argument actions; see OutputMode
+HORSEWHISPERER_API void SetOutputMode(OutputMode mode) {
+    HorseWhisperer::Instance().setOutputMode(mode);
+}
+
+// Capture what each action writes to std::cout in the output of its
+// result instead of writing it; see GetActionResults
+HORSEWHISPERER_API void SetOutputCapture(bool enabled) {
+    HorseWhisperer::Instance().setOutputCapture(enabled);
+}
+
+// Maximum number of forked actions running at once; by default, the
+// number of hardware threads
+HORSEWHISPERER_API void SetMaxForkedActions(unsigned int max_processes) {
+    HorseWhisperer::Instance().setMaxForkedActions(max_processes);
+}
+
+// Result of the running action, up to 64KiB when the action is forked
+HORSEWHISPERER_API void SetActionResult(std::string result) {
+    HorseWhisperer::Instance().setActionResult(std::move(result));
+}
+
+// Exit codes and results of the actions executed by the last Start()
+HORSEWHISPERER_API std::vector<ActionResult> GetActionResults() {
+    return HorseWhisperer::Instance().actionResults();
+}
+
+// Token of the running action, cancelled when its deadline expires or
+// on SIGINT/SIGTERM
+HORSEWHISPERER_API CancellationToken GetCancellationToken() {
+    return HorseWhisperer::Instance().cancellationToken();
+}
+
+// Same as --trace-file; the trace is written when Start() returns or,
+// if the actions aren't started, at exit. An empty path disables tracing.
+HORSEWHISPERER_API void SetTraceFile(std::string path) {
+    // Initializing HorseWhisperer resets the tracer
+    HorseWhisperer::Instance();
+    Tracer::Instance().setFile(std::move(path));
+}
+
+// Runs body for each index in [begin, end) on the executor shared by the
+// actions, sized by the --jobs flag; see Executor::parallelFor
+HORSEWHISPERER_API void ParallelFor(size_t begin, size_t end,
+                                    const std::function<void(size_t)>& body,
+                                    size_t grain) {
+    HorseWhisperer::Instance().executor().parallelFor(begin, end, body, grain);
+}
+
+// Runs the task on the executor shared by the actions; see Submit
+HORSEWHISPERER_API void SubmitTask(std::function<void()> task) {
+    HorseWhisperer::Instance().executor().submit(std::move(task));
+}
+
+// Writes the tables of the current definitions to a schema image and
+// returns its checksum; meant to be called at build time, once all the
+// flags and actions are defined
+HORSEWHISPERER_API uint64_t SaveSchema(std::string path) {
+    return HorseWhisperer::Instance().saveSchema(path);
+}
+
+// Maps a schema image and resets HorseWhisperer, as Reset() does; the
+// definitions that follow are bound to the ones of the image instead of
+// being added to the tables. A non zero checksum must match the one
+// returned by SaveSchema. Returns false, leaving the definitions to be
+// made at runtime, in case the image can't be used.
+HORSEWHISPERER_API bool LoadSchema(std::string path, uint64_t checksum) {
+    return HorseWhisperer::Instance().loadSchema(path, checksum);
+}
+
+// By default outcomes are cached in $TMPDIR/horsewhisperer-cache
+HORSEWHISPERER_API void SetActionCacheDirectory(std::string directory) {
+    HorseWhisperer::Instance().actionCache().setDirectory(std::move(directory));
+}
+
+HORSEWHISPERER_API void SetActionCacheSizeLimit(uint64_t max_bytes) {
+    HorseWhisperer::Instance().actionCache().setSizeLimit(max_bytes);
+}
+
+HORSEWHISPERER_API ActionCacheStats GetActionCacheStats() {
+    return HorseWhisperer::Instance().actionCache().stats();
+}
+
+// Counters of the actions executed by the last Start() with --hw-counters
+// or --hw-counters-file
+HORSEWHISPERER_API std::vector<ActionCounters> GetActionCounters() {
+    return HorseWhisperer::Instance().actionCounters();
+}
+
+// Resources used by each action executed by the last Start()
+HORSEWHISPERER_API std::vector<ActionResources> GetActionResources() {
+    return HorseWhisperer::Instance().actionResources();
+}
+
+// Messages are written to stderr by default; a null stream discards them.
+HORSEWHISPERER_API void SetLogStream(std::ostream* stream) {
+    FlushLog();
+    Logger::Instance().setStream(stream);
+}
+
+// Block until all the messages logged so far are written; Start()
+// flushes the log before returning.
+HORSEWHISPERER_API void FlushLog() {
+    Logger::Instance().flush();
+}
+
+#endif  // HORSEWHISPERER_DECLARATIONS_ONLY
+
+// Runs the function on the executor shared by the actions
+template <typename Function>
+HORSEWHISPERER_API auto Submit(Function function) -> std::future<decltype(function())> {
+    using Result = decltype(function());
+    auto task = std::make_shared<std::packaged_task<Result()>>(std::move(function));
+    auto result = task->get_future();
+    SubmitTask([task]() { (*task)(); });
+    return result;
+}
+
+// Binds the flag to the variable: parse() writes the validated value
+// there. The chained contexts of an action flag share the variable.
+template <typename Type>
+HORSEWHISPERER_API void DefineGlobalFlag(std::string aliases,
+                                         std::string description,
+                                         Type* variable,
+                                         Type default_value,
+                                         FlagCallback<Type> flag_callback) {
+    DefineGlobalFlag<Type>(std::move(aliases), std::move(description),
+                           FlagBinding<Type> { [variable](void*) { return variable; } },
+                           std::move(default_value), std::move(flag_callback));
+}
+
+template <typename Type>
+HORSEWHISPERER_API void DefineActionFlag(std::string action_name,
+                                         std::string aliases,
+                                         std::string description,
+                                         Type* variable,
+                                         Type default_value,
+                                         FlagCallback<Type> flag_callback) {
+    DefineActionFlag<Type>(std::move(action_name), std::move(aliases),
+                           std::move(description),
+                           FlagBinding<Type> { [variable](void*) { return variable; } },
+                           std::move(default_value), std::move(flag_callback));
+}
+
+// Binds the flag to a member of the options struct of the action, which
+// must be defined with DefineAction<Options>; each context gets its own
+// value
+template <typename Type, typename Options>
+HORSEWHISPERER_API void DefineActionFlag(std::string action_name,
+                                         std::string aliases,
+                                         std::string description,
+                                         Type Options::* member,
+                                         Type default_value,
+                                         FlagCallback<Type> flag_callback) {
+    DefineActionFlag<Type>(std::move(action_name), std::move(aliases),
+                           std::move(description),
+                           FlagBinding<Type> {
+                               [member](void* options) {
+                                   assert(options);
+                                   return &(static_cast<Options*>(options)->*member);
+                               } },
+                           std::move(default_value), std::move(flag_callback));
+}
+
+template <typename Type>
+HORSEWHISPERER_API void DefineActionArgument(std::string action_name,
+                                             std::string name,
+                                             std::string description,
+                                             Type* variable,
+                                             Type default_value,
+                                             FlagCallback<Type> validation_callback) {
+    DefineActionArgument<Type>(std::move(action_name), std::move(name),
+                               std::move(description),
+                               FlagBinding<Type> { [variable](void*) { return variable; } },
+                               std::move(default_value), std::move(validation_callback));
+}
+
+// Binds the parameter to a member of the options struct of the action,
+// defined with DefineAction<Options>
+template <typename Type, typename Options>
+HORSEWHISPERER_API void DefineActionArgument(std::string action_name,
+                                             std::string name,
+                                             std::string description,
+                                             Type Options::* member,
+                                             Type default_value,
+                                             FlagCallback<Type> validation_callback) {
+    DefineActionArgument<Type>(std::move(action_name), std::move(name),
+                               std::move(description),
+                               FlagBinding<Type> {
+                                   [member](void* options) {
+                                       assert(options);
+                                       return &(static_cast<Options*>(options)->*member);
+                                   } },
+                               std::move(default_value), std::move(validation_callback));
+}
+
+// Defines an action whose callback receives an Options instance, created
+// for each context of the action, holding the values of the flags bound
+// to its members
+template <typename Options>
+HORSEWHISPERER_API void DefineAction(std::string action_name,
+                                     int arity,
+                                     bool chainable,
+                                     std::string description,
+                                     std::string help_string,
+                                     OptionsActionCallback<Options> action_callback,
+                                     ArgumentsCallback arguments_callback,
+                                     bool variable_arity) {
+    DefineActionWithOptions(
+        std::move(action_name), arity, chainable, std::move(description),
+        std::move(help_string),
+        []() { return std::shared_ptr<void> { std::make_shared<Options>() }; },
+        [action_callback](const Arguments& arguments, const void* options) {
+            return action_callback(arguments, *static_cast<const Options*>(options));
+        },
+        std::move(arguments_callback), variable_arity);
+}
+
 }  // namespace HorseWhisperer
 
 #endif  // INCLUDE_HORSEWHISPERER_HORSEWHISPERER_H_
@@ -0,0 +1,596 @@
+#ifndef INCLUDE_HORSEWHISPERER_SERVER_H_
+#define INCLUDE_HORSEWHISPERER_SERVER_H_
+
+// Command server: a warmed process that owns the definitions and runs
+// each command line in a pre-forked child, so that clients don't pay
+// for the startup of the application. POSIX only.
+
+#include "horsewhisperer.h"
+
+#include <set>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+namespace HorseWhisperer {
+
+//
+// Types
+//
+
+// Runs a command line in a worker, after the definitions; returns the
+// exit code to be forwarded to the client
+using CommandRunner = std::function<int(int argc, char** argv)>;
+
+//
+// Tokens
+//
+
+// Number of idle workers waiting for a request
+static const unsigned int SERVER_WORKERS_DEFAULT = 4;
+
+//
+// API Declarations
+//
+
+static int RunCommandLine(int argc, char** argv) __attribute__ ((unused));
+static int Serve(std::string socket_path,
+                 unsigned int num_workers = SERVER_WORKERS_DEFAULT,
+                 CommandRunner runner = RunCommandLine) __attribute__ ((unused));
+static int ForwardToServer(std::string socket_path,
+                           int argc, char** argv) __attribute__ ((unused));
+
+//
+// CommandServer
+//
+
+// Protocol: the client sends a RequestHeader, carrying its stdin,
+// stdout and stderr descriptors as SCM_RIGHTS ancillary data, followed
+// by the NUL terminated working directory, arguments and environment
+// variables. The worker replies with the 4 byte exit code.
+class CommandServer {
+  public:
+    struct RequestHeader {
+        uint32_t magic;
+        uint32_t argc;
+        uint32_t envc;
+        uint32_t payload_size;
+    };
+
+    static const uint32_t REQUEST_MAGIC = 0x31535748;  // "HWS1"
+    static const uint32_t MAX_PAYLOAD_SIZE = 16 * 1024 * 1024;
+    static const int NUM_FORWARDED_FDS = 3;
+
+    // The signal handlers write to a pipe, so that the server loop
+    // wakes up whichever thread runs them
+    template <typename Dummy = void>
+    struct ServerSignals {
+        static volatile sig_atomic_t stop;
+        static int pipe_fds[2];
+
+        static void handleStop(int) {
+            stop = 1;
+            notify();
+        }
+
+        static void handleChild(int) {
+            notify();
+        }
+
+        static void notify() {
+            auto saved_errno = errno;
+            char byte { 0 };
+            if (write(pipe_fds[1], &byte, 1) < 0) {
+                // The pipe is full; the loop will wake up anyway
+            }
+            errno = saved_errno;
+        }
+    };
+
+    static int serve(const std::string& socket_path, unsigned int num_workers,
+                     const CommandRunner& runner) {
+        using Signals = ServerSignals<>;
+
+        if (pipe(Signals::pipe_fds) != 0) {
+            std::cout << "Failed to create a pipe: " << std::strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+        for (auto fd : Signals::pipe_fds) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+
+        int listen_fd = listenOn(socket_path);
+        if (listen_fd < 0) {
+            closePipe();
+            return EXIT_FAILURE;
+        }
+
+        // Anything buffered now would be written by every worker
+        std::cout.flush();
+        std::cerr.flush();
+        Logger::Instance().flush();
+
+        Signals::stop = 0;
+        struct sigaction previous_int {};
+        struct sigaction previous_term {};
+        struct sigaction previous_chld {};
+        installHandler(SIGINT, Signals::handleStop, previous_int);
+        installHandler(SIGTERM, Signals::handleStop, previous_term);
+        installHandler(SIGCHLD, Signals::handleChild, previous_chld);
+
+        std::set<pid_t> workers {};
+        while (!Signals::stop) {
+            // Replace the workers as they complete their request
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                workers.erase(pid);
+            }
+
+            bool fork_failed { false };
+            while (workers.size() < std::max(num_workers, 1u)) {
+                // The signals are blocked until the worker restores the
+                // default handlers, so that a SIGTERM sent right after the
+                // fork isn't caught by the server handler in the worker
+                sigset_t blocked {};
+                sigset_t previous_mask {};
+                sigemptyset(&blocked);
+                sigaddset(&blocked, SIGINT);
+                sigaddset(&blocked, SIGTERM);
+                sigaddset(&blocked, SIGCHLD);
+                sigprocmask(SIG_BLOCK, &blocked, &previous_mask);
+                pid = fork();
+                if (pid == 0) {
+                    // Workers are stopped with SIGTERM; handlers inherited
+                    // from the application must not run in them
+                    signal(SIGINT, SIG_DFL);
+                    signal(SIGTERM, SIG_DFL);
+                    signal(SIGCHLD, SIG_DFL);
+                    sigprocmask(SIG_SETMASK, &previous_mask, nullptr);
+                    closePipe();
+                    runWorker(listen_fd, runner);
+                }
+                sigprocmask(SIG_SETMASK, &previous_mask, nullptr);
+                if (pid < 0) {
+                    std::cout << "Failed to fork a server worker: "
+                              << std::strerror(errno) << std::endl;
+                    fork_failed = true;
+                    break;
+                }
+                workers.insert(pid);
+            }
+
+            // Wait for a signal; retry failed forks after a while
+            pollfd wake_up { Signals::pipe_fds[0], POLLIN, 0 };
+            poll(&wake_up, 1, fork_failed ? 100 : -1);
+            char bytes[64];
+            while (read(Signals::pipe_fds[0], bytes, sizeof(bytes)) > 0) {}
+        }
+
+        for (auto pid : workers) {
+            kill(pid, SIGTERM);
+        }
+        for (auto pid : workers) {
+            int status;
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+        }
+
+        close(listen_fd);
+        unlink(socket_path.c_str());
+        sigaction(SIGINT, &previous_int, nullptr);
+        sigaction(SIGTERM, &previous_term, nullptr);
+        sigaction(SIGCHLD, &previous_chld, nullptr);
+        closePipe();
+        return EXIT_SUCCESS;
+    }
+
+    static int forward(const std::string& socket_path, int argc, char** argv) {
+        int fd = connectTo(socket_path);
+        if (fd < 0) {
+            return -1;
+        }
+
+        std::string payload { currentDirectory() };
+        payload += '\0';
+        for (int idx = 0; idx < argc; idx++) {
+            payload += argv[idx];
+            payload += '\0';
+        }
+        uint32_t envc { 0 };
+        for (char** var = environ; var && *var; var++, envc++) {
+            payload += *var;
+            payload += '\0';
+        }
+
+        RequestHeader header { REQUEST_MAGIC, static_cast<uint32_t>(argc), envc,
+                               static_cast<uint32_t>(payload.size()) };
+        int fds[NUM_FORWARDED_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+        int32_t exit_code;
+
+        // The worker owns the terminal from now on
+        std::cout.flush();
+        std::cerr.flush();
+
+        if (!sendWithFds(fd, &header, sizeof(header), fds)
+                || !writeAll(fd, payload.data(), payload.size())) {
+            close(fd);
+            return -1;
+        }
+
+        if (!readAll(fd, &exit_code, sizeof(exit_code))) {
+            // The worker died
+            exit_code = EXIT_FAILURE;
+        }
+
+        close(fd);
+        return exit_code;
+    }
+
+  private:
+    static void installHandler(int signal_number, void (*handler)(int),
+                               struct sigaction& previous) {
+        struct sigaction action {};
+        action.sa_handler = handler;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        sigaction(signal_number, &action, &previous);
+    }
+
+    static void closePipe() {
+        close(ServerSignals<>::pipe_fds[0]);
+        close(ServerSignals<>::pipe_fds[1]);
+    }
+
+    static int listenOn(const std::string& socket_path) {
+        sockaddr_un address {};
+        if (socket_path.size() >= sizeof(address.sun_path)) {
+            std::cout << "Socket path too long: " << socket_path << std::endl;
+            return -1;
+        }
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+        // Only the owner may connect; nobody can connect before listen(),
+        // so the socket is restricted before it accepts any request
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(socket_path.c_str());
+        if (fd < 0
+                || bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+                || chmod(socket_path.c_str(), S_IRUSR | S_IWUSR) != 0
+                || listen(fd, SOMAXCONN) != 0) {
+            std::cout << "Failed to listen on " << socket_path << ": "
+                      << std::strerror(errno) << std::endl;
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        return fd;
+    }
+
+    static int connectTo(const std::string& socket_path) {
+        sockaddr_un address {};
+        if (socket_path.size() >= sizeof(address.sun_path)) {
+            return -1;
+        }
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // Serve a single request, then exit; never returns
+    static void runWorker(int listen_fd, const CommandRunner& runner) {
+        int fd;
+        while ((fd = accept(listen_fd, nullptr, nullptr)) < 0 && errno == EINTR) {}
+        close(listen_fd);
+        if (fd < 0) {
+            _exit(EXIT_FAILURE);
+        }
+        if (!isOwnerPeer(fd)) {
+            close(fd);
+            _exit(EXIT_FAILURE);
+        }
+
+        int32_t exit_code { EXIT_FAILURE };
+        std::vector<std::string> strings {};
+        size_t argc { 0 };
+        if (receiveRequest(fd, strings, argc)) {
+            exit_code = runRequest(strings, argc, runner);
+        }
+
+        std::cout.flush();
+        std::cerr.flush();
+        Logger::Instance().flush();
+        if (Tracer::Instance().enabled()) {
+            Tracer::Instance().write();
+        }
+
+        writeAll(fd, &exit_code, sizeof(exit_code));
+        close(fd);
+
+        // The worker shares the process image of the server; skip the
+        // static destructors, e.g. the Logger would join a writer
+        // thread that exists only in the server
+        _exit(exit_code);
+    }
+
+    // On success, strings contains the working directory, the argc
+    // arguments and the environment variables
+    static bool receiveRequest(int fd, std::vector<std::string>& strings, size_t& argc) {
+        RequestHeader header {};
+        int fds[NUM_FORWARDED_FDS];
+        if (!receiveWithFds(fd, &header, sizeof(header), fds)) {
+            return false;
+        }
+
+        if (header.magic != REQUEST_MAGIC || header.payload_size > MAX_PAYLOAD_SIZE) {
+            closeFds(fds, NUM_FORWARDED_FDS);
+            return false;
+        }
+
+        // Redirect stdio to the client's descriptors
+        for (int idx = 0; idx < NUM_FORWARDED_FDS; idx++) {
+            dup2(fds[idx], idx);
+            close(fds[idx]);
+        }
+
+        std::string payload(header.payload_size, '\0');
+        if (!readAll(fd, &payload[0], payload.size())) {
+            return false;
+        }
+
+        for (size_t begin = 0; begin < payload.size(); ) {
+            auto end = payload.find('\0', begin);
+            if (end == std::string::npos) {
+                end = payload.size();
+            }
+            strings.emplace_back(payload, begin, end - begin);
+            begin = end + 1;
+        }
+        argc = header.argc;
+        return strings.size() == 1 + header.argc + header.envc && header.argc > 0;
+    }
+
+    static int runRequest(std::vector<std::string>& strings, size_t argc,
+                          const CommandRunner& runner) {
+        if (chdir(strings[0].c_str()) != 0) {
+            std::cout << "Failed to change directory to " << strings[0] << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        std::vector<char*> argv {};
+        for (size_t idx = 1; idx <= argc; idx++) {
+            argv.push_back(&strings[idx][0]);
+        }
+        argv.push_back(nullptr);
+
+        clearenv();
+        for (size_t idx = argc + 1; idx < strings.size(); idx++) {
+            auto& var = strings[idx];
+            auto separator = var.find('=');
+            if (separator != std::string::npos && separator > 0) {
+                setenv(var.substr(0, separator).c_str(),
+                       var.c_str() + separator + 1, 1);
+            }
+        }
+
+        return runner(static_cast<int>(argc), argv.data());
+    }
+
+    static bool sendWithFds(int fd, const void* data, size_t size,
+                            const int (&fds)[NUM_FORWARDED_FDS]) {
+        char control[CMSG_SPACE(sizeof(fds))] {};
+        iovec io { const_cast<void*>(data), size };
+        msghdr message {};
+        message.msg_iov = &io;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        auto cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+        ssize_t sent;
+        while ((sent = sendmsg(fd, &message, 0)) < 0 && errno == EINTR) {}
+        if (sent < 0) {
+            return false;
+        }
+        return writeAll(fd, static_cast<const char*>(data) + sent, size - sent);
+    }
+
+    static bool receiveWithFds(int fd, void* data, size_t size,
+                               int (&fds)[NUM_FORWARDED_FDS]) {
+        char control[CMSG_SPACE(sizeof(fds))] {};
+        iovec io { data, size };
+        msghdr message {};
+        message.msg_iov = &io;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        // The descriptors must not leak into the processes spawned by
+        // the actions before they replace stdio
+#ifdef MSG_CMSG_CLOEXEC
+        int flags { MSG_CMSG_CLOEXEC };
+#else
+        int flags { 0 };
+#endif
+        ssize_t received;
+        while ((received = recvmsg(fd, &message, flags)) < 0 && errno == EINTR) {}
+        if (received <= 0) {
+            return false;
+        }
+
+        // Whatever descriptors were received are closed on rejection
+        auto cmsg = CMSG_FIRSTHDR(&message);
+        if ((message.msg_flags & MSG_CTRUNC) || !cmsg
+                || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+                || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+            for (; cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                    auto num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    int received_fds[NUM_FORWARDED_FDS];
+                    num_fds = std::min(num_fds, sizeof(received_fds) / sizeof(int));
+                    std::memcpy(received_fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+                    closeFds(received_fds, num_fds);
+                }
+            }
+            return false;
+        }
+        std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+#ifndef MSG_CMSG_CLOEXEC
+        for (auto received_fd : fds) {
+            fcntl(received_fd, F_SETFD, FD_CLOEXEC);
+        }
+#endif
+
+        if (!readAll(fd, static_cast<char*>(data) + received, size - received)) {
+            closeFds(fds, NUM_FORWARDED_FDS);
+            return false;
+        }
+        return true;
+    }
+
+    static void closeFds(const int* fds, size_t num_fds) {
+        for (size_t idx = 0; idx < num_fds; idx++) {
+            close(fds[idx]);
+        }
+    }
+
+    // Only processes of the user running the server may submit requests
+    static bool isOwnerPeer(int fd) {
+#ifdef SO_PEERCRED
+        ucred credentials {};
+        socklen_t size = sizeof(credentials);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) != 0) {
+            return false;
+        }
+        return credentials.uid == geteuid();
+#else
+        uid_t uid;
+        gid_t gid;
+        return getpeereid(fd, &uid, &gid) == 0 && uid == geteuid();
+#endif
+    }
+
+    static bool writeAll(int fd, const void* data, size_t size) {
+        auto bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            auto written = write(fd, bytes, size);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            bytes += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    static bool readAll(int fd, void* data, size_t size) {
+        auto bytes = static_cast<char*>(data);
+        while (size > 0) {
+            auto bytes_read = read(fd, bytes, size);
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read <= 0) {
+                return false;
+            }
+            bytes += bytes_read;
+            size -= bytes_read;
+        }
+        return true;
+    }
+
+    static std::string currentDirectory() {
+        std::vector<char> buffer(4096);
+        if (!getcwd(buffer.data(), buffer.size())) {
+            return "/";
+        }
+        return buffer.data();
+    }
+};
+
+template <typename Dummy>
+volatile sig_atomic_t CommandServer::ServerSignals<Dummy>::stop = 0;
+
+template <typename Dummy>
+int CommandServer::ServerSignals<Dummy>::pipe_fds[2] = { -1, -1 };
+
+//
+// API
+//
+
+// Default runner: parse the command line and start the actions, as
+// the main() of a typical application does
+static int RunCommandLine(int argc, char** argv) {
+    try {
+        switch (Parse(argc, argv)) {
+            case ParseResult::OK:
+                break;
+            case ParseResult::HELP:
+                ShowHelp();
+                return EXIT_SUCCESS;
+            case ParseResult::VERSION:
+                ShowVersion();
+                return EXIT_SUCCESS;
+            case ParseResult::FAILURE:
+                std::cout << "Failed to parse the command line input." << std::endl;
+                return EXIT_FAILURE;
+            case ParseResult::INVALID_FLAG:
+                std::cout << "Invalid flag." << std::endl;
+                return EXIT_FAILURE;
+        }
+    } catch (horsewhisperer_error& e) {
+        std::cout << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return Start();
+}
+
+// Listen on the specified Unix socket and run each received command
+// line, with the client's stdio, environment and working directory, in
+// a worker forked in advance from this process. Only processes of the
+// same user can connect. Must be called after the definitions and
+// before Parse(). Returns on SIGINT or SIGTERM.
+static int Serve(std::string socket_path, unsigned int num_workers,
+                 CommandRunner runner) {
+    return CommandServer::serve(socket_path, num_workers, runner);
+}
+
+// Run the command line in the server listening on the specified
+// socket. Returns the exit code of the command or -1 in case the
+// server is unreachable, so that the caller can run it locally.
+static int ForwardToServer(std::string socket_path, int argc, char** argv) {
+    return CommandServer::forward(socket_path, argc, argv);
+}
+
+}  // namespace HorseWhisperer
+
+#endif  // INCLUDE_HORSEWHISPERER_SERVER_H_
@@ -0,0 +1,41 @@
+// The horsewhisperer library: defines the API that horsewhisperer.h
+// declares when HORSEWHISPERER_COMPILED_LIB is defined, and instantiates
+// the flag templates for the supported flag types.
+
+#ifndef HORSEWHISPERER_COMPILED_LIB
+#define HORSEWHISPERER_COMPILED_LIB
+#endif
+#define HORSEWHISPERER_IMPLEMENTATION
+
+#include <horsewhisperer/horsewhisperer.h>
+
+namespace HorseWhisperer {
+
+#define HORSEWHISPERER_INSTANTIATE_FLAG_API(Type)                                 \
+    template void DefineGlobalFlag<Type>(std::string, std::string, Type,          \
+                                         FlagCallback<Type>);                     \
+    template void DefineActionFlag<Type>(std::string, std::string, std::string,   \
+                                         Type, FlagCallback<Type>);               \
+    template void DefineGlobalFlag<Type>(std::string, std::string,                \
+                                         FlagBinding<Type>, Type,                 \
+                                         FlagCallback<Type>);                     \
+    template void DefineActionFlag<Type>(std::string, std::string, std::string,   \
+                                         FlagBinding<Type>, Type,                 \
+                                         FlagCallback<Type>);                     \
+    template void DefineActionArgument<Type>(std::string, std::string,            \
+                                             std::string, FlagBinding<Type>,      \
+                                             Type, FlagCallback<Type>);           \
+    template Type GetFlag<Type>(std::string const&);                              \
+    template void SetFlag<Type>(std::string const&, Type);
+
+HORSEWHISPERER_INSTANTIATE_FLAG_API(bool)
+HORSEWHISPERER_INSTANTIATE_FLAG_API(int)
+HORSEWHISPERER_INSTANTIATE_FLAG_API(double)
+HORSEWHISPERER_INSTANTIATE_FLAG_API(std::string)
+HORSEWHISPERER_INSTANTIATE_FLAG_API(MultiString)
+HORSEWHISPERER_INSTANTIATE_FLAG_API(IntList)
+HORSEWHISPERER_INSTANTIATE_FLAG_API(DoubleList)
+
+#undef HORSEWHISPERER_INSTANTIATE_FLAG_API
+
+}  // namespace HorseWhisperer
@@ -0,0 +1,29 @@
+#include "test/allocation_counter.h"
+
+#include <cstdlib>
+#include <new>
+
+// Only the allocations of the measuring thread are counted, so that the
+// counts don't depend on the logger or the executor threads
+static thread_local size_t thread_allocations = 0;
+
+size_t threadAllocations() {
+    return thread_allocations;
+}
+
+void* operator new(size_t size) {
+    thread_allocations++;
+    void* ptr = std::malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc {};
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
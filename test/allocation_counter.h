@@ -0,0 +1,23 @@
+#ifndef TEST_ALLOCATION_COUNTER_H_
+#define TEST_ALLOCATION_COUNTER_H_
+
+#include <cstddef>
+
+// Number of heap allocations made so far by the calling thread; the
+// global operator new is replaced in allocation_counter.cpp
+size_t threadAllocations();
+
+// Counts the allocations made by the calling thread during its lifetime
+class AllocationCounter {
+  public:
+    AllocationCounter() : start_ { threadAllocations() } {}
+
+    size_t count() const {
+        return threadAllocations() - start_;
+    }
+
+  private:
+    size_t start_;
+};
+
+#endif  // TEST_ALLOCATION_COUNTER_H_
@@ -0,0 +1,90 @@
+// Reports the heap memory and the time spent to define a large schema
+// of flags. Run with:
+//     ./horsewhisperer-flag-memory [num_flags]
+
+#include <horsewhisperer/horsewhisperer.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+
+namespace HW = HorseWhisperer;
+
+// Each block is prefixed by its size, so that the live heap size can
+// be tracked
+static const size_t HEADER_SIZE = 16;
+static std::atomic<size_t> live_bytes { 0 };
+static std::atomic<size_t> allocations { 0 };
+
+void* operator new(size_t size) {
+    auto block = static_cast<char*>(std::malloc(size + HEADER_SIZE));
+    if (!block) {
+        throw std::bad_alloc {};
+    }
+    *reinterpret_cast<size_t*>(block) = size;
+    live_bytes += size;
+    allocations++;
+    return block + HEADER_SIZE;
+}
+
+void operator delete(void* ptr) noexcept {
+    if (ptr) {
+        auto block = static_cast<char*>(ptr) - HEADER_SIZE;
+        live_bytes -= *reinterpret_cast<size_t*>(block);
+        std::free(block);
+    }
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+
+int main(int argc, char* argv[]) {
+    int num_flags = argc > 1 ? std::atoi(argv[1]) : 20000;
+    int num_actions = num_flags / 10;
+
+    // Instantiate the singleton before measuring
+    HW::Reset();
+
+    std::vector<std::string> aliases {};
+    std::vector<std::string> descriptions {};
+    for (int idx = 0; idx < num_flags; idx++) {
+        aliases.push_back("f" + std::to_string(idx) + " generated-flag-" + std::to_string(idx));
+        descriptions.push_back("Generated description of the flag number "
+                               + std::to_string(idx));
+    }
+    for (int idx = 0; idx < num_actions; idx++) {
+        HW::DefineAction("action-" + std::to_string(idx), 0, true, "", "", nullptr);
+    }
+
+    size_t bytes_before = live_bytes;
+    size_t allocations_before = allocations;
+    auto start = std::chrono::steady_clock::now();
+
+    for (int idx = 0; idx < num_flags; idx++) {
+        if (idx % 2) {
+            HW::DefineGlobalFlag<int>(aliases[idx], descriptions[idx], idx, nullptr);
+        } else {
+            HW::DefineActionFlag<std::string>("action-" + std::to_string(idx % num_actions),
+                                              aliases[idx], descriptions[idx],
+                                              "default", nullptr);
+        }
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    size_t bytes = live_bytes - bytes_before;
+    size_t num_allocations = allocations - allocations_before;
+
+    std::cout << "flags:                   " << num_flags << "\n"
+              << "live heap bytes:         " << bytes << "\n"
+              << "live heap bytes/flag:    " << bytes / num_flags << "\n"
+              << "allocations/flag:        "
+              << static_cast<double>(num_allocations) / num_flags << "\n"
+              << "definition time/flag:    "
+              << static_cast<double>(elapsed) / num_flags << " us\n";
+    return 0;
+}
@@ -0,0 +1,79 @@
+#!/usr/bin/env sh
+
+#     measure_multi_tu.sh
+#     ===================
+#
+#     Compiles a program made of many translation units, generated from
+#     multi_tu/module.cpp.in, once with the header only HorseWhisperer and
+#     once with the compiled library, and reports the time spent compiling
+#     the translation units of the program and the .text size of each
+#     variant. The library is compiled once, so its time is reported
+#     apart.
+#
+#     Usage: measure_multi_tu.sh [num_modules] [compiler flags]
+#     The compiler ($CXX, g++ by default) is run with -O2 if no flags are
+#     given.
+
+NUM_MODULES=${1:-16}
+if [ $# -gt 0 ]; then
+  shift
+fi
+FLAGS=${*:--O2}
+CXX=${CXX:-g++}
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+INCLUDE_DIRECTORY="$HERE/../../include"
+WORK_DIRECTORY=$(mktemp -d)
+trap 'rm -rf "$WORK_DIRECTORY"' EXIT
+
+module=1
+while [ $module -le $NUM_MODULES ]; do
+  sed "s/@MODULE@/$module/g" "$HERE/multi_tu/module.cpp.in" \
+    > "$WORK_DIRECTORY/module_$module.cpp"
+  module=$((module + 1))
+done
+cp "$HERE/multi_tu/main.cpp" "$WORK_DIRECTORY/main.cpp"
+
+now_ms() {
+  date +%s%3N
+}
+
+compile() {
+  $CXX -std=c++11 -pthread $FLAGS -I"$INCLUDE_DIRECTORY" "$@" || exit 1
+}
+
+# Compile the translation units of the program in the specified
+# directory, with the specified extra flags; print the elapsed ms
+compile_program() {
+  directory=$1
+  shift
+  mkdir -p "$directory"
+  begin=$(now_ms)
+  for source in "$WORK_DIRECTORY"/*.cpp; do
+    compile "$@" -c "$source" -o "$directory/$(basename "$source" .cpp).o"
+  done
+  echo $(($(now_ms) - begin))
+}
+
+text_size() {
+  size -A "$1" | awk '$1 == ".text" { print $2 }'
+}
+
+header_ms=$(compile_program "$WORK_DIRECTORY/header")
+compile "$WORK_DIRECTORY"/header/*.o -o "$WORK_DIRECTORY/header-only"
+
+compiled_ms=$(compile_program "$WORK_DIRECTORY/compiled" -DHORSEWHISPERER_COMPILED_LIB)
+begin=$(now_ms)
+compile -DHORSEWHISPERER_COMPILED_LIB -c "$HERE/../../src/horsewhisperer.cpp" \
+  -o "$WORK_DIRECTORY/horsewhisperer.o"
+library_ms=$(($(now_ms) - begin))
+compile "$WORK_DIRECTORY"/compiled/*.o "$WORK_DIRECTORY/horsewhisperer.o" \
+  -o "$WORK_DIRECTORY/compiled-library"
+
+echo "$NUM_MODULES modules + main, $CXX $FLAGS"
+printf "%-18s %14s %14s\n" "variant" "compile (ms)" ".text (bytes)"
+printf "%-18s %14s %14s\n" "header only" "$header_ms" \
+  "$(text_size "$WORK_DIRECTORY/header-only")"
+printf "%-18s %14s %14s\n" "compiled library" "$compiled_ms" \
+  "$(text_size "$WORK_DIRECTORY/compiled-library")"
+printf "%-18s %14s\n" "  library itself" "$library_ms"
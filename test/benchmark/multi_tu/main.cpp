@@ -0,0 +1,26 @@
+// Main of the multi translation unit program; the actions are defined
+// by the modules. See measure_multi_tu.sh.
+
+#include <horsewhisperer/horsewhisperer.h>
+
+namespace HW = HorseWhisperer;
+
+int main(int argc, char* argv[]) {
+    HW::SetAppName("multi-tu");
+    HW::SetHelpBanner("Usage: multi-tu [global options] <action> [options]");
+    HW::SetVersion("multi-tu 1.0\n");
+    HW::SetDelimiters(std::vector<std::string> { "+" });
+
+    switch (HW::Parse(argc, argv)) {
+        case HW::ParseResult::OK:
+            return HW::Start();
+        case HW::ParseResult::HELP:
+            HW::ShowHelp();
+            return EXIT_SUCCESS;
+        case HW::ParseResult::VERSION:
+            HW::ShowVersion();
+            return EXIT_SUCCESS;
+        default:
+            return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,206 @@
+// Execs programs built from startup/synthetic_schema.cpp many times and
+// reports, as JSON, the percentiles of the wall time and of the retired
+// instructions and the peak RSS of each scenario. Run with:
+//     ./horsewhisperer-startup-latency [--runs N] [--chain N] program...
+// The instructions are counted with perf_event_open when the kernel
+// allows it and are reported as null otherwise. Exits with failure if
+// any run of a program fails.
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct Scenario {
+    std::string name;
+    std::vector<std::string> arguments;
+};
+
+struct Sample {
+    int64_t wall_ns;
+    int64_t instructions;  // -1 if not counted
+    long max_rss_kb;
+};
+
+// Open a counter of the user space instructions retired by the specified
+// process and its threads, enabled when the process execs
+static int openInstructionCounter(pid_t pid) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(__NR_perf_event_open, &attr, pid, -1, -1,
+                                    PERF_FLAG_FD_CLOEXEC));
+}
+
+// Fork and exec the program with its output discarded; the child waits on
+// a pipe so that the counter is attached before it execs
+static bool run(const std::string& program, const Scenario& scenario, Sample& sample) {
+    std::vector<char*> argv { const_cast<char*>(program.c_str()) };
+    for (const auto& argument : scenario.arguments) {
+        argv.push_back(const_cast<char*>(argument.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    int go[2];
+    if (pipe2(go, O_CLOEXEC)) {
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(go[0]);
+        close(go[1]);
+        return false;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        char byte;
+        close(go[1]);
+        if (read(go[0], &byte, 1) == 1) {
+            execv(argv[0], argv.data());
+        }
+        _exit(127);
+    }
+
+    close(go[0]);
+    int counter = openInstructionCounter(pid);
+    char byte = 0;
+    if (write(go[1], &byte, 1) != 1) {
+        kill(pid, SIGKILL);
+    }
+    close(go[1]);
+
+    int status;
+    rusage usage;
+    wait4(pid, &status, 0, &usage);
+    sample.wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    sample.max_rss_kb = usage.ru_maxrss;
+    sample.instructions = -1;
+    if (counter >= 0) {
+        uint64_t count;
+        if (read(counter, &count, sizeof(count)) == sizeof(count)) {
+            sample.instructions = static_cast<int64_t>(count);
+        }
+        close(counter);
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int64_t percentile(std::vector<int64_t> values, int pct) {
+    std::sort(values.begin(), values.end());
+    auto idx = std::min(values.size() - 1, values.size() * pct / 100);
+    return values[idx];
+}
+
+static std::string escape(const std::string& str) {
+    std::string escaped {};
+    for (auto c : str) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+int main(int argc, char* argv[]) {
+    int runs = 1000;
+    int chain_length = 16;
+    std::vector<std::string> programs {};
+    for (int idx = 1; idx < argc; idx++) {
+        std::string arg { argv[idx] };
+        if (arg == "--runs" && idx + 1 < argc) {
+            runs = std::max(1, std::atoi(argv[++idx]));
+        } else if (arg == "--chain" && idx + 1 < argc) {
+            chain_length = std::max(1, std::atoi(argv[++idx]));
+        } else {
+            programs.push_back(arg);
+        }
+    }
+    if (programs.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [--runs N] [--chain N] program...\n";
+        return EXIT_FAILURE;
+    }
+
+    // The chain reuses action-0 so that it is valid for any schema size
+    Scenario chain { "chain", {} };
+    for (int idx = 0; idx < chain_length; idx++) {
+        if (idx) {
+            chain.arguments.push_back("+");
+        }
+        chain.arguments.push_back("action-0");
+        chain.arguments.push_back("pony");
+    }
+    std::vector<Scenario> scenarios {
+        { "version", { "--version" } },
+        { "help", { "--help" } },
+        { "action", { "action-0", "pony", "--tired-0" } },
+        chain,
+    };
+
+    int total_failures = 0;
+    std::cout << "{\n  \"runs\": " << runs << ",\n  \"programs\": [";
+    for (size_t p_idx = 0; p_idx < programs.size(); p_idx++) {
+        std::cout << (p_idx ? "," : "") << "\n    {\n      \"program\": \""
+                  << escape(programs[p_idx]) << "\",\n      \"scenarios\": [";
+        for (size_t s_idx = 0; s_idx < scenarios.size(); s_idx++) {
+            std::vector<int64_t> wall_ns {};
+            std::vector<int64_t> instructions {};
+            long peak_rss_kb = 0;
+            int failures = 0;
+            Sample sample;
+            // Warm up the page cache
+            run(programs[p_idx], scenarios[s_idx], sample);
+            for (int run_idx = 0; run_idx < runs; run_idx++) {
+                if (!run(programs[p_idx], scenarios[s_idx], sample)) {
+                    failures++;
+                }
+                wall_ns.push_back(sample.wall_ns);
+                if (sample.instructions >= 0) {
+                    instructions.push_back(sample.instructions);
+                }
+                peak_rss_kb = std::max(peak_rss_kb, sample.max_rss_kb);
+            }
+
+            std::cout << (s_idx ? "," : "") << "\n        { \"name\": \""
+                      << scenarios[s_idx].name << "\""
+                      << ", \"p50_us\": " << percentile(wall_ns, 50) / 1000.0
+                      << ", \"p99_us\": " << percentile(wall_ns, 99) / 1000.0;
+            if (instructions.empty()) {
+                std::cout << ", \"p50_instructions\": null, \"p99_instructions\": null";
+            } else {
+                std::cout << ", \"p50_instructions\": " << percentile(instructions, 50)
+                          << ", \"p99_instructions\": " << percentile(instructions, 99);
+            }
+            std::cout << ", \"peak_rss_kb\": " << peak_rss_kb
+                      << ", \"failures\": " << failures << " }";
+            total_failures += failures;
+        }
+        std::cout << "\n      ]\n    }";
+    }
+    std::cout << "\n  ]\n}\n";
+    return total_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
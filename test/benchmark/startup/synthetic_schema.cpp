@@ -0,0 +1,56 @@
+// Program with a generated schema of SCHEMA_SIZE actions and SCHEMA_SIZE
+// flags (half global, half action flags), laid out as
+// examples/example1.cpp; startup_latency execs it to measure the startup
+// latency as a function of the schema size.
+
+#include <horsewhisperer/horsewhisperer.h>
+
+#include <string>
+#include <vector>
+
+#ifndef SCHEMA_SIZE
+#define SCHEMA_SIZE 100
+#endif
+
+namespace HW = HorseWhisperer;
+
+int gallop(const std::vector<std::string>& arguments) {
+    return arguments.empty() || HW::GetFlag<int>("vlevel") > 9 ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    HW::SetHelpBanner("Usage: synthetic-schema [global options] <action> [options]");
+    HW::SetAppName("synthetic-schema");
+    HW::SetVersion("synthetic-schema " + std::to_string(SCHEMA_SIZE) + "\n");
+    HW::SetDelimiters(std::vector<std::string> { "+" });
+
+    for (int idx = 0; idx < SCHEMA_SIZE; idx++) {
+        auto suffix = std::to_string(idx);
+        HW::DefineAction("action-" + suffix, 1, true,
+                         "generated action number " + suffix,
+                         "Generated help of the action number " + suffix,
+                         gallop);
+        if (idx % 2) {
+            HW::DefineGlobalFlag<int>("ponies-" + suffix,
+                                      "generated global flag number " + suffix,
+                                      idx, nullptr);
+        } else {
+            HW::DefineActionFlag<bool>("action-" + suffix, "tired-" + suffix,
+                                       "generated action flag number " + suffix,
+                                       false, nullptr);
+        }
+    }
+
+    switch (HW::Parse(argc, argv)) {
+        case HW::ParseResult::OK:
+            return HW::Start();
+        case HW::ParseResult::HELP:
+            HW::ShowHelp();
+            return EXIT_SUCCESS;
+        case HW::ParseResult::VERSION:
+            HW::ShowVersion();
+            return EXIT_SUCCESS;
+        default:
+            return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,122 @@
+#include <horsewhisperer/horsewhisperer.h>
+#include "../test.h"
+#include "../allocation_counter.h"
+
+namespace HW = HorseWhisperer;
+
+// The counts are measured after a first identical round, so that the
+// containers of the cleared definitions already have the capacity
+// they need; only the allocations of the definitions themselves remain
+
+// Containers of small vectors move them without copying
+static_assert(std::is_nothrow_move_constructible<HW::SmallVector<std::string, 3>>::value
+              && std::is_nothrow_move_assignable<HW::SmallVector<std::string, 3>>::value,
+              "SmallVector moves must be noexcept");
+
+static const int NUM_FLAGS = 16;
+static const int NUM_ACTIONS = 8;
+
+static void defineFlags() {
+    HW::DefineGlobalFlag<std::string>("name", "description of a string flag", "",
+                                      nullptr);
+    HW::DefineGlobalFlag<HW::MultiString>("tag", "description of a multi-value flag", {},
+                                          nullptr);
+    for (int idx = 1; idx < NUM_FLAGS - 1; idx++) {
+        HW::DefineGlobalFlag<int>(std::string { "flag-" } + static_cast<char>('a' + idx),
+                                  "description of a counted global flag", 0, nullptr);
+    }
+}
+
+static void defineActions() {
+    for (int idx = 0; idx < NUM_ACTIONS; idx++) {
+        HW::DefineAction(std::string { "action-" } + static_cast<char>('a' + idx),
+                         1, true, "description of a counted action",
+                         "help of a counted action, long enough to be on the heap",
+                         [](std::vector<std::string>) -> int { return 0; });
+        HW::DefineActionFlag<int>(std::string { "action-" } + static_cast<char>('a' + idx),
+                                  "speed", "description of a counted action flag", 0,
+                                  nullptr);
+    }
+}
+
+static size_t countParse() {
+    // The string value and the arguments don't fit in a std::string
+    const char* args[] = { "test-app", "--flag-b", "3", "--name",
+                           "a value longer than the small string buffer",
+                           "action-a", "--speed", "5", "/path/to/the/first/pony",
+                           "+", "action-b", "--speed=6", "--flag-c=4",
+                           "/path/to/the/second/pony", nullptr };
+    AllocationCounter counter {};
+    auto result = HW::Parse(14, const_cast<char**>(args));
+    auto num_allocations = counter.count();
+    REQUIRE(result == HW::ParseResult::OK);
+    return num_allocations;
+}
+
+static size_t countTypicalParse() {
+    // Few arguments and values, all fitting in a std::string
+    const char* args[] = { "test-app", "--tag", "red", "green", "blue", "action-a",
+                           "--speed", "5", "pony", "+", "action-b", "mare", nullptr };
+    AllocationCounter counter {};
+    auto result = HW::Parse(12, const_cast<char**>(args));
+    auto num_allocations = counter.count();
+    REQUIRE(result == HW::ParseResult::OK);
+    return num_allocations;
+}
+
+TEST_CASE("allocations", "[allocations]") {
+    HW::Reset();
+    HW::SetDelimiters(std::vector<std::string> { "+" });
+    defineFlags();
+    defineActions();
+    countParse();
+    countTypicalParse();
+
+    SECTION("defining a flag allocates its value and its description") {
+        HW::Reset();
+        AllocationCounter counter {};
+        defineFlags();
+        auto num_allocations = counter.count();
+
+        REQUIRE(num_allocations <= 2 * NUM_FLAGS);
+    }
+
+    SECTION("defining an action allocates the action, its map entry and its texts") {
+        HW::Reset();
+        defineFlags();
+        AllocationCounter counter {};
+        defineActions();
+        auto num_allocations = counter.count();
+
+        // The flag also allocates the list of flags of its action
+        REQUIRE(num_allocations <= (4 + 3) * NUM_ACTIONS);
+    }
+
+    SECTION("parsing allocates only the contexts, their flags and the values") {
+        HW::Reset();
+        HW::SetDelimiters(std::vector<std::string> { "+" });
+        defineFlags();
+        defineActions();
+        auto num_allocations = countParse();
+
+        // Each context allocates itself, the copy of the action flag, its
+        // list of arguments and the argument; the global flag stores the
+        // string value
+        REQUIRE(num_allocations <= 2 * 4 + 1);
+    }
+
+    SECTION("parsing a typical command line allocates only the contexts and the lists") {
+        HW::Reset();
+        HW::SetDelimiters(std::vector<std::string> { "+" });
+        defineFlags();
+        defineActions();
+        auto num_allocations = countTypicalParse();
+
+        // Each context allocates itself, the copy of the action flag and
+        // its list of arguments; the values of the multi-value flag are
+        // allocated at once
+        REQUIRE(num_allocations <= 2 * 3 + 1);
+    }
+
+    HW::Reset();
+}
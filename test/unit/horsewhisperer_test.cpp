@@ -1,6 +1,8 @@
 #include <horsewhisperer/horsewhisperer.h>
 #include "../test.h"
 
+#include <set>
+
 namespace HW = HorseWhisperer;
 
 void prepareGlobal() {
@@ -191,6 +193,56 @@ TEST_CASE("GetFlagType", "[type]") {
     }
 }
 
+TEST_CASE("FlagTable", "[flags]") {
+    HW::FlagTable table {};
+    auto makeFlag = [](int value) {
+        std::unique_ptr<HW::Flag<int>> flagp { new HW::Flag<int>() };
+        flagp->value = value;
+        return std::unique_ptr<HW::FlagBase> { std::move(flagp) };
+    };
+
+    SECTION("it finds a flag by any of its aliases") {
+        auto id = table.define(HW::GLOBAL_SCOPE, "f flag", "a flag",
+                               makeFlag(1), false);
+        REQUIRE(table.find(HW::GLOBAL_SCOPE, "f") == id);
+        REQUIRE(table.find(HW::GLOBAL_SCOPE, "flag") == id);
+        REQUIRE(table.find(HW::GLOBAL_SCOPE, "fla") == HW::NO_FLAG);
+        REQUIRE(table.find(HW::GLOBAL_SCOPE, "") == HW::NO_FLAG);
+        REQUIRE(table.aliases(id) == "f flag");
+        REQUIRE(table.description(id) == "a flag");
+        REQUIRE(table.type(id) == HW::FlagType::Int);
+    }
+
+    SECTION("names are resolved per scope") {
+        auto global_id = table.define(HW::GLOBAL_SCOPE, "flag", "", makeFlag(1), false);
+        auto action_id = table.define(1, "flag", "", makeFlag(2), false);
+        REQUIRE(global_id != action_id);
+        REQUIRE(table.find(HW::GLOBAL_SCOPE, "flag") == global_id);
+        REQUIRE(table.find(1, "flag") == action_id);
+        REQUIRE(table.find(2, "flag") == HW::NO_FLAG);
+    }
+
+    SECTION("a redefined alias refers to the last flag") {
+        table.define(HW::GLOBAL_SCOPE, "flag", "", makeFlag(1), false);
+        auto id = table.define(HW::GLOBAL_SCOPE, "flag", "", makeFlag(2), false);
+        REQUIRE(table.find(HW::GLOBAL_SCOPE, "flag") == id);
+        REQUIRE(static_cast<HW::Flag<int>*>(table.value(id))->value == 2);
+    }
+
+    SECTION("it handles many flags") {
+        for (int idx = 0; idx < 5000; idx++) {
+            table.define(idx % 7, "f" + std::to_string(idx) + " flag", "",
+                         makeFlag(idx), false);
+        }
+        REQUIRE(table.size() == 5000u);
+        for (int idx = 0; idx < 5000; idx++) {
+            auto id = table.find(idx % 7, "f" + std::to_string(idx));
+            REQUIRE(id == static_cast<HW::FlagId>(idx));
+        }
+        REQUIRE(table.find(3, "flag") == 4999u - (4999 - 3) % 7);
+    }
+}
+
 int getTest(std::vector<std::string>) {
     SECTION("it returns the default value of a unset flag") {
         // check local flag context
@@ -636,6 +688,91 @@ TEST_CASE("parse", "[parse]") {
     }
 }
 
+TEST_CASE("parse numeric lists", "[parse]") {
+    HW::Reset();
+    prepareGlobal();
+    prepareAction(nullptr);
+    HW::DefineGlobalFlag<HW::IntList>("ids", "some ids", {}, nullptr);
+    HW::DefineGlobalFlag<HW::DoubleList>("thresholds", "some thresholds", { 0.5 },
+                                         nullptr);
+
+    SECTION("it gives the list types") {
+        REQUIRE(HW::GetFlagType("ids") == HW::FlagType::IntList);
+        REQUIRE(HW::GetFlagType("thresholds") == HW::FlagType::DoubleList);
+    }
+
+    SECTION("it parses a comma separated list of integers") {
+        const char* args[] = { "test-app", "test-action", "--ids=1,-2,30", nullptr };
+        REQUIRE(HW::Parse(3, const_cast<char**>(args)) == HW::ParseResult::OK);
+        REQUIRE(HW::GetFlag<HW::IntList>("ids") == HW::IntList({ 1, -2, 30 }));
+    }
+
+    SECTION("it parses long lists of integers") {
+        std::string ids_arg { "--ids=" };
+        HW::IntList expected {};
+        for (int id = -500; id < 500; id++) {
+            ids_arg += std::to_string(id * 7919) + (id < 499 ? "," : "");
+            expected.push_back(id * 7919);
+        }
+        const char* args[] = { "test-app", "test-action", ids_arg.c_str(), nullptr };
+        REQUIRE(HW::Parse(3, const_cast<char**>(args)) == HW::ParseResult::OK);
+        REQUIRE(HW::GetFlag<HW::IntList>("ids") == expected);
+    }
+
+    SECTION("it parses space and comma separated values") {
+        const char* args[] = { "test-app", "test-action", "--thresholds",
+                               "1.5,-2e3", "0.25", "--global-get", nullptr };
+        REQUIRE(HW::Parse(6, const_cast<char**>(args)) == HW::ParseResult::OK);
+        REQUIRE(HW::GetFlag<HW::DoubleList>("thresholds")
+                == HW::DoubleList({ 1.5, -2000.0, 0.25 }));
+        REQUIRE(HW::GetFlag<bool>("global-get"));
+    }
+
+    SECTION("it fails on invalid values") {
+        std::string value {};
+
+        SECTION("non digits") {
+            value = "--ids=1,2,three";
+        }
+
+        SECTION("empty fields") {
+            value = "--ids=1,,2";
+        }
+
+        SECTION("trailing separator") {
+            value = "--ids=1,2,";
+        }
+
+        SECTION("integer overflow") {
+            value = "--ids=1,2147483648";
+        }
+
+        SECTION("non digits in a long list") {
+            value = "--ids=1,2,3,4,5,6,7,8,9,10,11,12,1x";
+        }
+
+        const char* args[] = { "test-app", "test-action", value.c_str(), nullptr };
+        REQUIRE(HW::Parse(3, const_cast<char**>(args)) == HW::ParseResult::INVALID_FLAG);
+    }
+
+    SECTION("it fails when no value is given") {
+        const char* args[] = { "test-app", "test-action", "--ids", nullptr };
+        REQUIRE(HW::Parse(3, const_cast<char**>(args)) == HW::ParseResult::FAILURE);
+    }
+
+    SECTION("it validates the whole list at once") {
+        size_t validated_size { 0 };
+        HW::DefineGlobalFlag<HW::IntList>("ports", "some ports", {},
+                                          [&validated_size](HW::IntList& ports) {
+                                              validated_size = ports.size();
+                                          });
+        const char* args[] = { "test-app", "test-action", "--ports", "80,443",
+                               "8080", nullptr };
+        REQUIRE(HW::Parse(5, const_cast<char**>(args)) == HW::ParseResult::OK);
+        REQUIRE(validated_size == 3);
+    }
+}
+
 auto action_callback = [](std::vector<std::string>) -> int { return 0; };
 
 TEST_CASE("HorseWhisperer::getActions" "[getActions]") {
@@ -799,3 +936,1409 @@ TEST_CASE("HorseWhisperer::Start", "[start]") {
         REQUIRE(call_counter == 3);
     }
 }
+
+TEST_CASE("HORSEWHISPERER_LOG", "[log]") {
+    HW::Reset();
+    prepareGlobal();
+    std::ostringstream log_stream {};
+    HW::SetLogStream(&log_stream);
+
+    SECTION("it does not log when verbose output is not set") {
+        HORSEWHISPERER_LOG(1) << "hidden";
+        HW::FlushLog();
+        REQUIRE(log_stream.str().empty());
+    }
+
+    SECTION("it logs the messages enabled by the vlevel flag") {
+        const char* args[] = { "test-app", "-vv", nullptr };
+        HW::Parse(2, const_cast<char**>(args));
+        HORSEWHISPERER_LOG(1) << "level " << 1;
+        HORSEWHISPERER_LOG(2) << "level " << 2;
+        HORSEWHISPERER_LOG(3) << "level " << 3;
+        HW::FlushLog();
+        REQUIRE(log_stream.str() == "level 1\nlevel 2\n");
+    }
+
+    SECTION("it does not evaluate the message of a disabled level") {
+        int evaluations = 0;
+        HW::SetFlag<int>("vlevel", 1);
+        HORSEWHISPERER_LOG(2) << ++evaluations;
+        REQUIRE(evaluations == 0);
+    }
+
+    SECTION("it collects the messages of multiple threads") {
+        HW::SetFlag<bool>("verbose", true);
+        std::vector<std::thread> threads {};
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([t]() {
+                for (int i = 0; i < 2000; i++) {
+                    HORSEWHISPERER_LOG(1) << "thread " << t << " message " << i;
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        HW::FlushLog();
+        auto log = log_stream.str();
+        REQUIRE(std::count(log.begin(), log.end(), '\n') == 8000);
+        REQUIRE(log.find("thread 3 message 1999\n") != std::string::npos);
+    }
+
+    HW::SetLogStream(&std::cerr);
+}
+
+TEST_CASE("HorseWhisperer::SetActionIdempotent", "[cache]") {
+    char cache_dir_template[] = "/tmp/hw-cache-test-XXXXXX";
+    std::string cache_dir { mkdtemp(cache_dir_template) };
+    int call_counter = 0;
+    int exit_code = 0;
+
+    auto prepare = [&]() {
+        HW::Reset();
+        prepareGlobal();
+        HW::SetActionCacheDirectory(cache_dir);
+        HW::DefineAction("scan", 1, true, "test-action", "no help",
+                         [&](std::vector<std::string> args) -> int {
+                            call_counter++;
+                            std::cout << "scanned " << args[0] << "\n";
+                            return exit_code;
+                         });
+        HW::DefineActionFlag<int>("scan", "depth", "scan depth", 1, nullptr);
+        HW::SetActionIdempotent("scan");
+    };
+
+    auto run = [](std::vector<const char*> args) -> std::pair<int, std::string> {
+        std::ostringstream output {};
+        auto original = std::cout.rdbuf(output.rdbuf());
+        args.push_back(nullptr);
+        HW::Parse(args.size() - 1, const_cast<char**>(args.data()));
+        auto result = HW::Start();
+        std::cout.rdbuf(original);
+        return { result, output.str() };
+    };
+
+    SECTION("it replays the outcome of an identical invocation") {
+        prepare();
+        auto first = run({ "test-app", "scan", "host1", "scan", "host1" });
+
+        REQUIRE(call_counter == 1);
+        REQUIRE(first.first == 0);
+        REQUIRE(first.second == "scanned host1\nscanned host1\n");
+        REQUIRE(HW::GetActionCacheStats().hits == 1);
+        REQUIRE(HW::GetActionCacheStats().misses == 1);
+        REQUIRE(HW::GetActionCacheStats().stores == 1);
+    }
+
+    SECTION("it replays the outcome across invocations") {
+        prepare();
+        REQUIRE(run({ "test-app", "scan", "host1" }).first == 0);
+        prepare();
+        auto second = run({ "test-app", "scan", "host1" });
+
+        REQUIRE(call_counter == 1);
+        REQUIRE(second.first == 0);
+        REQUIRE(second.second == "scanned host1\n");
+    }
+
+    SECTION("it doesn't cache failures") {
+        exit_code = 3;
+        prepare();
+        REQUIRE(run({ "test-app", "scan", "host1" }).first == 3);
+        prepare();
+        REQUIRE(run({ "test-app", "scan", "host1" }).first == 3);
+
+        REQUIRE(call_counter == 2);
+        REQUIRE(HW::GetActionCacheStats().stores == 0);
+    }
+
+    SECTION("it doesn't use a directory accessible by others") {
+        chmod(cache_dir.c_str(), 0755);
+        prepare();
+        run({ "test-app", "scan", "host1", "scan", "host1" });
+
+        REQUIRE(call_counter == 2);
+        REQUIRE(HW::GetActionCacheStats().stores == 0);
+    }
+
+    SECTION("it doesn't follow a symlink to the directory") {
+        auto link_path = cache_dir + ".link";
+        REQUIRE(symlink(cache_dir.c_str(), link_path.c_str()) == 0);
+        prepare();
+        HW::SetActionCacheDirectory(link_path);
+        run({ "test-app", "scan", "host1", "scan", "host1" });
+        unlink(link_path.c_str());
+
+        REQUIRE(call_counter == 2);
+        REQUIRE(HW::GetActionCacheStats().stores == 0);
+    }
+
+    SECTION("it runs the action when arguments or flags differ") {
+        prepare();
+        run({ "test-app", "scan", "host1", "scan", "host2",
+              "scan", "host1", "--depth", "2" });
+        prepare();
+        run({ "test-app", "scan", "host1", "--global-get" });
+
+        REQUIRE(call_counter == 4);
+        REQUIRE(HW::GetActionCacheStats().hits == 0);
+    }
+
+    SECTION("it evicts the outcomes exceeding the size limit") {
+        prepare();
+        HW::SetActionCacheSizeLimit(1);
+        run({ "test-app", "scan", "host1", "scan", "host1" });
+
+        REQUIRE(call_counter == 2);
+        REQUIRE(HW::GetActionCacheStats().evictions == 2);
+    }
+
+    std::system(("rm -rf " + cache_dir).c_str());
+}
+
+TEST_CASE("HorseWhisperer::SetConcurrentValidation", "[validation]") {
+    HW::Reset();
+    prepareGlobal();
+    HW::SetConcurrentValidation(true, 8);
+
+    auto slow_flag_validator = [](int& value) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (value < 0) {
+            throw HW::flag_validation_error { "negative " + std::to_string(value) };
+        }
+        value *= 2;
+    };
+    HW::DefineGlobalFlag<int>("size", "a slow flag", 0, slow_flag_validator);
+    HW::DefineAction("check", 1, true, "test-action", "no help", action_callback,
+                     [](const HW::Arguments& args) {
+                        // Later arguments fail faster
+                        std::this_thread::sleep_for(
+                            std::chrono::milliseconds(200 - 20 * args[0].size()));
+                        if (args[0].find("bad") != std::string::npos) {
+                            throw HW::action_validation_error { args[0] };
+                        }
+                     });
+
+    SECTION("it runs the validation callbacks concurrently") {
+        const char* args[] = { "test-app", "--size", "4",
+                               "check", "a", "check", "bb", "check", "ccc",
+                               "check", "dddd", "check", "eeeee", nullptr };
+        auto start = std::chrono::steady_clock::now();
+        REQUIRE(HW::Parse(13, const_cast<char**>(args)) == HW::ParseResult::OK);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+
+        REQUIRE(elapsed < std::chrono::milliseconds(500));
+        REQUIRE(HW::GetFlag<int>("size") == 8);
+    }
+
+    SECTION("it reports the first failure in command line order") {
+        const char* args[] = { "test-app", "check", "a", "check", "bad",
+                               "check", "also-bad", "--size", "-1", nullptr };
+        try {
+            HW::Parse(9, const_cast<char**>(args));
+            FAIL("no validation error");
+        } catch (HW::action_validation_error& e) {
+            REQUIRE(std::string { e.what() } == "bad");
+        }
+    }
+
+    SECTION("it reports flag failures in command line order") {
+        const char* args[] = { "test-app", "--size", "-1", "check", "bad",
+                               "--size", "-2", nullptr };
+        try {
+            HW::Parse(7, const_cast<char**>(args));
+            FAIL("no validation error");
+        } catch (HW::flag_validation_error& e) {
+            REQUIRE(std::string { e.what() } == "negative -1");
+        }
+    }
+
+    SECTION("it doesn't store a rejected value") {
+        const char* args[] = { "test-app", "--size", "-1", "check", "a", nullptr };
+        REQUIRE_THROWS_AS(HW::Parse(5, const_cast<char**>(args)),
+                          HW::flag_validation_error);
+        REQUIRE(HW::GetFlag<int>("size") == 0);
+    }
+
+    SECTION("it validates the built-in flags while tokenizing") {
+        const char* args[] = { "test-app", "--verbose", "check", "a", nullptr };
+        REQUIRE(HW::Parse(4, const_cast<char**>(args)) == HW::ParseResult::OK);
+        REQUIRE(HW::GetFlag<int>("vlevel") == 1);
+        HW::SetFlag<int>("vlevel", 0);
+    }
+}
+
+TEST_CASE("HorseWhisperer::SetActionDeadline", "[cancel]") {
+    HW::Reset();
+    prepareGlobal();
+    std::vector<std::string> delim { "+" };
+    HW::SetDelimiters(delim);
+
+    int num_completed = 0;
+    auto waiting_action = [&num_completed](std::vector<std::string>) -> int {
+        auto token = HW::GetCancellationToken();
+        if (token.waitFor(std::chrono::seconds(10))) {
+            return EXIT_SUCCESS;
+        }
+        num_completed++;
+        return EXIT_SUCCESS;
+    };
+    HW::DefineAction("wait", 0, true, "test-action", "no help", waiting_action);
+    HW::DefineAction("quick", 0, true, "test-action", "no help",
+                     [&num_completed](std::vector<std::string>) -> int {
+                        REQUIRE_FALSE(HW::GetCancellationToken().isCancelled());
+                        num_completed++;
+                        return EXIT_SUCCESS;
+                     });
+
+    SECTION("it cancels an action that exceeds its deadline") {
+        HW::SetActionDeadline("wait", std::chrono::milliseconds(50));
+        const char* args[] = { "test-app", "wait", "+", "quick", nullptr };
+        HW::Parse(4, const_cast<char**>(args));
+
+        auto start = std::chrono::steady_clock::now();
+        REQUIRE(HW::Start() == HW::ACTION_TIMEOUT_EXIT_CODE);
+        REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+        REQUIRE(HW::GetCancellationToken().reason() == HW::CancellationReason::Timeout);
+        REQUIRE(num_completed == 0);
+    }
+
+    SECTION("it applies the --timeout flag to every action") {
+        const char* args[] = { "test-app", "quick", "+", "wait", "--timeout", "0.05",
+                               nullptr };
+        HW::Parse(6, const_cast<char**>(args));
+
+        REQUIRE(HW::Start() == HW::ACTION_TIMEOUT_EXIT_CODE);
+        REQUIRE(num_completed == 1);
+    }
+
+    SECTION("it rejects a negative --timeout") {
+        const char* args[] = { "test-app", "quick", "--timeout", "-1", nullptr };
+        REQUIRE_THROWS_AS(HW::Parse(4, const_cast<char**>(args)),
+                          HW::flag_validation_error);
+    }
+
+    SECTION("it does not cancel actions that complete in time") {
+        HW::SetActionDeadline("quick", std::chrono::milliseconds(5000));
+        const char* args[] = { "test-app", "quick", "+", "quick", nullptr };
+        HW::Parse(4, const_cast<char**>(args));
+
+        REQUIRE(HW::Start() == EXIT_SUCCESS);
+        REQUIRE(num_completed == 2);
+    }
+
+    SECTION("a signal cancels the running action and skips the chain") {
+        HW::DefineAction("interrupted", 0, true, "test-action", "no help",
+                         [](std::vector<std::string>) -> int {
+                            std::raise(SIGINT);
+                            HW::GetCancellationToken().wait();
+                            return EXIT_SUCCESS;
+                         });
+        const char* args[] = { "test-app", "interrupted", "+", "quick", nullptr };
+        HW::Parse(4, const_cast<char**>(args));
+
+        REQUIRE(HW::Start() == 128 + SIGINT);
+        REQUIRE(HW::GetCancellationToken().reason() == HW::CancellationReason::Signal);
+        REQUIRE(num_completed == 0);
+    }
+
+    SECTION("it restores the previous signal disposition") {
+        struct sigaction previous, restored;
+        std::memset(&previous, 0, sizeof(previous));
+        previous.sa_handler = SIG_IGN;
+        previous.sa_flags = SA_RESTART;
+        sigemptyset(&previous.sa_mask);
+        sigaddset(&previous.sa_mask, SIGUSR1);
+        struct sigaction original;
+        sigaction(SIGTERM, &previous, &original);
+
+        const char* args[] = { "test-app", "quick", "+", "quick", nullptr };
+        HW::Parse(4, const_cast<char**>(args));
+        REQUIRE(HW::Start() == EXIT_SUCCESS);
+
+        sigaction(SIGTERM, &original, &restored);
+        REQUIRE(restored.sa_handler == SIG_IGN);
+        REQUIRE((restored.sa_flags & SA_RESTART) != 0);
+        REQUIRE(sigismember(&restored.sa_mask, SIGUSR1) == 1);
+    }
+}
+
+TEST_CASE("HorseWhisperer::SetTraceFile", "[trace]") {
+    char trace_dir_template[] = "/tmp/hw-trace-test-XXXXXX";
+    std::string trace_file { std::string { mkdtemp(trace_dir_template) } + "/trace.json" };
+
+    HW::Reset();
+    prepareGlobal();
+    HW::DefineGlobalFlag<int>("size", "a validated flag", 0, [](int&) {});
+    HW::DefineAction("traced", 0, true, "test-action", "no help",
+                     [](std::vector<std::string>) -> int {
+                        HW::TraceScope scope { "inner-span" };
+                        return EXIT_SUCCESS;
+                     });
+
+    auto readTrace = [&trace_file]() {
+        std::ifstream file { trace_file };
+        std::stringstream content {};
+        content << file.rdbuf();
+        return content.str();
+    };
+
+    SECTION("it writes a trace covering parsing and actions") {
+        const char* args[] = { "test-app", "--trace-file", trace_file.c_str(),
+                               "--size", "3", "traced", nullptr };
+        REQUIRE(HW::Parse(6, const_cast<char**>(args)) == HW::ParseResult::OK);
+        REQUIRE(HW::Start() == EXIT_SUCCESS);
+
+        auto trace = readTrace();
+        REQUIRE(trace.find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[") == 0);
+        REQUIRE(trace.substr(trace.size() - 3) == "]}\n");
+        REQUIRE(trace.find("\"name\":\"definition\",\"cat\":\"definition\"")
+                != std::string::npos);
+        REQUIRE(trace.find("\"name\":\"tokenize\",\"cat\":\"parse\"") != std::string::npos);
+        REQUIRE(trace.find("\"name\":\"size\",\"cat\":\"flag\"") != std::string::npos);
+        REQUIRE(trace.find("\"name\":\"validateActionArguments\"") != std::string::npos);
+        REQUIRE(trace.find("\"name\":\"traced\",\"cat\":\"action\"") != std::string::npos);
+        REQUIRE(trace.find("\"name\":\"inner-span\",\"cat\":\"app\"") != std::string::npos);
+    }
+
+    SECTION("it can be enabled through the API") {
+        HW::SetTraceFile(trace_file);
+        const char* args[] = { "test-app", "traced", nullptr };
+        HW::Parse(2, const_cast<char**>(args));
+        HW::Start();
+
+        REQUIRE(readTrace().find("inner-span") != std::string::npos);
+    }
+
+    SECTION("nothing is written when tracing is disabled") {
+        const char* args[] = { "test-app", "traced", nullptr };
+        HW::Parse(2, const_cast<char**>(args));
+        HW::Start();
+
+        REQUIRE_FALSE(std::ifstream { trace_file }.good());
+    }
+
+    HW::Reset();
+    std::remove(trace_file.c_str());
+    rmdir(trace_file.substr(0, trace_file.rfind('/')).c_str());
+}
+
+TEST_CASE("HorseWhisperer::ParallelFor", "[executor]") {
+    HW::Reset();
+    prepareGlobal();
+    std::vector<std::string> delim { "+" };
+    HW::SetDelimiters(delim);
+
+    std::vector<std::atomic<int>> visits(1000);
+    std::set<std::thread::id> worker_ids {};
+    std::mutex worker_ids_mutex {};
+
+    HW::DefineAction("process", 0, true, "test-action", "no help",
+                     [&](std::vector<std::string>) -> int {
+                        HW::ParallelFor(0, visits.size(), [&](size_t idx) {
+                            // Nested loops run on the same workers
+                            HW::ParallelFor(0, 2, [&](size_t) { visits[idx]++; });
+                            std::lock_guard<std::mutex> lock { worker_ids_mutex };
+                            worker_ids.insert(std::this_thread::get_id());
+                        });
+                        return EXIT_SUCCESS;
+                     });
+
+    SECTION("it runs every index of chained actions on --jobs workers") {
+        const char* args[] = { "test-app", "process", "+", "process", "-j", "3",
+                               nullptr };
+        HW::Parse(6, const_cast<char**>(args));
+
+        REQUIRE(HW::Start() == EXIT_SUCCESS);
+        for (auto& count : visits) {
+            REQUIRE(count.load() == 4);
+        }
+        // The workers and the thread running the actions
+        REQUIRE(worker_ids.size() <= 4);
+        REQUIRE(HW::GetFlag<int>("jobs") == 3);
+    }
+
+    SECTION("it rethrows the exception of a failing index") {
+        REQUIRE_THROWS_AS(HW::ParallelFor(0, 100, [](size_t idx) {
+                              if (idx == 42) {
+                                  throw std::runtime_error { "failed" };
+                              }
+                          }),
+                          std::runtime_error);
+    }
+
+    SECTION("Submit returns the result of the task") {
+        auto answer = HW::Submit([]() { return 42; });
+        auto failure = HW::Submit([]() -> int { throw std::runtime_error { "failed" }; });
+
+        REQUIRE(answer.get() == 42);
+        REQUIRE_THROWS_AS(failure.get(), std::runtime_error);
+    }
+
+    SECTION("it rejects a negative --jobs") {
+        const char* args[] = { "test-app", "process", "--jobs", "-1", nullptr };
+        REQUIRE_THROWS_AS(HW::Parse(4, const_cast<char**>(args)),
+                          HW::flag_validation_error);
+    }
+
+    SECTION("shutdown runs the queued tasks") {
+        HW::Executor executor {};
+        executor.setNumThreads(2);
+        std::atomic<int> num_completed { 0 };
+        for (int idx = 0; idx < 50; idx++) {
+            executor.submit([&num_completed]() { num_completed++; });
+        }
+        executor.shutdown();
+
+        REQUIRE(num_completed.load() == 50);
+    }
+
+    HW::Reset();
+}
+
+TEST_CASE("HorseWhisperer::DefineActionGroup", "[groups]") {
+    HW::Reset();
+    prepareGlobal();
+    std::vector<std::string> delim { "+" };
+    HW::SetDelimiters(delim);
+
+    std::vector<std::string> listed {};
+    HW::DefineActionGroup("node", "manage nodes", "node help\n");
+    HW::DefineActionFlag<std::string>("node", "cluster", "cluster name",
+                                      "default", nullptr);
+    HW::DefineAction("node list", 1, true, "list nodes", "node list help\n",
+                     [&](std::vector<std::string> args) -> int {
+                        listed.push_back(HW::GetFlag<std::string>("cluster")
+                                         + ":" + args[0]);
+                        return EXIT_SUCCESS;
+                     });
+    HW::DefineActionFlag<bool>("node list", "long", "long listing", false, nullptr);
+    HW::DefineAction("node pool drain", 0, false, "drain a pool", "no help", nullptr);
+    HW::DefineAction("status", 0, true, "show status", "no help", nullptr);
+
+    auto capture = [](std::vector<const char*> args) -> std::pair<HW::ParseResult, std::string> {
+        std::ostringstream output {};
+        auto original = std::cout.rdbuf(output.rdbuf());
+        args.push_back(nullptr);
+        auto result = HW::Parse(args.size() - 1, const_cast<char**>(args.data()));
+        if (result == HW::ParseResult::HELP) {
+            HW::ShowHelp();
+        }
+        std::cout.rdbuf(original);
+        return { result, output.str() };
+    };
+
+    SECTION("it dispatches the action of a path") {
+        auto result = capture({ "test-app", "node", "list", "eu", "--cluster", "prod",
+                                "+", "node", "list", "us" });
+
+        REQUIRE(result.first == HW::ParseResult::OK);
+        REQUIRE(HW::GetParsedActions()
+                == (std::vector<std::string> { "node list", "node list" }));
+        REQUIRE(HW::Start() == EXIT_SUCCESS);
+        REQUIRE(listed == (std::vector<std::string> { "prod:eu", "default:us" }));
+    }
+
+    SECTION("the flags of a group are flags of its actions") {
+        REQUIRE(HW::IsActionFlag("node list", "cluster"));
+        REQUIRE(HW::IsActionFlag("node list", "long"));
+        REQUIRE_FALSE(HW::IsActionFlag("node", "long"));
+        REQUIRE_FALSE(HW::IsActionFlag("status", "cluster"));
+    }
+
+    SECTION("intermediate groups are defined by their actions") {
+        auto result = capture({ "test-app", "node", "pool", "drain" });
+
+        REQUIRE(result.first == HW::ParseResult::OK);
+        REQUIRE(HW::GetParsedActions()
+                == (std::vector<std::string> { "node pool drain" }));
+    }
+
+    SECTION("it fails when a group is given without an action") {
+        auto result = capture({ "test-app", "node", "--cluster", "prod" });
+
+        REQUIRE(result.first == HW::ParseResult::FAILURE);
+        REQUIRE(result.second.find("Missing action for group 'node'")
+                != std::string::npos);
+    }
+
+    SECTION("the help of a group lists its subtree only") {
+        auto result = capture({ "test-app", "node", "--help" });
+
+        REQUIRE(result.first == HW::ParseResult::HELP);
+        REQUIRE(result.second.find("node help") != std::string::npos);
+        REQUIRE(result.second.find("--cluster") != std::string::npos);
+        REQUIRE(result.second.find("list nodes") != std::string::npos);
+        REQUIRE(result.second.find("node pool") != std::string::npos);
+        REQUIRE(result.second.find("drain a pool") == std::string::npos);
+        REQUIRE(result.second.find("show status") == std::string::npos);
+    }
+
+    SECTION("the help of an action lists the flags of its groups") {
+        auto result = capture({ "test-app", "node", "list", "--help" });
+
+        REQUIRE(result.first == HW::ParseResult::HELP);
+        REQUIRE(result.second.find("node list specific flags") != std::string::npos);
+        REQUIRE(result.second.find("node flags") != std::string::npos);
+        REQUIRE(result.second.find("--cluster") != std::string::npos);
+    }
+
+    SECTION("the global help lists the top level actions in order") {
+        auto result = capture({ "test-app", "--help" });
+        auto node_position = result.second.find("manage nodes");
+        auto status_position = result.second.find("show status");
+
+        REQUIRE(node_position != std::string::npos);
+        REQUIRE(status_position != std::string::npos);
+        REQUIRE(node_position < status_position);
+        REQUIRE(result.second.find("list nodes") == std::string::npos);
+    }
+
+    HW::Reset();
+}
+
+TEST_CASE("HorseWhisperer::LoadSchema", "[schema]") {
+    char schema_dir_template[] = "/tmp/hw-schema-test-XXXXXX";
+    std::string schema_file { std::string { mkdtemp(schema_dir_template) } + "/app.hwschema" };
+
+    std::vector<std::string> listed {};
+    auto define = [&]() {
+        prepareGlobal();
+        HW::DefineGlobalFlag<std::string>("c cluster", "cluster name", "default", nullptr);
+        HW::DefineActionGroup("node", "manage nodes", "node help\n");
+        HW::DefineActionFlag<bool>("node", "long", "long listing", false, nullptr);
+        HW::DefineAction("node list", 1, false, "list nodes", "no help",
+                         [&](std::vector<std::string> args) -> int {
+                            listed.push_back(HW::GetFlag<std::string>("cluster") + ":"
+                                             + args[0]
+                                             + (HW::GetFlag<bool>("long") ? ":long" : ""));
+                            return EXIT_SUCCESS;
+                         });
+        HW::DefineActionFlag<int>("node list", "depth", "listing depth", 1,
+                                  [](int& depth) {
+                                      if (depth < 0) {
+                                          throw HW::flag_validation_error { "negative" };
+                                      }
+                                  });
+    };
+
+    auto run = [](std::vector<const char*> args) -> int {
+        args.push_back(nullptr);
+        if (HW::Parse(args.size() - 1, const_cast<char**>(args.data()))
+                != HW::ParseResult::OK) {
+            return -1;
+        }
+        return HW::Start();
+    };
+
+    HW::Reset();
+    define();
+    auto checksum = HW::SaveSchema(schema_file);
+
+    SECTION("the definitions are bound to the image") {
+        REQUIRE(HW::LoadSchema(schema_file, checksum));
+        define();
+
+        REQUIRE(run({ "test-app", "node", "list", "a", "--long", "-c", "prod",
+                      "--depth", "2" }) == EXIT_SUCCESS);
+        REQUIRE(listed == std::vector<std::string> { "prod:a:long" });
+        REQUIRE(HW::GetFlag<int>("depth") == 2);
+        REQUIRE(HW::IsActionFlag("node list", "long"));
+        REQUIRE_THROWS_AS(run({ "test-app", "node", "list", "a", "--depth", "-1" }),
+                          HW::flag_validation_error);
+    }
+
+    SECTION("the image of bound definitions is identical") {
+        REQUIRE(HW::LoadSchema(schema_file, checksum));
+        define();
+
+        REQUIRE(HW::SaveSchema(schema_file + ".copy") == checksum);
+        std::remove((schema_file + ".copy").c_str());
+    }
+
+    SECTION("an image with another checksum is rejected") {
+        REQUIRE_FALSE(HW::LoadSchema(schema_file, checksum + 1));
+        REQUIRE_FALSE(HW::LoadSchema(schema_file + ".missing", 0));
+        define();
+
+        REQUIRE(run({ "test-app", "node", "list", "b" }) == EXIT_SUCCESS);
+        REQUIRE(listed == std::vector<std::string> { "default:b" });
+    }
+
+    SECTION("a corrupted image is rejected") {
+        std::fstream file { schema_file, std::ios::in | std::ios::out | std::ios::binary };
+        file.seekp(-1, std::ios::end);
+        file.put('\x7f');
+        file.close();
+
+        REQUIRE_FALSE(HW::LoadSchema(schema_file, 0));
+    }
+
+    SECTION("definitions that differ from the image are made at runtime") {
+        REQUIRE(HW::LoadSchema(schema_file, checksum));
+        prepareGlobal();
+        HW::DefineGlobalFlag<int>("retries", "not in the image", 3, nullptr);
+        HW::DefineAction("status", 0, false, "not in the image", "no help",
+                         [](std::vector<std::string>) -> int { return 7; });
+        HW::DefineActionFlag<bool>("status", "quick", "not in the image", false, nullptr);
+        define();
+
+        REQUIRE(run({ "test-app", "node", "list", "c", "--long", "--retries", "4" })
+                == EXIT_SUCCESS);
+        REQUIRE(listed == std::vector<std::string> { "default:c:long" });
+        REQUIRE(HW::GetFlag<int>("retries") == 4);
+        REQUIRE(HW::IsActionFlag("status", "quick"));
+    }
+
+    HW::Reset();
+    std::remove(schema_file.c_str());
+    rmdir(schema_file.substr(0, schema_file.rfind('/')).c_str());
+}
+
+struct RenameOptions {
+    std::string suffix;
+    int count;
+    HW::IntList ids;
+};
+
+TEST_CASE("HorseWhisperer bound flags", "[binding]") {
+    HW::Reset();
+    prepareGlobal();
+    std::vector<std::string> delim { "+" };
+    HW::SetDelimiters(delim);
+
+    int level { -1 };
+    bool dry_run { true };
+    HW::DefineGlobalFlag<int>("level", "a bound flag", &level, 3);
+    HW::DefineGlobalFlag<bool>("dry-run", "a bound flag", &dry_run, false,
+                               [](bool&) {});
+
+    std::vector<std::string> renamed {};
+    HW::DefineAction<RenameOptions>("rename", 1, true, "rename", "no help",
+        [&](const std::vector<std::string>& args, const RenameOptions& options) -> int {
+            renamed.push_back(args[0] + options.suffix + ":"
+                              + std::to_string(options.count) + ":"
+                              + std::to_string(options.ids.size()));
+            return EXIT_SUCCESS;
+        });
+    HW::DefineActionFlag<std::string>("rename", "suffix", "a member flag",
+                                      &RenameOptions::suffix, ".bak");
+    HW::DefineActionFlag<int>("rename", "count", "a member flag",
+                              &RenameOptions::count, 1,
+                              [](int& value) {
+                                  if (value < 0) {
+                                      throw HW::flag_validation_error { "negative" };
+                                  }
+                              });
+    HW::DefineActionFlag<HW::IntList>("rename", "ids", "a member flag",
+                                  &RenameOptions::ids, HW::IntList {});
+
+    auto parse = [](std::vector<const char*> args) {
+        args.push_back(nullptr);
+        return HW::Parse(args.size() - 1, const_cast<char**>(args.data()));
+    };
+
+    SECTION("bound variables hold the default values") {
+        REQUIRE(level == 3);
+        REQUIRE_FALSE(dry_run);
+    }
+
+    SECTION("parse writes the values of global flags to their variables") {
+        REQUIRE(parse({ "test-app", "--level", "7", "--dry-run",
+                        "rename", "a" }) == HW::ParseResult::OK);
+        REQUIRE(level == 7);
+        REQUIRE(dry_run);
+        REQUIRE(HW::GetFlag<int>("level") == 7);
+
+        HW::SetFlag<int>("level", 9);
+        REQUIRE(level == 9);
+    }
+
+    SECTION("each context hands its own options to the action") {
+        REQUIRE(parse({ "test-app", "rename", "a", "--suffix", ".old", "--count", "2",
+                        "+", "rename", "b", "--ids", "1,2,3" }) == HW::ParseResult::OK);
+        REQUIRE(HW::Start() == EXIT_SUCCESS);
+        REQUIRE(renamed == (std::vector<std::string> { "a.old:2:0", "b.bak:1:3" }));
+    }
+
+    SECTION("invalid values are not written") {
+        REQUIRE_THROWS_AS(parse({ "test-app", "rename", "a", "--count", "-1" }),
+                          HW::flag_validation_error);
+    }
+}
+
+struct CopyOptions {
+    int port;
+    HW::DoubleList weights;
+    HW::MultiString files;
+};
+
+TEST_CASE("HorseWhisperer::DefineActionArgument", "[arguments]") {
+    HW::Reset();
+    prepareGlobal();
+    std::vector<std::string> delim { "+" };
+    HW::SetDelimiters(delim);
+
+    std::vector<std::string> copied {};
+    HW::DefineAction<CopyOptions>("copy", 2, true, "copy", "copy help\n",
+        [&](const std::vector<std::string>&, const CopyOptions& options) -> int {
+            copied.push_back(std::to_string(options.port) + ":"
+                             + std::to_string(options.weights.size()) + ":"
+                             + std::to_string(options.files.size()));
+            return EXIT_SUCCESS;
+        }, nullptr, true);
+    HW::DefineActionArgument<int>("copy", "port", "destination port",
+                                  &CopyOptions::port, 0,
+                                  [](int& port) {
+                                      if (port <= 0 || port > 65535) {
+                                          throw HW::flag_validation_error { "out of range" };
+                                      }
+                                  });
+    HW::DefineActionArgument<HW::DoubleList>("copy", "weights", "weights",
+                                             &CopyOptions::weights, HW::DoubleList {});
+    HW::DefineActionArgument<HW::MultiString>("copy", "files", "files to copy",
+                                              &CopyOptions::files, HW::MultiString {});
+
+    bool verbose { false };
+    HW::DefineAction("toggle", 1, true, "toggle", "no help",
+                     [](const std::vector<std::string>&) -> int { return EXIT_SUCCESS; });
+    HW::DefineActionArgument<bool>("toggle", "on", "whether to toggle", &verbose, false);
+
+    auto capture = [](std::vector<const char*> args) -> std::pair<HW::ParseResult, std::string> {
+        std::ostringstream output {};
+        auto original = std::cout.rdbuf(output.rdbuf());
+        args.push_back(nullptr);
+        auto result = HW::Parse(args.size() - 1, const_cast<char**>(args.data()));
+        if (result == HW::ParseResult::HELP) {
+            HW::ShowHelp();
+        }
+        std::cout.rdbuf(original);
+        return { result, output.str() };
+    };
+
+    SECTION("it converts the arguments of each context once") {
+        auto result = capture({ "test-app", "copy", "8080", "0.5,1.5", "a", "b",
+                                "+", "copy", "22", "1" });
+
+        REQUIRE(result.first == HW::ParseResult::OK);
+        REQUIRE(HW::Start() == EXIT_SUCCESS);
+        REQUIRE(copied == (std::vector<std::string> { "8080:2:2", "22:1:0" }));
+    }
+
+    SECTION("it writes the arguments to bound variables") {
+        REQUIRE(capture({ "test-app", "toggle", "true" }).first == HW::ParseResult::OK);
+        REQUIRE(verbose);
+    }
+
+    SECTION("it reports the position of an argument of the wrong type") {
+        auto result = capture({ "test-app", "copy", "80", "x" });
+
+        REQUIRE(result.first == HW::ParseResult::FAILURE);
+        REQUIRE(result.second.find("argument 2 ('weights') of action 'copy' expects "
+                                   "a list of doubles, got 'x'") != std::string::npos);
+    }
+
+    for (std::string port : { "", "99999999999999999999", "4294967297", "80x" }) {
+        SECTION("it rejects the integer '" + port + "'") {
+            auto result = capture({ "test-app", "copy", port.c_str(), "1" });
+
+            REQUIRE(result.first == HW::ParseResult::FAILURE);
+            REQUIRE(result.second.find("argument 1 ('port') of action 'copy' expects "
+                                       "a value of type integer, got '" + port + "'")
+                    != std::string::npos);
+        }
+    }
+
+    SECTION("it throws when an argument fails its validation") {
+        std::vector<const char*> args { "test-app", "copy", "70000", "1", nullptr };
+        REQUIRE_THROWS_AS(HW::Parse(args.size() - 1, const_cast<char**>(args.data())),
+                          HW::action_validation_error);
+    }
+
+    SECTION("the action help lists the arguments") {
+        auto result = capture({ "test-app", "copy", "--help" });
+
+        REQUIRE(result.first == HW::ParseResult::HELP);
+        REQUIRE(result.second.find("copy arguments:") != std::string::npos);
+        REQUIRE(result.second.find("port <int>") != std::string::npos);
+        REQUIRE(result.second.find("destination port") != std::string::npos);
+    }
+}
+
+TEST_CASE("HorseWhisperer::DefineStreamingAction", "[stream]") {
+    HW::Reset();
+    prepareGlobal();
+    std::vector<std::string> delim { "+" };
+    HW::SetDelimiters(delim);
+
+    char directory_template[] = "/tmp/hw-stream-test-XXXXXX";
+    std::string directory { mkdtemp(directory_template) };
+    auto items_file = directory + "/items";
+    auto input_file = directory + "/input";
+    {
+        std::ofstream items { items_file };
+        for (int idx = 0; idx < 10000; idx++) {
+            items << "item-" << idx << "\n";
+        }
+        items << "\nlast-item";
+    }
+    {
+        std::ofstream input { input_file };
+        input << "from-stdin\r\n";
+    }
+
+    size_t num_items { 0 };
+    std::vector<std::string> seen {};
+    HW::DefineStreamingAction("ingest", 1, true, "ingest items", "no help",
+        [&](HW::ArgumentStream& arguments) -> int {
+            for (const auto& item : arguments) {
+                if (item.compare(0, 5, "item-") == 0) {
+                    num_items++;
+                } else {
+                    seen.push_back(item);
+                }
+            }
+            return EXIT_SUCCESS;
+        });
+
+    auto parse = [](std::vector<const char*> args) {
+        args.push_back(nullptr);
+        return HW::Parse(args.size() - 1, const_cast<char**>(args.data()));
+    };
+
+    SECTION("it reads the arguments from argv and files") {
+        auto file_argument = "@" + items_file;
+        REQUIRE(parse({ "test-app", "ingest", "first", file_argument.c_str(), "after",
+                        "+", "ingest", "again" }) == HW::ParseResult::OK);
+        REQUIRE(HW::Start() == EXIT_SUCCESS);
+        REQUIRE(num_items == 10000);
+        REQUIRE(seen == (std::vector<std::string> { "first", "last-item", "after",
+                                                    "again" }));
+    }
+
+    SECTION("it reads the arguments from stdin") {
+        int saved_stdin = dup(STDIN_FILENO);
+        int input_fd = open(input_file.c_str(), O_RDONLY);
+        dup2(input_fd, STDIN_FILENO);
+        close(input_fd);
+
+        REQUIRE(parse({ "test-app", "ingest", "-", "--global-get" }) == HW::ParseResult::OK);
+        auto exit_code = HW::Start();
+        dup2(saved_stdin, STDIN_FILENO);
+        close(saved_stdin);
+
+        REQUIRE(exit_code == EXIT_SUCCESS);
+        REQUIRE(seen == (std::vector<std::string> { "from-stdin" }));
+    }
+
+    SECTION("it throws when a file can't be read") {
+        auto file_argument = "@" + directory + "/missing";
+        REQUIRE(parse({ "test-app", "ingest", file_argument.c_str() })
+                == HW::ParseResult::OK);
+        REQUIRE_THROWS_AS(HW::Start(), HW::horsewhisperer_error);
+    }
+
+    std::remove(items_file.c_str());
+    std::remove(input_file.c_str());
+    rmdir(directory.c_str());
+}
+
+TEST_CASE("HorseWhisperer journal", "[journal]") {
+    char directory_template[] = "/tmp/hw-journal-test-XXXXXX";
+    std::string directory { mkdtemp(directory_template) };
+    auto journal = directory + "/chain.journal";
+    std::vector<std::string> calls {};
+    std::string failing_step {};
+
+    auto run = [&](std::vector<const char*> args) -> int {
+        HW::Reset();
+        prepareGlobal();
+        HW::DefineAction("step", 1, true, "test-action", "no help",
+                         [&](std::vector<std::string> args) -> int {
+                            calls.push_back(args[0]);
+                            return args[0] == failing_step ? EXIT_FAILURE
+                                                           : EXIT_SUCCESS;
+                         });
+        std::ostringstream output {};
+        auto original = std::cout.rdbuf(output.rdbuf());
+        args.push_back(nullptr);
+        HW::Parse(args.size() - 1, const_cast<char**>(args.data()));
+        auto result = HW::Start();
+        std::cout.rdbuf(original);
+        return result;
+    };
+
+    auto fileSize = [](const std::string& path) -> long {
+        struct stat file_stat;
+        return stat(path.c_str(), &file_stat) == 0 ? file_stat.st_size : -1;
+    };
+
+    SECTION("it resumes a failed chain from the failed action") {
+        failing_step = "b";
+        REQUIRE(run({ "test-app", "step", "a", "step", "b", "step", "c",
+                      "--journal", journal.c_str() }) == EXIT_FAILURE);
+        REQUIRE(calls == (std::vector<std::string> { "a", "b" }));
+
+        calls.clear();
+        failing_step = "";
+        REQUIRE(run({ "test-app", "step", "a", "step", "b", "step", "c",
+                      "--resume", journal.c_str() }) == EXIT_SUCCESS);
+        REQUIRE(calls == (std::vector<std::string> { "b", "c" }));
+
+        calls.clear();
+        REQUIRE(run({ "test-app", "step", "a", "step", "b", "step", "c",
+                      "--resume", journal.c_str() }) == EXIT_SUCCESS);
+        REQUIRE(calls.empty());
+    }
+
+    SECTION("it ignores the flags that don't affect the actions when resuming") {
+        failing_step = "b";
+        REQUIRE(run({ "test-app", "step", "a", "step", "b",
+                      "--journal", journal.c_str() }) == EXIT_FAILURE);
+
+        calls.clear();
+        failing_step = "";
+        REQUIRE(run({ "test-app", "-v", "--timeout", "10", "-j", "2",
+                      "step", "a", "step", "b",
+                      "--resume", journal.c_str() }) == EXIT_SUCCESS);
+        REQUIRE(calls == (std::vector<std::string> { "b" }));
+    }
+
+    SECTION("it runs again the actions with different inputs") {
+        REQUIRE(run({ "test-app", "step", "a", "step", "a",
+                      "--journal", journal.c_str() }) == EXIT_SUCCESS);
+        calls.clear();
+        REQUIRE(run({ "test-app", "step", "a", "step", "a", "step", "a",
+                      "--resume", journal.c_str() }) == EXIT_SUCCESS);
+        REQUIRE(calls.size() == 1);
+
+        calls.clear();
+        REQUIRE(run({ "test-app", "step", "a", "--global-get",
+                      "--resume", journal.c_str() }) == EXIT_SUCCESS);
+        REQUIRE(calls.size() == 1);
+    }
+
+    SECTION("it discards a torn record") {
+        REQUIRE(run({ "test-app", "step", "a", "--journal", journal.c_str() })
+                == EXIT_SUCCESS);
+        auto valid_size = fileSize(journal);
+        {
+            std::ofstream torn { journal, std::ios::binary | std::ios::app };
+            torn << "HWJ1 torn record";
+        }
+
+        calls.clear();
+        REQUIRE(run({ "test-app", "step", "a", "step", "b",
+                      "--resume", journal.c_str() }) == EXIT_SUCCESS);
+        REQUIRE(calls == (std::vector<std::string> { "b" }));
+        REQUIRE(fileSize(journal) > valid_size);
+
+        calls.clear();
+        REQUIRE(run({ "test-app", "step", "a", "step", "b",
+                      "--resume", journal.c_str() }) == EXIT_SUCCESS);
+        REQUIRE(calls.empty());
+    }
+
+    SECTION("it fails when the journal can't be opened") {
+        auto missing = directory + "/missing/chain.journal";
+        REQUIRE(run({ "test-app", "step", "a", "--journal", missing.c_str() })
+                == EXIT_FAILURE);
+        REQUIRE(run({ "test-app", "step", "a", "--journal", journal.c_str(),
+                      "--resume", journal.c_str() }) == EXIT_FAILURE);
+        REQUIRE(calls.empty());
+    }
+
+    std::remove(journal.c_str());
+    rmdir(directory.c_str());
+}
+
+TEST_CASE("HorseWhisperer hardware counters", "[counters]") {
+    HW::Reset();
+    prepareGlobal();
+    HW::DefineAction("step", 1, true, "test-action", "no help",
+                     [](std::vector<std::string> args) -> int {
+                        return args[0] == "fail" ? EXIT_FAILURE : EXIT_SUCCESS;
+                     });
+
+    char counters_template[] = "/tmp/hw-counters-test-XXXXXX";
+    int counters_fd = mkstemp(counters_template);
+    close(counters_fd);
+    std::string counters_file { counters_template };
+
+    auto run = [](std::vector<const char*> args, std::string& table) -> int {
+        std::ostringstream error {};
+        auto original = std::cerr.rdbuf(error.rdbuf());
+        args.push_back(nullptr);
+        HW::Parse(args.size() - 1, const_cast<char**>(args.data()));
+        auto result = HW::Start();
+        std::cerr.rdbuf(original);
+        table = error.str();
+        return result;
+    };
+    std::string table {};
+
+    SECTION("it counts the events of each executed action") {
+        REQUIRE(run({ "test-app", "step", "first", "step", "fail", "step", "skipped",
+                      "--hw-counters", "--hw-counters-file", counters_file.c_str() },
+                    table) == EXIT_FAILURE);
+
+        auto counters = HW::GetActionCounters();
+        REQUIRE(counters.size() == 2);
+        for (auto& action_counters : counters) {
+            REQUIRE(action_counters.action == "step");
+            REQUIRE(action_counters.wall_time_ns > 0);
+            REQUIRE(action_counters.cycles >= -1);
+        }
+
+        REQUIRE(table.find("instructions") != std::string::npos);
+        REQUIRE(std::count(table.begin(), table.end(), '\n') >= 3);
+
+        std::ifstream file { counters_file };
+        std::stringstream json {};
+        json << file.rdbuf();
+        REQUIRE(json.str().find("{\"action\":\"step\",\"wall_time_ns\":")
+                != std::string::npos);
+    }
+
+    SECTION("nothing is counted by default") {
+        REQUIRE(run({ "test-app", "step", "first" }, table) == EXIT_SUCCESS);
+        REQUIRE(HW::GetActionCounters().empty());
+        REQUIRE(table.empty());
+    }
+
+    std::remove(counters_file.c_str());
+}
+
+TEST_CASE("HorseWhisperer::GetActionResources", "[resources]") {
+    HW::Reset();
+    prepareGlobal();
+    char output_template[] = "/tmp/hw-resources-test-XXXXXX";
+    int output_fd = mkstemp(output_template);
+    close(output_fd);
+    std::string output_file { output_template };
+    const size_t data_size { 16 * 1024 * 1024 };
+
+    HW::DefineAction("write", 0, true, "test-action", "no help",
+                     [&](std::vector<std::string>) -> int {
+                        // Fresh pages, so each one faults
+                        std::unique_ptr<char[]> data { new char[data_size] };
+                        std::memset(data.get(), 'x', data_size);
+                        std::ofstream output { output_file, std::ios::binary };
+                        output.write(data.get(), data_size);
+                        return 3;
+                     });
+    HW::DefineAction("noop", 0, true, "test-action", "no help",
+                     [](std::vector<std::string>) -> int { return EXIT_SUCCESS; });
+
+    std::vector<const char*> args { "test-app", "noop", "write", nullptr };
+    REQUIRE(HW::Parse(args.size() - 1, const_cast<char**>(args.data()))
+            == HW::ParseResult::OK);
+    REQUIRE(HW::Start() == 3);
+
+    auto resources = HW::GetActionResources();
+    REQUIRE(resources.size() == 2);
+    REQUIRE(resources[0].action == "noop");
+    REQUIRE(resources[0].exit_code == EXIT_SUCCESS);
+    REQUIRE(resources[1].action == "write");
+    REQUIRE(resources[1].exit_code == 3);
+    REQUIRE(resources[1].user_cpu_us + resources[1].system_cpu_us >= 0);
+    REQUIRE(resources[1].max_rss_growth_kb >= 0);
+    REQUIRE(resources[1].minor_faults > resources[0].minor_faults);
+    if (resources[1].write_chars >= 0) {
+        REQUIRE(resources[1].write_chars >= static_cast<int64_t>(data_size));
+        REQUIRE(resources[0].write_chars == 0);
+    }
+
+    std::remove(output_file.c_str());
+}
+
+TEST_CASE("wordWrap", "[help]") {
+    auto wrap = [](const std::string& txt, unsigned int width) -> std::string {
+        std::string output {};
+        HW::wordWrap(output, txt.data(), txt.size(), width, "  ");
+        return output;
+    };
+
+    SECTION("it wraps the words to the width") {
+        REQUIRE(wrap("aaa bbb ccc", 7) == "aaa bbb\n  ccc");
+        REQUIRE(wrap("aaa bbb ccc", 11) == "aaa bbb ccc");
+        REQUIRE(wrap("a verylongword b", 4) == "a\n  verylongword\n  b");
+    }
+
+    SECTION("it collapses spaces and tabs and keeps the line breaks") {
+        REQUIRE(wrap("  a  \t b\t", 10) == "a b");
+        REQUIRE(wrap("first\nsecond\n", 20) == "first\n  second");
+        REQUIRE(wrap("first\r\n\r\nsecond", 20) == "first\n\n  second");
+    }
+
+    SECTION("it measures the display width of UTF-8 text") {
+        // 11 columns, 13 bytes
+        REQUIRE(wrap("h\xC3\xA9llo w\xC3\xB6rld", 11) == "h\xC3\xA9llo w\xC3\xB6rld");
+        // e followed by a combining acute accent takes one column
+        REQUIRE(wrap("cafe\xCC\x81 noir", 9) == "cafe\xCC\x81 noir");
+        // Wide characters take two columns each
+        std::string wide { "\xE6\x97\xA5\xE6\x9C\xAC \xE8\xAA\x9E" };
+        REQUIRE(wrap(wide, 7) == wide);
+        REQUIRE(wrap(wide, 6) == "\xE6\x97\xA5\xE6\x9C\xAC\n  \xE8\xAA\x9E");
+        // Past the ASCII blocks scanned 16 bytes at a time
+        std::string long_word { "abcdefghijklmnopqrstuvwxyz" };
+        REQUIRE(wrap(long_word + " \xC3\xA9", 28) == long_word + " \xC3\xA9");
+        REQUIRE(wrap(long_word + " \xC3\xA9", 27) == long_word + "\n  \xC3\xA9");
+        // Invalid sequences take one column per byte
+        REQUIRE(wrap("\xFF\xFE x", 4) == "\xFF\xFE x");
+    }
+}
+
+TEST_CASE("HorseWhisperer::SetActionForked", "[fork]") {
+    auto run = [&](std::vector<const char*> args, std::string& output,
+                   unsigned int max_processes) -> int {
+        HW::Reset();
+        prepareGlobal();
+        HW::DefineAction("step", 1, true, "test-action", "no help",
+                         [](std::vector<std::string> args) -> int {
+                            auto begin = std::chrono::steady_clock::now();
+                            // The first steps complete last
+                            std::this_thread::sleep_for(std::chrono::milliseconds {
+                                100 - 20 * std::stoi(args[0]) });
+                            std::cout << "step " << args[0] << " in " << getpid()
+                                      << std::endl;
+                            auto end = std::chrono::steady_clock::now();
+                            HW::SetActionResult(
+                                std::to_string(begin.time_since_epoch().count()) + " "
+                                + std::to_string(end.time_since_epoch().count()));
+                            return args[0] == "3" ? 3 : EXIT_SUCCESS;
+                         });
+        HW::DefineAction("crash", 0, true, "test-action", "no help",
+                         [](std::vector<std::string>) -> int {
+                            std::cout << "about to crash" << std::endl;
+                            // Not reported by Catch
+                            signal(SIGABRT, SIG_DFL);
+                            std::abort();
+                         });
+        HW::DefineAction("local", 0, true, "test-action", "no help",
+                         [](std::vector<std::string>) -> int {
+                            HW::SetActionResult("local result");
+                            return EXIT_SUCCESS;
+                         });
+        HW::SetActionForked("step");
+        HW::SetActionForked("crash");
+        HW::SetMaxForkedActions(max_processes);
+        std::ostringstream stream {};
+        auto original = std::cout.rdbuf(stream.rdbuf());
+        args.push_back(nullptr);
+        HW::Parse(args.size() - 1, const_cast<char**>(args.data()));
+        auto result = HW::Start();
+        std::cout.rdbuf(original);
+        output = stream.str();
+        return result;
+    };
+    auto pid = std::to_string(getpid());
+    std::string output {};
+
+    SECTION("the output is replayed in chain order") {
+        REQUIRE(run({ "test-app", "step", "0", "step", "1", "step", "2", "local" },
+                    output, 0) == EXIT_SUCCESS);
+        REQUIRE(output.find("step 0") < output.find("step 1"));
+        REQUIRE(output.find("step 1") < output.find("step 2"));
+        REQUIRE(output.find(" in " + pid + "\n") == std::string::npos);
+
+        auto results = HW::GetActionResults();
+        REQUIRE(results.size() == 4);
+        REQUIRE(results[0].action == "step");
+        REQUIRE(results[0].exit_code == EXIT_SUCCESS);
+        REQUIRE(results[0].result.find(' ') != std::string::npos);
+        REQUIRE(results[3].action == "local");
+        REQUIRE(results[3].result == "local result");
+        REQUIRE(HW::GetActionResources().size() == 4);
+    }
+
+    SECTION("the chain fails with the first failure of the batch") {
+        REQUIRE(run({ "test-app", "step", "3", "crash", "step", "0", "local" },
+                    output, 0) == 3);
+        REQUIRE(output.find("about to crash") != std::string::npos);
+        REQUIRE(output.find("Forked action 'crash' was terminated by signal "
+                            + std::to_string(SIGABRT)) != std::string::npos);
+        REQUIRE(output.find("step 0") != std::string::npos);
+        REQUIRE(output.find("Not starting action 'local'") != std::string::npos);
+
+        auto results = HW::GetActionResults();
+        REQUIRE(results.size() == 3);
+        REQUIRE(results[0].exit_code == 3);
+        REQUIRE(results[1].exit_code == 128 + SIGABRT);
+        REQUIRE(results[2].exit_code == EXIT_SUCCESS);
+    }
+
+    SECTION("the number of concurrent children is limited") {
+        REQUIRE(run({ "test-app", "step", "0", "step", "1", "step", "2" }, output, 1)
+                == EXIT_SUCCESS);
+
+        auto results = HW::GetActionResults();
+        REQUIRE(results.size() == 3);
+        long long previous_end { 0 };
+        for (const auto& result : results) {
+            std::istringstream times { result.result };
+            long long begin, end;
+            times >> begin >> end;
+            REQUIRE(begin >= previous_end);
+            previous_end = end;
+        }
+    }
+}
+
+TEST_CASE("HorseWhisperer::SetActionPerArgument", "[per-argument]") {
+    std::mutex mutex {};
+    std::vector<std::string> checked {};
+    std::set<std::thread::id> threads {};
+
+    auto run = [&](std::vector<const char*> args, HW::ExitCodePolicy policy) -> int {
+        HW::Reset();
+        prepareGlobal();
+        checked.clear();
+        threads.clear();
+        HW::DefineAction("check", 1, false, "test-action", "no help",
+                         [&](std::vector<std::string> hosts) -> int {
+                            std::this_thread::sleep_for(std::chrono::milliseconds { 5 });
+                            std::lock_guard<std::mutex> lock { mutex };
+                            checked.insert(checked.end(), hosts.begin(), hosts.end());
+                            threads.insert(std::this_thread::get_id());
+                            if (hosts.size() != 1 || hosts[0] == "bad") {
+                                return 2;
+                            }
+                            if (hosts[0] == "negative") {
+                                return -1;
+                            }
+                            return hosts[0] == "worse" ? 5 : EXIT_SUCCESS;
+                         }, nullptr, true);
+        HW::SetActionPerArgument("check", policy);
+        args.push_back(nullptr);
+        HW::Parse(args.size() - 1, const_cast<char**>(args.data()));
+        return HW::Start();
+    };
+
+    std::vector<const char*> args { "test-app", "check", "-j", "4" };
+    std::vector<std::string> hosts {};
+    for (int idx = 0; idx < 64; idx++) {
+        hosts.push_back("host" + std::to_string(idx));
+    }
+    for (const auto& host : hosts) {
+        args.push_back(host.c_str());
+    }
+
+    SECTION("the callback is invoked once per argument on the workers") {
+        REQUIRE(run(args, HW::ExitCodePolicy::FirstFailure) == EXIT_SUCCESS);
+        std::sort(checked.begin(), checked.end());
+        std::sort(hosts.begin(), hosts.end());
+        REQUIRE(checked == hosts);
+        REQUIRE(threads.size() > 1);
+    }
+
+    SECTION("the worst code is returned with the WorstCode policy") {
+        args.push_back("bad");
+        args.push_back("worse");
+        REQUIRE(run(args, HW::ExitCodePolicy::WorstCode) == 5);
+        REQUIRE(checked.size() == hosts.size() + 2);
+    }
+
+    SECTION("a negative code isn't hidden by successes with the WorstCode policy") {
+        args.push_back("negative");
+        REQUIRE(run(args, HW::ExitCodePolicy::WorstCode) == -1);
+
+        args.push_back("bad");
+        REQUIRE(run(args, HW::ExitCodePolicy::WorstCode) == 2);
+    }
+
+    SECTION("the first failure is returned with the FirstFailure policy") {
+        args.insert(args.begin() + 4, "bad");
+        REQUIRE(run(args, HW::ExitCodePolicy::FirstFailure) == 2);
+        REQUIRE(checked.size() <= hosts.size() + 1);
+
+        // One worker runs the arguments in order, stopping at the failure
+        args[3] = "1";
+        REQUIRE(run(args, HW::ExitCodePolicy::FirstFailure) == 2);
+        REQUIRE(checked == std::vector<std::string> { "bad" });
+    }
+
+    SECTION("a single argument is passed as is") {
+        REQUIRE(run({ "test-app", "check", "worse" }, HW::ExitCodePolicy::WorstCode) == 5);
+        REQUIRE(threads.size() == 1);
+        REQUIRE(*threads.begin() == std::this_thread::get_id());
+    }
+}
+
+TEST_CASE("HorseWhisperer::SetOutputMode", "[output]") {
+    std::string output {};
+    std::ostringstream stream {};
+    // What reached the stream once the wave action flushed its line
+    std::string flushed {};
+    auto run = [&](std::vector<const char*> args, HW::OutputMode mode, bool capture) -> int {
+        HW::Reset();
+        prepareGlobal();
+        HW::DefineAction("greet", 1, true, "test-action", "no help",
+                         [](std::vector<std::string> names) -> int {
+                            for (const auto& name : names) {
+                                // The first names complete last
+                                std::this_thread::sleep_for(std::chrono::milliseconds {
+                                    40 - 10 * (name.back() - '0') });
+                                std::cout << "hello\n" << name << std::endl;
+                            }
+                            return EXIT_SUCCESS;
+                         }, nullptr, true);
+        HW::DefineAction("wave", 0, true, "test-action", "no help",
+                         [&](std::vector<std::string>) -> int {
+                            std::cout << "wave" << std::endl;
+                            flushed = stream.str();
+                            return EXIT_SUCCESS;
+                         });
+        HW::SetActionPerArgument("greet");
+        HW::SetDelimiters({ "+" });
+        HW::SetOutputMode(mode);
+        HW::SetOutputCapture(capture);
+        stream.str("");
+        flushed.clear();
+        auto original = std::cout.rdbuf(stream.rdbuf());
+        args.push_back(nullptr);
+        HW::Parse(args.size() - 1, const_cast<char**>(args.data()));
+        auto result = HW::Start();
+        std::cout.rdbuf(original);
+        output = stream.str();
+        return result;
+    };
+
+    SECTION("concurrent invocations are written in argument order") {
+        REQUIRE(run({ "test-app", "greet", "p0", "p1", "p2", "p3", "-j", "4" },
+                    HW::OutputMode::Ordered, false) == EXIT_SUCCESS);
+        REQUIRE(output == "hello\np0\nhello\np1\nhello\np2\nhello\np3\n");
+    }
+
+    SECTION("flushed output is written right away by default") {
+        REQUIRE(run({ "test-app", "wave", "+", "greet", "p1" },
+                    HW::OutputMode::Ordered, false) == EXIT_SUCCESS);
+        REQUIRE(flushed == "wave\n");
+        REQUIRE(output == "wave\nhello\np1\n");
+    }
+
+    SECTION("buffered output is written in blocks, ignoring the flushes") {
+        REQUIRE(run({ "test-app", "wave", "+", "greet", "p1", "p0" },
+                    HW::OutputMode::Buffered, false) == EXIT_SUCCESS);
+        REQUIRE(flushed.empty());
+        REQUIRE(output == "wave\nhello\np1\nhello\np0\n");
+    }
+
+    SECTION("live lines are prefixed by their argument") {
+        REQUIRE(run({ "test-app", "greet", "p0", "p1", "-j", "2" },
+                    HW::OutputMode::Live, false) == EXIT_SUCCESS);
+        REQUIRE(output.size() == std::string { "p0: hello\np0: p0\np1: hello\np1: p1\n" }.size());
+        REQUIRE(output.find("p0: hello\n") != std::string::npos);
+        REQUIRE(output.find("p1: p1\n") != std::string::npos);
+    }
+
+    SECTION("the output of each action can be captured") {
+        REQUIRE(run({ "test-app", "wave", "+", "greet", "p1", "p2" },
+                    HW::OutputMode::Ordered, true) == EXIT_SUCCESS);
+        REQUIRE(output.empty());
+        auto results = HW::GetActionResults();
+        REQUIRE(results.size() == 2);
+        REQUIRE(results[0].output == "wave\n");
+        REQUIRE(results[1].output == "hello\np1\nhello\np2\n");
+    }
+}
@@ -0,0 +1,160 @@
+#include <horsewhisperer/server.h>
+#include "../test.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <sstream>
+
+namespace HW = HorseWhisperer;
+
+// Forks a process serving the test actions on the specified socket
+static pid_t startServer(const std::string& socket_path) {
+    auto pid = fork();
+    if (pid == 0) {
+        // Catch's fatal signal handlers must not run in the server processes
+        signal(SIGABRT, SIG_DFL);
+        HW::Reset();
+        HW::SetAppName("server-test");
+        HW::DefineGlobalFlag<std::string>("greeting", "a greeting", "hello", nullptr);
+        HW::DefineAction("greet", 1, false, "greets", "no help",
+                         [](std::vector<std::string> args) -> int {
+                            std::cout << HW::GetFlag<std::string>("greeting") << " "
+                                      << args[0] << " from "
+                                      << std::getenv("SERVER_TEST_VAR") << std::endl;
+                            return 7;
+                         });
+        HW::DefineAction("crash", 0, false, "crashes", "no help",
+                         [](std::vector<std::string>) -> int {
+                            std::abort();
+                         });
+        _exit(HW::Serve(socket_path, 2));
+    }
+
+    // Wait for the socket
+    for (int attempt = 0; attempt < 500 && access(socket_path.c_str(), F_OK) != 0;
+            attempt++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return pid;
+}
+
+// Forward the command line, capturing the stdout of the command
+static int forward(const std::string& socket_path, std::vector<const char*> args,
+                   std::string& output) {
+    char output_template[] = "/tmp/hw-server-output-XXXXXX";
+    int output_fd = mkstemp(output_template);
+    int saved_stdout = dup(STDOUT_FILENO);
+    std::cout.flush();
+    dup2(output_fd, STDOUT_FILENO);
+
+    args.push_back(nullptr);
+    auto exit_code = HW::ForwardToServer(socket_path, static_cast<int>(args.size()) - 1,
+                                         const_cast<char**>(args.data()));
+
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    close(output_fd);
+
+    std::ifstream file { output_template };
+    std::stringstream content {};
+    content << file.rdbuf();
+    output = content.str();
+    unlink(output_template);
+    return exit_code;
+}
+
+TEST_CASE("HorseWhisperer::Serve", "[server]") {
+    char socket_dir_template[] = "/tmp/hw-server-test-XXXXXX";
+    std::string socket_path { std::string { mkdtemp(socket_dir_template) } + "/hw.sock" };
+    std::string output {};
+
+    SECTION("ForwardToServer returns -1 when no server is listening") {
+        REQUIRE(forward(socket_path, { "server-test", "greet", "x" }, output) == -1);
+    }
+
+    SECTION("the server runs the forwarded command lines") {
+        auto server_pid = startServer(socket_path);
+        setenv("SERVER_TEST_VAR", "the client", 1);
+
+        // More requests than workers
+        for (int idx = 0; idx < 5; idx++) {
+            auto name = "pony-" + std::to_string(idx);
+            REQUIRE(forward(socket_path, { "server-test", "greet", name.c_str(),
+                                           "--greeting", "hi" }, output) == 7);
+            REQUIRE(output == "hi " + name + " from the client\n");
+        }
+
+        SECTION("it reports parse failures") {
+            REQUIRE(forward(socket_path, { "server-test", "greet" }, output)
+                    == EXIT_FAILURE);
+            REQUIRE(output.find("Failed to parse the command line input.\n")
+                    != std::string::npos);
+        }
+
+        SECTION("only the owner can access the socket") {
+            struct stat socket_stat;
+            REQUIRE(stat(socket_path.c_str(), &socket_stat) == 0);
+            REQUIRE((socket_stat.st_mode & 0777) == 0600);
+        }
+
+        SECTION("a malformed request is rejected without redirecting stdio") {
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un address {};
+            address.sun_family = AF_UNIX;
+            std::strncpy(address.sun_path, socket_path.c_str(),
+                         sizeof(address.sun_path) - 1);
+            REQUIRE(connect(fd, reinterpret_cast<sockaddr*>(&address),
+                            sizeof(address)) == 0);
+
+            int output_pipe[2];
+            REQUIRE(pipe(output_pipe) == 0);
+            uint32_t header[4] = { 0xdeadbeef, 1, 0, 0 };
+            int fds[3] = { output_pipe[1], output_pipe[1], output_pipe[1] };
+            char control[CMSG_SPACE(sizeof(fds))] {};
+            iovec io { header, sizeof(header) };
+            msghdr message {};
+            message.msg_iov = &io;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            auto cmsg = CMSG_FIRSTHDR(&message);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+            std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+            REQUIRE(sendmsg(fd, &message, 0) == sizeof(header));
+            close(output_pipe[1]);
+
+            int32_t exit_code { 0 };
+            REQUIRE(read(fd, &exit_code, sizeof(exit_code)) == sizeof(exit_code));
+            REQUIRE(exit_code == EXIT_FAILURE);
+            close(fd);
+
+            // The worker didn't write to the received descriptors
+            char byte;
+            REQUIRE(read(output_pipe[0], &byte, 1) == 0);
+            close(output_pipe[0]);
+
+            REQUIRE(forward(socket_path, { "server-test", "greet", "again" }, output)
+                    == 7);
+        }
+
+        SECTION("a crashed worker fails the command and is replaced") {
+            REQUIRE(forward(socket_path, { "server-test", "crash" }, output)
+                    == EXIT_FAILURE);
+            REQUIRE(forward(socket_path, { "server-test", "greet", "again" }, output)
+                    == 7);
+        }
+
+        kill(server_pid, SIGTERM);
+        int status;
+        REQUIRE(waitpid(server_pid, &status, 0) == server_pid);
+        REQUIRE(WIFEXITED(status));
+        REQUIRE(WEXITSTATUS(status) == EXIT_SUCCESS);
+        REQUIRE(access(socket_path.c_str(), F_OK) != 0);
+    }
+
+    unsetenv("SERVER_TEST_VAR");
+    rmdir(socket_path.substr(0, socket_path.rfind('/')).c_str());
+}